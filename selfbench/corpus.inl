@@ -0,0 +1,12 @@
+// A thousand trivial tests in group Unit<SELFBENCH_UNIT>, every generated unit includes this once
+#include "simpletest.h"
+
+#define SELFBENCH_TEST(name) DEFINE_TEST_G(name, TOK(Unit, SELFBENCH_UNIT)) { TEST_EQ(1, 1); }
+#define SELFBENCH_10(prefix) SELFBENCH_TEST(TOK(prefix, 0)) SELFBENCH_TEST(TOK(prefix, 1)) SELFBENCH_TEST(TOK(prefix, 2)) SELFBENCH_TEST(TOK(prefix, 3)) SELFBENCH_TEST(TOK(prefix, 4)) \
+	SELFBENCH_TEST(TOK(prefix, 5)) SELFBENCH_TEST(TOK(prefix, 6)) SELFBENCH_TEST(TOK(prefix, 7)) SELFBENCH_TEST(TOK(prefix, 8)) SELFBENCH_TEST(TOK(prefix, 9))
+#define SELFBENCH_100(prefix) SELFBENCH_10(TOK(prefix, 0)) SELFBENCH_10(TOK(prefix, 1)) SELFBENCH_10(TOK(prefix, 2)) SELFBENCH_10(TOK(prefix, 3)) SELFBENCH_10(TOK(prefix, 4)) \
+	SELFBENCH_10(TOK(prefix, 5)) SELFBENCH_10(TOK(prefix, 6)) SELFBENCH_10(TOK(prefix, 7)) SELFBENCH_10(TOK(prefix, 8)) SELFBENCH_10(TOK(prefix, 9))
+#define SELFBENCH_1000(prefix) SELFBENCH_100(TOK(prefix, 0)) SELFBENCH_100(TOK(prefix, 1)) SELFBENCH_100(TOK(prefix, 2)) SELFBENCH_100(TOK(prefix, 3)) SELFBENCH_100(TOK(prefix, 4)) \
+	SELFBENCH_100(TOK(prefix, 5)) SELFBENCH_100(TOK(prefix, 6)) SELFBENCH_100(TOK(prefix, 7)) SELFBENCH_100(TOK(prefix, 8)) SELFBENCH_100(TOK(prefix, 9))
+
+SELFBENCH_1000(Test)
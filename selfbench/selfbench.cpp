@@ -0,0 +1,311 @@
+#include "simpletest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#elif defined(_WIN32)
+#define popen _popen
+#define pclose _pclose
+#endif
+
+//---------------------------------------------------------------------------------
+// Measures simpletest's own hot paths and writes them as JSON. Every metric is a
+// cost, lower is better, so a later run can be compared against an earlier one
+// to catch framework changes that add overhead.
+//---------------------------------------------------------------------------------
+#if !defined(SELFBENCH_TESTS)
+#define SELFBENCH_TESTS 0 // size of the generated corpus, set by CMake
+#endif
+#if !defined(SELFBENCH_LAZY)
+#define SELFBENCH_LAZY 0
+#endif
+
+// Timings are the best of this many repetitions, anything slower is noise
+static int const locRepeats = 5;
+
+// Fraction worse a metric can get before it's a regression, unless --threshold
+// sets one for all of them. Timings spread more than sizes, runs more than loops.
+static double const locHotPathThreshold = 0.15;
+static double const locRunThreshold = 0.25;
+static double const locSizeThreshold = 0.05;
+
+struct Metric
+{
+	char const* name;
+	double value;
+	double threshold;
+};
+
+static Metric locMetrics[32];
+static int locNumMetrics;
+static volatile unsigned locSink;
+
+static void locRecord(char const* name, double value, double threshold)
+{
+	locMetrics[locNumMetrics].name = name;
+	locMetrics[locNumMetrics].value = value;
+	locMetrics[locNumMetrics].threshold = threshold;
+	++locNumMetrics;
+}
+
+static double locSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename Body>
+static double locBestSeconds(Body body)
+{
+	double best = 1e30;
+	for (int repeat = 0; repeat < locRepeats; ++repeat)
+	{
+		auto start = std::chrono::steady_clock::now();
+		body();
+		double seconds = locSince(start);
+		best = seconds < best ? seconds : best;
+	}
+	return best;
+}
+
+template <typename Body>
+static double locBestNanoseconds(int iterations, Body body)
+{
+	return locBestSeconds([&] { body(iterations); }) * 1e9 / iterations;
+}
+
+//---------------------------------------------------------------------------------
+// Hot paths, measured inside real tests so assertions go through the same current
+// test lookup as anywhere else
+//---------------------------------------------------------------------------------
+static int const locIterations = 1 << 22;
+
+DEFINE_TEST_G(AssertPass, Selfbench)
+{
+	int const mask = int(locSink | 0xffff);
+	locRecord("assert_pass_ns", locBestNanoseconds(locIterations, [&](int iterations)
+	{
+		for (int i = 0; i < iterations; ++i)
+			TEST_EQ(i & mask, i & 0xffff);
+	}), locHotPathThreshold);
+}
+
+DEFINE_TEST_G(StringEqual, Selfbench)
+{
+	char left[65], right[65];
+	for (int i = 0; i < 64; ++i)
+		left[i] = right[i] = char('a' + (i + int(locSink)) % 26);
+	left[64] = right[64] = 0;
+
+	locRecord("string_equal_64_ns", locBestNanoseconds(locIterations / 16, [&](int iterations)
+	{
+		for (int i = 0; i < iterations; ++i)
+			TEST_STR_EQ(left, right);
+	}), locHotPathThreshold);
+}
+
+// Fails on purpose, messages are released every so often so they keep being formatted and stored
+DEFINE_TEST_G(FailureStorm, Selfbench)
+{
+	TestFixture* fixture = test_scope_.Fixture();
+	locRecord("assert_fail_logged_ns", locBestNanoseconds(locIterations / 64, [&](int iterations)
+	{
+		for (int i = 0; i < iterations; ++i)
+		{
+			TEST_EQ(i, i + 1);
+			if ((i & 31) == 31)
+				fixture->ReleaseErrors();
+		}
+	}), locHotPathThreshold);
+	fixture->ReleaseErrors();
+}
+
+DEFINE_TEST_G(TypeToString, Selfbench)
+{
+	locRecord("type_to_string_int_ns", locBestNanoseconds(locIterations / 16, [&](int iterations)
+	{
+		unsigned length = 0;
+		for (int i = 0; i < iterations; ++i)
+			length += unsigned(strlen(*TypeToString(i * 7919)));
+		locSink = locSink + length;
+	}), locHotPathThreshold);
+	locRecord("type_to_string_double_ns", locBestNanoseconds(locIterations / 64, [&](int iterations)
+	{
+		unsigned length = 0;
+		for (int i = 0; i < iterations; ++i)
+			length += unsigned(strlen(*TypeToString(double(i) * 0.37)));
+		locSink = locSink + length;
+	}), locHotPathThreshold);
+}
+
+//---------------------------------------------------------------------------------
+// Comparing against a previous result, it only needs to read what Write writes
+//---------------------------------------------------------------------------------
+static bool locFindMetric(char const* json, char const* name, double& value)
+{
+	char key[64];
+	snprintf(key, sizeof(key), "\"%s\":", name);
+	char const* found = strstr(json, key);
+	if (found == nullptr)
+		return false;
+	value = strtod(found + strlen(key), nullptr);
+	return true;
+}
+
+// A negative threshold uses each metric's own
+static int locCompare(char const* path, double threshold)
+{
+	static char json[16384];
+	FILE* file = fopen(path, "rb");
+	if (file == nullptr)
+	{
+		printf("Failed to open baseline '%s'.\n", path);
+		return 2;
+	}
+	json[fread(json, 1, sizeof(json) - 1, file)] = 0;
+	fclose(file);
+
+	int regressions = 0;
+	for (int i = 0; i < locNumMetrics; ++i)
+	{
+		double before;
+		if (!locFindMetric(json, locMetrics[i].name, before) || before <= 0)
+			continue;
+
+		double allowed = threshold < 0 ? locMetrics[i].threshold : threshold;
+		double change = locMetrics[i].value / before - 1;
+		bool regressed = change > allowed;
+		regressions += regressed;
+		printf("%-30s %12.4g -> %12.4g %+7.1f%% (limit %+.0f%%)%s\n", locMetrics[i].name, before, locMetrics[i].value, change * 100, allowed * 100, regressed ? "  REGRESSION" : "");
+	}
+
+	if (regressions)
+		printf("%d of %d metrics got slower or bigger by more than their limit.\n", regressions, locNumMetrics);
+	return regressions ? 1 : 0;
+}
+
+static void locWrite(FILE* file)
+{
+	fprintf(file, "{\n  \"tests\": %d,\n  \"lazy\": %s,\n  \"metrics\": {\n", SELFBENCH_TESTS, SELFBENCH_LAZY ? "true" : "false");
+	for (int i = 0; i < locNumMetrics; ++i)
+		fprintf(file, "    \"%s\": %.6g%s\n", locMetrics[i].name, locMetrics[i].value, i + 1 < locNumMetrics ? "," : "");
+	fprintf(file, "  }\n}\n");
+}
+
+//---------------------------------------------------------------------------------
+// The first run in a process builds the index and constructs lazy tests, and
+// startup only happens once, so they're measured again in fresh copies of
+// selfbench that print both and exit, keeping the best of every process.
+//---------------------------------------------------------------------------------
+static double locFirstRun()
+{
+	TestFixture::ExecuteOptions corpus("Unit*", nullptr, TestFixture::Silent);
+	auto start = std::chrono::steady_clock::now();
+	TestFixture::ExecuteAllTests(corpus);
+	return locSince(start);
+}
+
+static void locBestOfProcesses(char const* self, double& startup, double& firstRun)
+{
+	char command[1024];
+	snprintf(command, sizeof(command), "\"%s\" --first-run", self);
+	for (int repeat = 1; repeat < locRepeats; ++repeat)
+	{
+		FILE* child = popen(command, "r");
+		if (child == nullptr)
+			return;
+
+		double childStartup, childFirstRun;
+		bool read = fscanf(child, "%lf %lf", &childStartup, &childFirstRun) == 2;
+		if (pclose(child) != 0 || !read)
+			return;
+		startup = childStartup < startup ? childStartup : startup;
+		firstRun = childFirstRun < firstRun ? childFirstRun : firstRun;
+	}
+}
+
+//---------------------------------------------------------------------------------
+// selfbench [--json <file>] [--compare <file>] [--threshold <fraction>]
+//---------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	// everything before main, mostly constructing and registering the corpus
+	double startup = double(clock()) / CLOCKS_PER_SEC;
+
+	if (argc == 2 && strcmp(argv[1], "--first-run") == 0)
+	{
+		double firstRun = SELFBENCH_TESTS ? locFirstRun() : 0;
+		printf("%.9g %.9g\n", startup, firstRun);
+		return 0;
+	}
+
+	char const* jsonFile = nullptr;
+	char const* compareFile = nullptr;
+	double threshold = -1;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+			jsonFile = argv[++i];
+		else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc)
+			compareFile = argv[++i];
+		else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+			threshold = atof(argv[++i]);
+		else
+		{
+			printf("Usage: %s [--json <file>] [--compare <file>] [--threshold <fraction>]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	double firstRun = SELFBENCH_TESTS ? locFirstRun() : 0;
+	locBestOfProcesses(argv[0], startup, firstRun);
+	locRecord("startup_seconds", startup, locRunThreshold);
+	TestFixture::ExecuteAllTests("Selfbench", nullptr, TestFixture::Silent);
+
+	if (SELFBENCH_TESTS)
+	{
+		locRecord("first_run_ns_per_test", firstRun * 1e9 / SELFBENCH_TESTS, locRunThreshold);
+
+		TestFixture::ExecuteOptions corpus("Unit*", nullptr, TestFixture::Silent);
+		locRecord("dispatch_ns_per_test", locBestSeconds([&] { TestFixture::ExecuteAllTests(corpus); }) * 1e9 / SELFBENCH_TESTS, locRunThreshold);
+
+		TestFixture::ExecuteOptions parallel("Unit*", nullptr, TestFixture::Silent, 0);
+		locRecord("parallel_dispatch_ns_per_test", locBestSeconds([&] { TestFixture::ExecuteAllTests(parallel); }) * 1e9 / SELFBENCH_TESTS, locRunThreshold);
+
+		// picking one test out of all of them goes through the index
+		TestFixture::ExecuteOptions one("Unit1", "Test500", TestFixture::Silent);
+		locRecord("select_one_us", locBestSeconds([&]
+		{
+			for (int i = 0; i < 1000; ++i)
+				TestFixture::ExecuteAllTests(one);
+		}) * 1e6 / 1000, locRunThreshold);
+	}
+
+	locRecord("fixture_bytes", double(sizeof(TestFixture)), 0);
+#if defined(__unix__) || defined(__APPLE__)
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+	locRecord("max_rss_kb", double(usage.ru_maxrss) / 1024, locSizeThreshold);
+#else
+	locRecord("max_rss_kb", double(usage.ru_maxrss), locSizeThreshold);
+#endif
+#endif
+
+	locWrite(stdout);
+	if (jsonFile)
+	{
+		FILE* file = fopen(jsonFile, "w");
+		if (file == nullptr)
+		{
+			printf("Failed to open '%s'.\n", jsonFile);
+			return 2;
+		}
+		locWrite(file);
+		fclose(file);
+	}
+
+	return compareFile ? locCompare(compareFile, threshold) : 0;
+}
@@ -1,19 +1,200 @@
 #include "simpletest.h"
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <cstdint>
 #include <stdarg.h>
-#include <time.h>
+#include <stddef.h>
+#include <math.h>
+#include <chrono>
+#include <thread>
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <unistd.h>
+#define TEST_SIGNALS 1
+#if PROCESS_POOL || RUN_HISTORY
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if PROCESS_POOL
+#include <sys/wait.h>
+#define TEST_PROCESS_POOL 1
+#endif
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define TEST_BACKTRACE 1
+#endif
+#elif defined(_WIN32)
+#if !defined(WIN32_LEAN_AND_MEAN)
+#define WIN32_LEAN_AND_MEAN
+#endif
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+#if defined(BENCHMARK_USE_TSC) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define TEST_TSC_CLOCK 1
+#elif defined(BENCHMARK_USE_TSC) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define TEST_TSC_CLOCK 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TEST_SSE2 1
+#endif
+#if TEST_SSE2 && (defined(__AVX2__) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))))
+#include <immintrin.h>
+#define TEST_AVX2 1
+#endif
 
 //---------------------------------------------------------------------------------
 // statics
 //---------------------------------------------------------------------------------
-void DefaultPrint(char const* string) { printf("%s", string); }
+//---------------------------------------------------------------------------------
+// Framework locks. The watchdog parks a hung thread wherever it is, and one
+// parked while holding a lock of the framework would block every other thread
+// for good, so parking waits until the thread has let go of its last one.
+// Add ons hold a TestFrameworkScope around locks of their own.
+//---------------------------------------------------------------------------------
+static thread_local int locFrameworkDepth;
+static thread_local volatile int locParkPending;
+#if TEST_SIGNALS
+static void locParkThread(int);
+#endif
+
+static void locEnterFramework()
+{
+	++locFrameworkDepth;
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+static void locLeaveFramework()
+{
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+	if (--locFrameworkDepth == 0 && locParkPending)
+	{
+#if TEST_SIGNALS
+		locParkThread(0);
+#endif
+	}
+}
+TestFrameworkScope::TestFrameworkScope() { locEnterFramework(); }
+TestFrameworkScope::~TestFrameworkScope() { locLeaveFramework(); }
+
+// stdio locks the stream while printing
+void DefaultPrint(char const* string) { TestFrameworkScope scope; printf("%s", string); }
 
 TestFixture* TestFixture::ourFirstTest;
 TestFixture* TestFixture::ourLastTest;
+bool TestFixture::ourIndexDirty;
 thread_local TestFixture* TestFixture::ourCurrentTest;
+thread_local bool TestFixture::ourSkipRegistration;
+int TestFixture::ourMaxLoggedFailures;
+int TestFixture::ourNumSamples = 1;
+int TestFixture::ourConcurrency = 1;
+TestFixture::OutputMode TestFixture::ourOutput = TestFixture::Normal;
 void (*TestFixture::Print)(char const* string) = DefaultPrint;
+void const volatile* volatile ourBenchmarkSink;
+
+struct TestSpinLock
+{
+	void Lock() { locEnterFramework(); while (myLock.test_and_set(std::memory_order_acquire)) std::this_thread::yield(); }
+	void Unlock() { myLock.clear(std::memory_order_release); locLeaveFramework(); }
+
+	std::atomic_flag myLock = ATOMIC_FLAG_INIT;
+};
+
+//---------------------------------------------------------------------------------
+// Shared error arena. Chunks are handed out from the top of the arena the first
+// time they're needed and recycled through a free list afterwards, so pages
+// are only touched once something actually fails. A message longer than a chunk
+// claims a run of consecutive chunks, from the top while there's room or else
+// from neighbours on the free list, and runs go back as single chunks.
+//---------------------------------------------------------------------------------
+static_assert(ERROR_CHUNK_SIZE > sizeof(TestErrorChunk) + sizeof(TestError) + 64, "ERROR_CHUNK_SIZE is too small to hold any messages");
+
+alignas(TestError) static char locErrorArena[ERROR_ARENA_SIZE];
+static size_t locErrorArenaTop;
+static TestErrorChunk* locFreeErrorChunks;
+static TestSpinLock locErrorArenaLock;
+
+// Only runs for long messages once the top is used up, the free list is at most a few hundred chunks
+static TestErrorChunk* locClaimFreeRun(size_t count)
+{
+	size_t const runSize = count * ERROR_CHUNK_SIZE;
+	for (TestErrorChunk* start = locFreeErrorChunks; start; start = start->next)
+	{
+		char* begin = (char*)start;
+		size_t numFree = 0;
+		for (TestErrorChunk* i = locFreeErrorChunks; i; i = i->next)
+			numFree += (char*)i >= begin && (char*)i < begin + runSize;
+
+		if (numFree < count)
+			continue;
+
+		for (TestErrorChunk** i = &locFreeErrorChunks; *i;)
+		{
+			if ((char*)*i >= begin && (char*)*i < begin + runSize)
+				*i = (*i)->next;
+			else
+				i = &(*i)->next;
+		}
+		return start;
+	}
+	return nullptr;
+}
+static TestErrorChunk* locClaimErrorChunks(size_t count)
+{
+	locErrorArenaLock.Lock();
+	TestErrorChunk* chunk = nullptr;
+	if (count == 1 && locFreeErrorChunks)
+	{
+		chunk = locFreeErrorChunks;
+		locFreeErrorChunks = chunk->next;
+	}
+	else if (locErrorArenaTop + count * ERROR_CHUNK_SIZE <= ERROR_ARENA_SIZE)
+	{
+		chunk = (TestErrorChunk*)(locErrorArena + locErrorArenaTop);
+		locErrorArenaTop += count * ERROR_CHUNK_SIZE;
+	}
+	else if (count > 1)
+	{
+		chunk = locClaimFreeRun(count);
+	}
+	locErrorArenaLock.Unlock();
+
+	if (chunk)
+		chunk->size = count * ERROR_CHUNK_SIZE;
+	return chunk;
+}
+static void locReleaseErrorChunks(TestErrorChunk* first)
+{
+	// split runs up again so any of their chunks can be claimed on its own
+	TestErrorChunk* last = first;
+	for (;;)
+	{
+		while (last->size > ERROR_CHUNK_SIZE)
+		{
+			TestErrorChunk* next = (TestErrorChunk*)((char*)last + ERROR_CHUNK_SIZE);
+			next->next = last->next;
+			next->size = last->size - ERROR_CHUNK_SIZE;
+			last->next = next;
+			last->size = ERROR_CHUNK_SIZE;
+			last = next;
+		}
+		if (last->next == nullptr)
+			break;
+		last = last->next;
+	}
+
+	locErrorArenaLock.Lock();
+	last->next = locFreeErrorChunks;
+	locFreeErrorChunks = first;
+	locErrorArenaLock.Unlock();
+}
 
 //---------------------------------------------------------------------------------
 // Standard type printers
@@ -126,13 +307,48 @@ TempString TypeToString(void const* value, char const* extra)
 //---------------------------------------------------------------------------------
 TestFixture::TestFixture()
 	: myNextTest(nullptr)
-	, myNextError(nullptr)
+	, myErrorChunks(nullptr)
+	, myFirstError(nullptr)
+	, myLastError(nullptr)
+	, myErrorWrite(nullptr)
+	, myErrorSpace(0)
+	, myNumDroppedMessages(0)
+	, myNumUnloggedFailures(0)
 	, myNumTestsChecked(0)
 	, myNumErrors(0)
 	, myPrintMethod(PrintDefault)
+	, myDuration(0)
+	, myDurationStddev(0)
+	, myNumSamples(0)
+	, myBaseline()
+	, myBenchmark(nullptr)
+	, myStress(nullptr)
+	, myName(nullptr)
+	, myGroup(nullptr)
+	, myOrder(0)
+	, mySelection(0)
+	, myNextInGroup(nullptr)
+	, myLastInGroup(nullptr)
+	, myNextGroup(nullptr)
+	, myNextGroupInBucket(nullptr)
+	, myNextNameInBucket(nullptr)
+	, myNextName(nullptr)
+	, myDescriptor(nullptr)
+	, myNextSelected(nullptr)
+	, myNextQueued(nullptr)
+	, myPrevQueued(nullptr)
+	, myShard(0)
+	, myHistory(-1)
+	, myTimeout(0)
+	, myFinished(false)
+	, myAbandoned(false)
 {
 	// global link list registration, add in order of discovery
-	if (ourFirstTest == nullptr)
+	if (ourSkipRegistration)
+	{
+		return;
+	}
+	else if (ourFirstTest == nullptr)
 	{
 		ourFirstTest = this;
 		ourLastTest = this;
@@ -142,250 +358,3680 @@ TestFixture::TestFixture()
 		ourLastTest->myNextTest = this;
 		ourLastTest = this;
 	}
+	ourIndexDirty = true;
+}
+//---------------------------------------------------------------------------------
+TestHook* TestHook::ourFirst;
+
+TestHook::TestHook()
+	: myNext(nullptr)
+{
+	TestHook** tail = &ourFirst;
+	while (*tail)
+		tail = &(*tail)->myNext;
+	*tail = this;
+}
+static void locBeginPhase(TestFixture& test, TestPhase phase)
+{
+	for (TestHook* i = TestHook::ourFirst; i; i = i->myNext)
+		i->BeginPhase(test, phase);
+}
+static void locEndPhase(TestFixture& test, TestPhase phase)
+{
+	for (TestHook* i = TestHook::ourFirst; i; i = i->myNext)
+		i->EndPhase(test, phase);
 }
 //---------------------------------------------------------------------------------
+static void locFormatTime(char* buffer, size_t size, double seconds);
+
 bool TestFixture::ExecuteTest()
 {
-	myNumTestsChecked = myNumErrors = 0;
-	myNextError = (TestError*)myMessageSpace;
+	// tests are only sampled more than once for baselines, benchmarks take their own samples
+	int samples = myBenchmark ? 1 : ourNumSamples;
+	double sum = 0;
+	double sumSquares = 0;
+	myNumSamples = 0;
 
 	TestFixture* lastCurrent = ourCurrentTest;
 	ourCurrentTest = this;
-	Setup();
-	RunTest();
-	TearDown();
+	do
+	{
+		myNumTestsChecked = myNumErrors = 0;
+		ReleaseErrors();
+
+		auto start = std::chrono::steady_clock::now();
+		if (TestHook::ourFirst)
+		{
+			locBeginPhase(*this, TestPhaseSetup);
+			Setup();
+			locEndPhase(*this, TestPhaseSetup);
+			locBeginPhase(*this, TestPhaseRunTest);
+			RunTest();
+			locEndPhase(*this, TestPhaseRunTest);
+			locBeginPhase(*this, TestPhaseTearDown);
+			TearDown();
+			locEndPhase(*this, TestPhaseTearDown);
+		}
+		else
+		{
+			Setup();
+			RunTest();
+			TearDown();
+		}
+		double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		sum += duration;
+		sumSquares += duration * duration;
+		++myNumSamples;
+	} while (myNumSamples < samples && myNumErrors == 0);
 	ourCurrentTest = lastCurrent;
 
+	myDuration = sum / myNumSamples;
+	double variance = myNumSamples > 1 ? (sumSquares - sum * myDuration) / (myNumSamples - 1) : 0;
+	myDurationStddev = variance > 0 ? sqrt(variance) : 0;
+
+	CheckBudget();
 	return myNumErrors == 0;
 }
+void TestFixture::CheckBudget()
+{
+	// the budget counts as one more check
+	double budget = Limits().budget;
+	if (budget > 0)
+		AddTest();
+	if (budget > 0 && myDuration > budget)
+	{
+		char took[32], limit[32];
+		locFormatTime(took, sizeof(took), myDuration);
+		locFormatTime(limit, sizeof(limit), budget);
+		AddError();
+		LogMessage("Took %s, over its budget of %s", took, limit);
+	}
+}
+
+//---------------------------------------------------------------------------------
+// Vectorized mismatch searches. AVX2 is only compiled in for the functions that
+// use it and picked at runtime, so the library still runs on any x86-64.
+//---------------------------------------------------------------------------------
+#if TEST_SSE2
+static unsigned locLowestBit(unsigned mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+#if TEST_AVX2 && !defined(__AVX2__)
+#define TEST_AVX2_TARGET __attribute__((target("avx2")))
+static bool locHasAVX2() { static bool const hasAVX2 = __builtin_cpu_supports("avx2"); return hasAVX2; }
+#elif TEST_AVX2
+#define TEST_AVX2_TARGET
+static bool locHasAVX2() { return true; }
+#endif
+
+static size_t locFindMismatchScalar(unsigned char const* left, unsigned char const* right, size_t size, size_t start)
+{
+	for (; start < size && left[start] == right[start]; ++start) {}
+	return start;
+}
+#if TEST_SSE2
+static size_t locFindMismatchSSE2(unsigned char const* left, unsigned char const* right, size_t size, size_t start)
+{
+	for (; start + 16 <= size; start += 16)
+	{
+		__m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const*)(left + start)), _mm_loadu_si128((__m128i const*)(right + start)));
+		unsigned differ = ~unsigned(_mm_movemask_epi8(equal)) & 0xffff;
+		if (differ)
+			return start + locLowestBit(differ);
+	}
+	return locFindMismatchScalar(left, right, size, start);
+}
+#endif
+#if TEST_AVX2
+TEST_AVX2_TARGET static size_t locFindMismatchAVX2(unsigned char const* left, unsigned char const* right, size_t size, size_t start)
+{
+	for (; start + 32 <= size; start += 32)
+	{
+		__m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i const*)(left + start)), _mm256_loadu_si256((__m256i const*)(right + start)));
+		unsigned differ = ~unsigned(_mm256_movemask_epi8(equal));
+		if (differ)
+			return start + locLowestBit(differ);
+	}
+	return locFindMismatchSSE2(left, right, size, start);
+}
+#endif
+
+size_t TestFindMismatch(void const* left, void const* right, size_t size, size_t start)
+{
+#if TEST_AVX2
+	if (locHasAVX2())
+		return locFindMismatchAVX2((unsigned char const*)left, (unsigned char const*)right, size, start);
+#endif
+#if TEST_SSE2
+	return locFindMismatchSSE2((unsigned char const*)left, (unsigned char const*)right, size, start);
+#else
+	return locFindMismatchScalar((unsigned char const*)left, (unsigned char const*)right, size, start);
+#endif
+}
+
+// Elements are close when they're equal, so matching infinities pass, or within tolerance. NaN never is.
+template <typename T>
+static size_t locFindNotCloseScalar(T const* left, T const* right, size_t count, size_t start, T tolerance)
+{
+	for (; start < count && (left[start] == right[start] || fabs(left[start] - right[start]) <= tolerance); ++start) {}
+	return start;
+}
+
+size_t TestFindNotClose(float const* left, float const* right, size_t count, size_t start, double tolerance)
+{
+#if TEST_SSE2
+	__m128 const sign = _mm_set1_ps(-0.0f);
+	__m128 const limit = _mm_set1_ps(float(tolerance));
+	for (; start + 4 <= count; start += 4)
+	{
+		__m128 l = _mm_loadu_ps(left + start);
+		__m128 r = _mm_loadu_ps(right + start);
+		__m128 close = _mm_or_ps(_mm_cmpeq_ps(l, r), _mm_cmple_ps(_mm_andnot_ps(sign, _mm_sub_ps(l, r)), limit));
+		unsigned differ = ~unsigned(_mm_movemask_ps(close)) & 0xf;
+		if (differ)
+			return start + locLowestBit(differ);
+	}
+#endif
+	return locFindNotCloseScalar(left, right, count, start, float(tolerance));
+}
+size_t TestFindNotClose(double const* left, double const* right, size_t count, size_t start, double tolerance)
+{
+#if TEST_SSE2
+	__m128d const sign = _mm_set1_pd(-0.0);
+	__m128d const limit = _mm_set1_pd(tolerance);
+	for (; start + 2 <= count; start += 2)
+	{
+		__m128d l = _mm_loadu_pd(left + start);
+		__m128d r = _mm_loadu_pd(right + start);
+		__m128d close = _mm_or_pd(_mm_cmpeq_pd(l, r), _mm_cmple_pd(_mm_andnot_pd(sign, _mm_sub_pd(l, r)), limit));
+		unsigned differ = ~unsigned(_mm_movemask_pd(close)) & 0x3;
+		if (differ)
+			return start + locLowestBit(differ);
+	}
+#endif
+	return locFindNotCloseScalar(left, right, count, start, tolerance);
+}
+
+//---------------------------------------------------------------------------------
+// Offset of the first byte that differs between two strings, or of the terminator
+// when they match. Like strlen, the vector loop only reads whole aligned 16 byte
+// blocks, which can't cross into the next page. Right is walked byte by byte up to
+// its first block boundary, left is shifted into place from the aligned blocks on
+// either side, and the block after left's terminator is never loaded. Address and
+// memory sanitizers would still flag the bytes past the terminators, so they get
+// the plain loop.
+//---------------------------------------------------------------------------------
+#if defined(__SANITIZE_ADDRESS__)
+#define TEST_SANITIZED 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+#define TEST_SANITIZED 1
+#endif
+#endif
+
+#if TEST_SSE2 && !TEST_SANITIZED
+template <int Shift>
+static size_t locFindShiftedDifference(char const* left, char const* right, size_t offset)
+{
+	__m128i const zero = _mm_setzero_si128();
+	__m128i const* leftBlock = (__m128i const*)(left + offset - Shift);
+	__m128i low = _mm_load_si128(leftBlock);
+	for (;;)
+	{
+		__m128i l = low;
+		if (Shift)
+		{
+			// only step into the next block of left when its terminator isn't in this one
+			unsigned nulAhead = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(low, zero))) >> Shift;
+			__m128i high = nulAhead ? zero : _mm_load_si128(leftBlock + 1);
+			l = _mm_or_si128(_mm_srli_si128(low, Shift), _mm_slli_si128(high, 16 - Shift));
+			low = high;
+		}
+		__m128i r = _mm_load_si128((__m128i const*)(right + offset));
+		unsigned stop = (~unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(l, r))) | unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(l, zero)))) & 0xffff;
+		if (stop)
+			return offset + locLowestBit(stop);
+
+		offset += 16;
+		++leftBlock;
+		if (!Shift)
+			low = _mm_load_si128(leftBlock);
+	}
+}
+static size_t (*const locFindShiftedDifferences[16])(char const*, char const*, size_t) =
+{
+	locFindShiftedDifference<0>, locFindShiftedDifference<1>, locFindShiftedDifference<2>, locFindShiftedDifference<3>,
+	locFindShiftedDifference<4>, locFindShiftedDifference<5>, locFindShiftedDifference<6>, locFindShiftedDifference<7>,
+	locFindShiftedDifference<8>, locFindShiftedDifference<9>, locFindShiftedDifference<10>, locFindShiftedDifference<11>,
+	locFindShiftedDifference<12>, locFindShiftedDifference<13>, locFindShiftedDifference<14>, locFindShiftedDifference<15>,
+};
+#endif
+
+static size_t locFindStringDifference(char const* left, char const* right)
+{
+	size_t offset = 0;
+#if TEST_SSE2 && !TEST_SANITIZED
+	for (; uintptr_t(right + offset) & 15; ++offset)
+	{
+		if (left[offset] != right[offset] || left[offset] == 0)
+			return offset;
+	}
+	return locFindShiftedDifferences[uintptr_t(left + offset) & 15](left, right, offset);
+#else
+	for (; left[offset] == right[offset] && left[offset]; ++offset) {}
+	return offset;
+#endif
+}
+
 //---------------------------------------------------------------------------------
 // Utility to print a part of a string to show where the error is and put elipse
 // where the string is truncated
 //---------------------------------------------------------------------------------
-static void locCopyStringWithElipse(char dest[STRING_EQ_PRINT_LENGTH], char const* string, size_t offset = 0)
+static void locCopyStringWithElipse(char dest[STRING_EQ_PRINT_LENGTH], char const* string, size_t length, size_t offset = 0)
 {
-	char const* start = string + offset - STRING_EQ_PRINT_LENGTH / 2;
-	if (start < string)
-		start = string;
+	size_t start = offset > STRING_EQ_PRINT_LENGTH / 2 ? offset - STRING_EQ_PRINT_LENGTH / 2 : 0;
 
-	int i = 0;
-	for (; i < STRING_EQ_PRINT_LENGTH - 1 && start[i]; ++i)
+	size_t i = 0;
+	for (; i < STRING_EQ_PRINT_LENGTH - 1 && start + i < length; ++i)
 	{
-		if (i < 3 && start > string)
+		if (i < 3 && start > 0)
 			dest[i] = '.';
-		else if (start[i] == '\r' || start[i] == '\n' || start[i] == '\t')
-			dest[i] = '\\'; // simply replace this with '\', we're just aiming for a general idea not an exact representation
+		else if ((unsigned char)string[start + i] < ' ')
+			dest[i] = '\\'; // simply replace control characters with '\', we're just aiming for a general idea not an exact representation
 		else
-			dest[i] = start[i];
+			dest[i] = string[start + i];
 	}
 
 	dest[i] = 0;
 
-	if (i == STRING_EQ_PRINT_LENGTH - 1 && start[i])
+	if (i == STRING_EQ_PRINT_LENGTH - 1 && start + i < length)
 	{
 		dest[i - 1] = '.';
 		dest[i - 2] = '.';
 		dest[i - 3] = '.';
 	}
 }
+
 //---------------------------------------------------------------------------------
-// Instead of just check for error and printing the string, try go be smart about
-// how the information is written out:
-// ... quick brown fox jumps over ...
-//                      ^
-// ... quick brown fox jamps over ...
+// Single line strings are printed above and below a caret at the first difference.
+// Multi-line strings report the line and column instead and show the lines around
+// it, every line cut to the same window so the columns stay lined up. The report
+// is three parts for a prefix taking the condition and three strings, or a single
+// body when the prefix takes the condition and one string.
 //---------------------------------------------------------------------------------
-bool TestFixture::TestStrings(char const* left, char const* right, char const* prefix, char const* condition)
+static void locLogStringDifference(TestFixture& test, char const* left, size_t leftLength, char const* right, size_t rightLength, size_t offset, char const* prefix, char const* condition, bool singleBody)
 {
-	AddTest();
-	if (left == right)
-	{
-		return true;
-	}
+	if (!test.ShouldLogFailure())
+		return;
 
 	char leftLine[STRING_EQ_PRINT_LENGTH];
 	char rightLine[STRING_EQ_PRINT_LENGTH];
 	char locationLine[STRING_EQ_PRINT_LENGTH];
+	auto placeCaret = [&](size_t column)
+	{
+		if (column > STRING_EQ_PRINT_LENGTH / 2)
+			column = STRING_EQ_PRINT_LENGTH / 2;
 
-	if (left == nullptr || right == nullptr)
+		memset(locationLine, ' ', column);
+		locationLine[column] = '^';
+		locationLine[column + 1] = 0;
+	};
+
+	if (memchr(left, '\n', leftLength) == nullptr && memchr(right, '\n', rightLength) == nullptr)
 	{
-		locationLine[0] = '^';
-		locationLine[1] = 0;
-		if (left == nullptr)
+		locCopyStringWithElipse(leftLine, left, leftLength, offset);
+		locCopyStringWithElipse(rightLine, right, rightLength, offset);
+		placeCaret(offset);
+
+		if (singleBody)
 		{
-			strcpy(leftLine, "nullptr");
-			locCopyStringWithElipse(rightLine, right);
+			char body[3 * STRING_EQ_PRINT_LENGTH + 8];
+			snprintf(body, sizeof(body), "\n%s\n%s\n%s", leftLine, locationLine, rightLine);
+			test.LogMessage(prefix, condition, body);
 		}
 		else
 		{
-			locCopyStringWithElipse(leftLine, left);
-			strcpy(rightLine, "nullptr");
+			test.LogMessage(prefix, condition, leftLine, locationLine, rightLine);
 		}
+		return;
 	}
-	else
+
+	// both strings are the same up to the difference, so either one gives the line it's on
+	size_t lineStart = 0;
+	int lineNumber = 1;
+	for (char const* newline; (newline = (char const*)memchr(left + lineStart, '\n', offset - lineStart)) != nullptr;)
 	{
-		char const* testLeft = left;
-		char const* testRight = right;
+		lineStart = size_t(newline - left) + 1;
+		++lineNumber;
+	}
+	size_t column = offset - lineStart;
+	placeCaret(column);
 
-		int offset = 0;
-		for (; *testLeft && *testRight; ++offset, ++testLeft, ++testRight)
-		{
-			if (*testLeft != *testRight)
-				break;
-		}
+	int width = 1;
+	for (int number = lineNumber + STRING_EQ_CONTEXT_LINES; number >= 10; number /= 10)
+		++width;
 
-		// reached the end of both strings, so they're the same
-		if (!*testLeft && !*testRight)
-			return true;
+	// lines are written with a newline in front, so the parts are split by ending them on the newline
+	char body[(2 * STRING_EQ_CONTEXT_LINES + 4) * (STRING_EQ_PRINT_LENGTH + 16) + 64];
+	int length = snprintf(body, sizeof(body), "\nFirst difference at line %d, column %d", lineNumber, int(column + 1));
+	int context = length;
+	int caret = length;
+
+	// prints the line starting at start and returns where the next one starts, past the end if there isn't one
+	auto appendLine = [&](char marker, int number, char const* string, size_t stringLength, size_t start)
+	{
+		char const* newline = (char const*)memchr(string + start, '\n', stringLength - start);
+		size_t end = newline ? size_t(newline - string) : stringLength;
+
+		locCopyStringWithElipse(leftLine, string + start, end - start, column);
+		if (length >= 0 && size_t(length) < sizeof(body))
+			length += snprintf(body + length, sizeof(body) - length, "\n%c %*d | %s", marker, width, number, leftLine);
+		return newline ? end + 1 : stringLength + 1;
+	};
+
+	size_t contextStart = lineStart;
+	int contextLine = lineNumber;
+	while (contextStart > 0 && lineNumber - contextLine < STRING_EQ_CONTEXT_LINES)
+	{
+		for (--contextStart; contextStart > 0 && left[contextStart - 1] != '\n'; --contextStart) {}
+		--contextLine;
+	}
+	context = length;
+	for (; contextLine < lineNumber; ++contextLine)
+		contextStart = appendLine(' ', contextLine, left, leftLength, contextStart);
 
-		locCopyStringWithElipse(leftLine, left, offset);
-		locCopyStringWithElipse(rightLine, right, offset);
+	size_t leftNext = appendLine('<', lineNumber, left, leftLength, lineStart);
+	size_t rightNext = appendLine('>', lineNumber, right, rightLength, lineStart);
+	caret = length;
+	if (length >= 0 && size_t(length) < sizeof(body))
+		length += snprintf(body + length, sizeof(body) - length, "\n  %*s | %s", width, "", locationLine);
 
-		if (offset > STRING_EQ_PRINT_LENGTH / 2)
-			offset = STRING_EQ_PRINT_LENGTH / 2;
+	for (int i = 1; i <= STRING_EQ_CONTEXT_LINES; ++i)
+	{
+		if (leftNext <= leftLength)
+			leftNext = appendLine('<', lineNumber + i, left, leftLength, leftNext);
+		if (rightNext <= rightLength)
+			rightNext = appendLine('>', lineNumber + i, right, rightLength, rightNext);
+	}
+
+	if (singleBody)
+	{
+		test.LogMessage(prefix, condition, body);
+		return;
+	}
+
+	auto split = [&](int at) -> char const*
+	{
+		if (at < 0 || size_t(at) >= sizeof(body) - 1 || body[at] != '\n')
+			return "";
+		body[at] = 0;
+		return body + at + 1;
+	};
+	char const* after = split(caret);
+	char const* around = split(context);
+	test.LogMessage(prefix, condition, body + 1, around, after);
+}
+
+bool TestFixture::TestStrings(char const* left, char const* right, char const* prefix, char const* condition)
+{
+	AddTest();
+	if (left == right)
+		return true;
 
-		memset(locationLine, ' ', offset);
-		locationLine[offset] = '^';
-		locationLine[offset + 1] = 0;
+	if (left == nullptr || right == nullptr)
+	{
+		AddError();
+		if (left == nullptr)
+			locLogStringDifference(*this, "nullptr", 7, right, strlen(right), 0, prefix, condition, false);
+		else
+			locLogStringDifference(*this, left, strlen(left), "nullptr", 7, 0, prefix, condition, false);
+		return false;
 	}
 
+	size_t offset = locFindStringDifference(left, right);
+
+	// reached the end of both strings, so they're the same
+	if (left[offset] == right[offset])
+		return true;
+
+	AddError();
+	locLogStringDifference(*this, left, strlen(left), right, strlen(right), offset, prefix, condition, false);
+	return false;
+}
+
+bool TestFixture::TestStrings(char const* left, size_t leftLength, char const* right, size_t rightLength, char const* prefix, char const* condition)
+{
+	AddTest();
+	size_t shortest = leftLength < rightLength ? leftLength : rightLength;
+	size_t offset = left == right ? shortest : TestFindMismatch(left, right, shortest, 0);
+	if (offset == shortest && leftLength == rightLength)
+		return true;
+
 	AddError();
-	LogMessage(prefix, condition, leftLine, locationLine, rightLine);
+	locLogStringDifference(*this, left ? left : "", left ? leftLength : 0, right ? right : "", right ? rightLength : 0, offset, prefix, condition, true);
 	return false;
 }
+
 //---------------------------------------------------------------------------------
-// Write error into current error object and advance pointer if there's still enough space
+// Array reports show a window around each of the first few differences, a few
+// values either side for typed arrays and a row of hex bytes for memory.
+// Every difference inside a window is marked.
 //---------------------------------------------------------------------------------
-void TestFixture::LogMessage(char const* string, ...)
-{
-	uintptr_t spaceLeft = (myMessageSpace + MESSAGE_SPACE) - (char*)myNextError;
+static size_t const locArrayContext = 3;
+static size_t const locHexRow = 16;
 
-	if (spaceLeft == 0)
-	{
-		return;
-	}
+static TempString locElementToString(TestArrayCompare const& compare, void const* array, size_t index)
+{
+	if (compare.toString)
+		return compare.toString(array, index);
 
-	spaceLeft -= sizeof(TestError);
+	TempString string;
+	snprintf(string.myTextBuffer, STRING_LENGTH, "%02x", ((unsigned char const*)array)[index]);
+	return string;
+}
 
-	va_list args;
+static void locLogArrayWindow(TestFixture& test, void const* left, void const* right, size_t count, size_t first, TestArrayCompare const& compare, size_t begin, size_t end)
+{
+	size_t const lineLength = (locHexRow > 2 * locArrayContext + 1 ? locHexRow : 2 * locArrayContext + 1) * (STRING_LENGTH + 2) + 8;
+	char leftLine[lineLength];
+	char rightLine[lineLength];
+	char locationLine[lineLength];
 
-	va_start(args, string);
+	char const* separator = compare.toString ? ", " : " ";
+	size_t length = 0;
+	auto append = [&](char const* leftText, char const* rightText, char marker)
+	{
+		size_t leftLength = strlen(leftText);
+		size_t rightLength = strlen(rightText);
+		size_t width = leftLength > rightLength ? leftLength : rightLength;
+		if (length + width + 2 >= lineLength)
+			return;
 
-	int printedChars = vsnprintf(myNextError->message, spaceLeft, string, args);
+		memcpy(leftLine + length, leftText, leftLength);
+		memset(leftLine + length + leftLength, ' ', width - leftLength);
+		memcpy(rightLine + length, rightText, rightLength);
+		memset(rightLine + length + rightLength, ' ', width - rightLength);
+		memset(locationLine + length, marker, width);
+		length += width;
+	};
 
-	va_end(args);
+	// hex rows start at their offset, so only values need to show there's more before them
+	size_t next = first;
+	if (begin > 0 && compare.toString)
+		append("...", "...", ' ');
+	for (size_t i = begin; i < end; ++i)
+	{
+		if (length)
+			append(separator, separator, ' ');
 
-	// if there isn't a reasonable amount of space left then just advance to end and stop printing errors
-	if (printedChars < (int)(spaceLeft - sizeof(TestError) - 64))
+		bool differs = i == next;
+		if (differs)
+			next = compare.find(left, right, count, i + 1, compare.tolerance);
+		append(*locElementToString(compare, left, i), *locElementToString(compare, right, i), differs ? '^' : ' ');
+	}
+	if (end < count && compare.toString)
 	{
-		uintptr_t nextOffset = (uintptr_t(myNextError->message) + printedChars + sizeof(TestError) * 2 - 1);
-		nextOffset -= nextOffset % alignof(TestError);
-		TestError* next = (TestError*)(nextOffset);
-		myNextError->next = next;
+		append(separator, separator, ' ');
+		append("...", "...", ' ');
 	}
-	else
+
+	// padding after the last column isn't any help
+	char* lines[] = { leftLine, rightLine, locationLine };
+	for (char* line : lines)
 	{
-		myNextError->next = (TestError*)(myMessageSpace + MESSAGE_SPACE);
+		size_t end = length;
+		while (end && line[end - 1] == ' ')
+			--end;
+		line[end] = 0;
 	}
 
-	myNextError = myNextError->next;
-}
-TestFixture const* TestFixture::LinkTest(TestFixture* test)
-{
-	test->myNextTest = TestFixture::ourFirstTest;
-	TestFixture::ourFirstTest = test;
-	return test;
+	if (compare.toString)
+		test.LogMessage("  at index %llu\n  %s\n  %s\n  %s", (unsigned long long)first, leftLine, rightLine, locationLine);
+	else
+		test.LogMessage("  at offset 0x%llx\n  %s\n  %s\n  %s", (unsigned long long)begin, leftLine, rightLine, locationLine);
 }
 
-//---------------------------------------------------------------------------------
-// Standard / Example runners
-//---------------------------------------------------------------------------------
-static bool locExecuteTest(TestFixture* test, TestFixture::OutputMode output)
+bool TestFixture::TestArrays(void const* left, void const* right, size_t count, TestArrayCompare const& compare, char const* prefix, char const* condition)
 {
-	clock_t start = 0;
-	if (output == TestFixture::Verbose)
+	AddTest();
+	if (left == right || count == 0)
+		return true;
+
+	if (left == nullptr || right == nullptr)
 	{
-		TestFixture::Printf("Running [%s/%s]", test->TestGroup(), test->TestName());
-		start = clock();
+		AddError();
+		if (ShouldLogFailure())
+			LogMessage(prefix, condition, left == nullptr ? "Left is nullptr" : "Right is nullptr");
+		return false;
 	}
 
-	if (test->ExecuteTest())
-	{
-		if (output == TestFixture::Verbose)
-		{
-			clock_t end = clock();
-			TestFixture::Printf(": Passed %d out of %d tests in %g seconds\n", test->NumTests(), test->NumTests(), float(end - start) / (float)CLOCKS_PER_SEC);
-		}
+	size_t first = compare.find(left, right, count, 0, compare.tolerance);
+	if (first == count)
 		return true;
-	}
 
-	if (output != TestFixture::Silent)
-	{
-		if (output != TestFixture::Verbose)
-			TestFixture::Printf("[%s/%s]", test->TestGroup(), test->TestName());
+	AddError();
+	if (!ShouldLogFailure())
+		return false;
 
-		TestFixture::Printf(": Failed %d out of %d tests\n", test->NumErrors(), test->NumTests());
+	size_t numDiffering = 0;
+	for (size_t i = first; i < count; i = compare.find(left, right, count, i + 1, compare.tolerance))
+		++numDiffering;
 
-		for (TestError const* err = test->GetFirstError(), *e = test->GetLastError(); err != e; err = err->next)
-		{
-			TestFixture::Printf("%s\n", err->message);
-		}
+	char summary[128];
+	snprintf(summary, sizeof(summary), "%llu of %llu %s differ", (unsigned long long)numDiffering, (unsigned long long)count, compare.toString ? "elements" : "bytes");
+
+	LogMessage(prefix, condition, summary);
+
+	size_t next = first;
+	for (int shown = 0; next < count && shown < ARRAY_EQ_PRINT_COUNT; ++shown)
+	{
+		size_t begin = compare.toString ? (next > locArrayContext ? next - locArrayContext : 0) : next - next % locHexRow;
+		size_t end = begin + (compare.toString ? next - begin + locArrayContext + 1 : locHexRow);
+		if (end > count)
+			end = count;
+
+		locLogArrayWindow(*this, left, right, count, next, compare, begin, end);
+		next = end < count ? compare.find(left, right, count, end, compare.tolerance) : count;
 	}
 
 	return false;
 }
-void TestFixture::Printf(char const* string, ...)
+#if DEFERRED_MESSAGES
+//---------------------------------------------------------------------------------
+// Deferred messages. The format is walked the same way printf does to find out
+// what each argument is and their bytes are stored in the message instead of
+// text. Strings are copied since they're usually temporaries. Printing walks the
+// format again and formats one conversion at a time.
+//---------------------------------------------------------------------------------
+enum TestArgument
 {
-	char tempSpace[4096];
-	va_list args;
-
-	va_start(args, string);
+	ArgumentNone,
+	ArgumentInt,
+	ArgumentLong,
+	ArgumentLongLong,
+	ArgumentSize,
+	ArgumentIntMax,
+	ArgumentPtrDiff,
+	ArgumentDouble,
+	ArgumentLongDouble,
+	ArgumentPointer,
+	ArgumentString,
+	ArgumentUnsupported,
+};
 
-	vsnprintf(tempSpace, sizeof(tempSpace), string, args);
+struct TestConversion
+{
+	char const* end; // one past the conversion character
+	TestArgument argument;
+	int numStars; // width and precision passed as int arguments before the value
+	int precision; // -1 when there isn't one, -2 when it's an argument
+};
 
-	va_end(args);
+static int const locMaxSpecLength = 32;
 
-	TestFixture::Print(tempSpace);
-}
-bool TestFixture::ExecuteAllTests(char const* groupFilter, char const* nameFilter, OutputMode output)
+static TestConversion locParseConversion(char const* percent)
 {
-	if (output != Silent)
+	TestConversion conversion = { percent + 1, ArgumentUnsupported, 0, -1 };
+	char const* c = conversion.end;
+
+	while (*c == '-' || *c == '+' || *c == ' ' || *c == '#' || *c == '0' || *c == '\'')
+		++c;
+
+	if (*c == '*')
+		++conversion.numStars, ++c;
+	else
+		while (*c >= '0' && *c <= '9') ++c;
+
+	if (*c == '.')
 	{
-		if (groupFilter == nullptr && nameFilter == nullptr)
-			Printf("Running all tests.\n");
-		else if (groupFilter != nullptr && nameFilter == nullptr)
-			Printf("Running all tests in groups [%s].\n", groupFilter);
-		else if (groupFilter == nullptr && nameFilter != nullptr)
-			Printf("Running all tests named [%s].\n", nameFilter);
+		conversion.precision = 0;
+		if (*++c == '*')
+			++conversion.numStars, conversion.precision = -2, ++c;
 		else
-			Printf("Running all tests named [%s/%s].\n", groupFilter, nameFilter);
+			for (; *c >= '0' && *c <= '9'; ++c) conversion.precision = conversion.precision * 10 + (*c - '0');
 	}
 
-	int count = 0;
-	int passes = 0;
-	int fails = 0;
-	bool passed = true;
-	for (auto i = TestFixture::GetFirstTest(); i; i = i->GetNextTest())
+	int longs = 0;
+	char length = 0;
+	for (; *c == 'h' || *c == 'l' || *c == 'L' || *c == 'q' || *c == 'j' || *c == 'z' || *c == 't'; ++c)
 	{
-		bool matchGroup = groupFilter == nullptr || strcmp(groupFilter, i->TestGroup()) == 0;
-		bool matchName = nameFilter == nullptr || strcmp(nameFilter, i->TestName()) == 0;
-		if (matchGroup && matchName)
-		{
-			++count;
-			passed &= locExecuteTest(i, output);
-			passes += i->NumTests();
-			fails += i->NumErrors();
-		}
+		length = *c;
+		longs += *c == 'l' ? 1 : *c == 'q' ? 2 : 0;
 	}
 
-	if (output != Silent)
+	switch (*c)
 	{
-		if (count == 0)
-			Printf("Failed to find any tests.\n");
-		else if (passed)
-			Printf("%d Tests finished. All %d assertions are passing.\n", count, passes);
+	case '%':
+		conversion.argument = ArgumentNone;
+		break;
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+		conversion.argument = longs >= 2 ? ArgumentLongLong : longs ? ArgumentLong : length == 'z' ? ArgumentSize : length == 'j' ? ArgumentIntMax : length == 't' ? ArgumentPtrDiff : ArgumentInt;
+		break;
+	case 'c':
+		conversion.argument = longs ? ArgumentUnsupported : ArgumentInt;
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		conversion.argument = length == 'L' ? ArgumentLongDouble : ArgumentDouble;
+		break;
+	case 's':
+		conversion.argument = longs ? ArgumentUnsupported : ArgumentString;
+		break;
+	case 'p':
+		conversion.argument = ArgumentPointer;
+		break;
+	}
+
+	conversion.end = *c ? c + 1 : c;
+	return conversion;
+}
+
+template <typename T>
+static bool locPut(char*& write, char const* end, T value)
+{
+	if (size_t(end - write) < sizeof(T))
+		return false;
+	memcpy(write, &value, sizeof(T));
+	write += sizeof(T);
+	return true;
+}
+
+template <typename T>
+static T locGet(char const*& read)
+{
+	T value;
+	memcpy(&value, read, sizeof(T));
+	read += sizeof(T);
+	return value;
+}
+
+// Size of the encoded arguments, 0 when they can't be encoded or don't fit
+static size_t locEncodeArguments(char* buffer, size_t size, char const* format, va_list args)
+{
+	char* write = buffer;
+	char const* end = buffer + size;
+
+	for (char const* percent = strchr(format, '%'); percent; )
+	{
+		TestConversion conversion = locParseConversion(percent);
+		if (conversion.end - percent >= locMaxSpecLength)
+			return 0;
+
+		int stars[2] = {};
+		for (int i = 0; i < conversion.numStars; ++i)
+		{
+			stars[i] = va_arg(args, int);
+			if (!locPut(write, end, stars[i]))
+				return 0;
+		}
+
+		bool stored = true;
+		switch (conversion.argument)
+		{
+		case ArgumentNone: break;
+		case ArgumentInt: stored = locPut(write, end, va_arg(args, int)); break;
+		case ArgumentLong: stored = locPut(write, end, va_arg(args, long)); break;
+		case ArgumentLongLong: stored = locPut(write, end, va_arg(args, long long)); break;
+		case ArgumentSize: stored = locPut(write, end, va_arg(args, size_t)); break;
+		case ArgumentIntMax: stored = locPut(write, end, va_arg(args, intmax_t)); break;
+		case ArgumentPtrDiff: stored = locPut(write, end, va_arg(args, ptrdiff_t)); break;
+		case ArgumentDouble: stored = locPut(write, end, va_arg(args, double)); break;
+		case ArgumentLongDouble: stored = locPut(write, end, va_arg(args, long double)); break;
+		case ArgumentPointer: stored = locPut(write, end, va_arg(args, void*)); break;
+		case ArgumentString:
+		{
+			char const* string = va_arg(args, char const*);
+			if (string == nullptr)
+				string = "(null)";
+
+			// with a precision the string doesn't have to be terminated
+			int precision = conversion.precision == -2 ? stars[conversion.numStars - 1] : conversion.precision;
+			size_t length = precision >= 0 ? strnlen(string, size_t(precision)) : strlen(string);
+			stored = size_t(end - write) > length;
+			if (stored)
+			{
+				memcpy(write, string, length);
+				write[length] = 0;
+				write += length + 1;
+			}
+			break;
+		}
+		default:
+			return 0;
+		}
+
+		if (!stored)
+			return 0;
+
+		percent = strchr(conversion.end, '%');
+	}
+
+	// messages without arguments still need a byte to tell them apart from a failure to encode
+	if (write == buffer)
+		*write++ = 0;
+	return size_t(write - buffer);
+}
+
+template <typename T>
+static int locPrintArgument(char* buffer, size_t size, char const* spec, int const* stars, int numStars, T value)
+{
+	if (numStars == 2)
+		return snprintf(buffer, size, spec, stars[0], stars[1], value);
+	if (numStars == 1)
+		return snprintf(buffer, size, spec, stars[0], value);
+	return snprintf(buffer, size, spec, value);
+}
+#endif
+
+char const* TestError::Text(char* buffer, size_t size) const
+{
+#if DEFERRED_MESSAGES
+	if (format && size)
+	{
+		char const* read = message;
+		size_t length = 0;
+		for (char const* c = format; *c && length + 1 < size;)
+		{
+			char const* percent = strchr(c, '%');
+			size_t literal = percent ? size_t(percent - c) : strlen(c);
+			if (literal > size - 1 - length)
+				literal = size - 1 - length;
+			memcpy(buffer + length, c, literal);
+			length += literal;
+			if (percent == nullptr)
+				break;
+
+			TestConversion conversion = locParseConversion(percent);
+			c = conversion.end;
+
+			char spec[locMaxSpecLength];
+			size_t specLength = size_t(conversion.end - percent);
+			if (conversion.argument == ArgumentNone)
+			{
+				if (length + 1 < size)
+					buffer[length++] = '%';
+				continue;
+			}
+			memcpy(spec, percent, specLength);
+			spec[specLength] = 0;
+
+			int stars[2] = {};
+			for (int i = 0; i < conversion.numStars; ++i)
+				stars[i] = locGet<int>(read);
+
+			char* out = buffer + length;
+			size_t left = size - length;
+			int printed = 0;
+			switch (conversion.argument)
+			{
+			case ArgumentInt: printed = locPrintArgument(out, left, spec, stars, conversion.numStars, locGet<int>(read)); break;
+			case ArgumentLong: printed = locPrintArgument(out, left, spec, stars, conversion.numStars, locGet<long>(read)); break;
+			case ArgumentLongLong: printed = locPrintArgument(out, left, spec, stars, conversion.numStars, locGet<long long>(read)); break;
+			case ArgumentSize: printed = locPrintArgument(out, left, spec, stars, conversion.numStars, locGet<size_t>(read)); break;
+			case ArgumentIntMax: printed = locPrintArgument(out, left, spec, stars, conversion.numStars, locGet<intmax_t>(read)); break;
+			case ArgumentPtrDiff: printed = locPrintArgument(out, left, spec, stars, conversion.numStars, locGet<ptrdiff_t>(read)); break;
+			case ArgumentDouble: printed = locPrintArgument(out, left, spec, stars, conversion.numStars, locGet<double>(read)); break;
+			case ArgumentLongDouble: printed = locPrintArgument(out, left, spec, stars, conversion.numStars, locGet<long double>(read)); break;
+			case ArgumentPointer: printed = locPrintArgument(out, left, spec, stars, conversion.numStars, locGet<void*>(read)); break;
+			case ArgumentString:
+				printed = locPrintArgument(out, left, spec, stars, conversion.numStars, read);
+				read += strlen(read) + 1;
+				break;
+			default:
+				break;
+			}
+
+			if (printed > 0)
+				length += size_t(printed) < left ? size_t(printed) : left - 1;
+		}
+
+		buffer[length] = 0;
+		return buffer;
+	}
+#else
+	(void)buffer;
+	(void)size;
+#endif
+	return message;
+}
+
+//---------------------------------------------------------------------------------
+// Write error into the current chunk, claiming a new one from the arena if it
+// doesn't fit. A message longer than a chunk claims a run of them, so a single
+// message can fill the test's MESSAGE_SPACE. Messages are dropped and counted
+// once the test has used up its MESSAGE_SPACE or the arena is empty.
+//---------------------------------------------------------------------------------
+static size_t const locMaxMessageSize = ERROR_CHUNK_SIZE - sizeof(TestErrorChunk) - offsetof(TestError, message);
+static size_t const locChunkHeaderSize = sizeof(TestErrorChunk) + offsetof(TestError, message);
+static size_t const locChunkSize = ERROR_CHUNK_SIZE; // the config macros are unparenthesized expressions
+static size_t const locMessageSpace = MESSAGE_SPACE;
+
+//---------------------------------------------------------------------------------
+// Worker processes stream the messages of the test they're running as they're
+// logged, with its counts at the time, so a test that takes the worker down
+// still reports everything up to that point. Released messages stream as null.
+//---------------------------------------------------------------------------------
+struct TestCounts
+{
+	std::atomic<int> numTests;
+	std::atomic<int> numErrors;
+	std::atomic<int> numUnlogged;
+};
+static TestFixture* locStreamTest;
+static void (*locStreamMessage)(TestError const* error);
+
+#if TEST_SIGNALS
+static TestCounts* locStreamCounts;
+
+// Only touches lock free atomics so signal handlers can call it too
+static void locPublishCounts()
+{
+	if (TestFixture const* test = locStreamTest)
+	{
+		locStreamCounts->numTests.store(test->NumTests(), std::memory_order_relaxed);
+		locStreamCounts->numErrors.store(test->NumErrors(), std::memory_order_relaxed);
+		locStreamCounts->numUnlogged.store(test->NumUnloggedFailures(), std::memory_order_relaxed);
+	}
+}
+#endif
+
+TestError* TestFixture::ClaimMessage(size_t size)
+{
+	if (myErrorChunks && myErrorWrite + offsetof(TestError, message) + size <= (char*)myErrorChunks + myErrorChunks->size)
+		return (TestError*)myErrorWrite;
+
+	// the last chunk a test claims may take it past MESSAGE_SPACE
+	size_t count = (locChunkHeaderSize + size + locChunkSize - 1) / locChunkSize;
+	TestErrorChunk* chunk = myErrorSpace + (count - 1) * locChunkSize < locMessageSpace ? locClaimErrorChunks(count) : nullptr;
+
+	// without a free run a long message makes do with a single chunk, LogMessage cuts it short
+	if (chunk == nullptr && count > 1 && size_t(myErrorSpace) < locMessageSpace)
+		chunk = locClaimErrorChunks(1);
+
+	if (chunk == nullptr)
+	{
+		++myNumDroppedMessages;
+		return nullptr;
+	}
+
+	chunk->next = myErrorChunks;
+	myErrorChunks = chunk;
+	myErrorSpace += int(chunk->size);
+	return (TestError*)(chunk + 1);
+}
+void TestFixture::AppendMessage(TestError* error, size_t size)
+{
+	error->next = nullptr;
+	if (myLastError)
+		myLastError->next = error;
+	else
+		myFirstError = error;
+	myLastError = error;
+
+	uintptr_t nextOffset = uintptr_t(error->message) + size + alignof(TestError) - 1;
+	myErrorWrite = (char*)(nextOffset - nextOffset % alignof(TestError));
+
+	if (this == locStreamTest)
+		locStreamMessage(error);
+}
+void TestFixture::LogMessage(char const* string, ...)
+{
+	// the watchdog logs into the test it stopped, so don't stop it halfway through linking a message
+	TestFrameworkScope scope;
+	va_list args;
+	va_start(args, string);
+
+#if DEFERRED_MESSAGES
+	// arguments that can't be encoded or don't fit are formatted straight away instead
+	char arguments[locMaxMessageSize];
+	va_list encodeArgs;
+	va_copy(encodeArgs, args);
+	size_t size = locEncodeArguments(arguments, sizeof(arguments), string, encodeArgs);
+	va_end(encodeArgs);
+
+	if (size)
+	{
+		va_end(args);
+		if (TestError* error = ClaimMessage(size))
+		{
+			error->format = string;
+			memcpy(error->message, arguments, size);
+			AppendMessage(error, size);
+		}
+		return;
+	}
+#endif
+
+	size_t const headerSize = offsetof(TestError, message);
+	TestError* error = nullptr;
+	int printedChars = 0;
+
+	if (myErrorChunks)
+	{
+		char* chunkEnd = (char*)myErrorChunks + myErrorChunks->size;
+		if (myErrorWrite + headerSize < chunkEnd)
+		{
+			size_t spaceLeft = chunkEnd - myErrorWrite - headerSize;
+
+			va_list tryArgs;
+			va_copy(tryArgs, args);
+			printedChars = vsnprintf(((TestError*)myErrorWrite)->message, spaceLeft, string, tryArgs);
+			va_end(tryArgs);
+
+			if (printedChars >= 0 && size_t(printedChars) < spaceLeft)
+				error = (TestError*)myErrorWrite;
+		}
+	}
+
+	if (error == nullptr)
+	{
+		if (printedChars == 0)
+		{
+			va_list sizeArgs;
+			va_copy(sizeArgs, args);
+			printedChars = vsnprintf(nullptr, 0, string, sizeArgs);
+			va_end(sizeArgs);
+		}
+
+		// claim enough chunks for the whole message as long as the test has the space left
+		size_t spaceLeft = size_t(myErrorSpace) < locMessageSpace ? locMessageSpace - myErrorSpace : 0;
+		size_t maxSize = (spaceLeft + locChunkSize - 1) / locChunkSize * locChunkSize;
+		maxSize = (maxSize > locChunkSize ? maxSize : locChunkSize) - locChunkHeaderSize;
+		size_t size = printedChars < 0 ? locMaxMessageSize : size_t(printedChars) + 1;
+		error = ClaimMessage(size < maxSize ? size : maxSize);
+		if (error == nullptr)
+		{
+			va_end(args);
+			return;
+		}
+
+		// a fresh chunk always has room for something, messages that are too long get cut short
+		size_t capacity = (char*)myErrorChunks + myErrorChunks->size - error->message;
+		printedChars = vsnprintf(error->message, capacity, string, args);
+		if (printedChars < 0 || size_t(printedChars) >= capacity)
+		{
+			printedChars = int(capacity - 1);
+			memcpy(error->message + printedChars - 3, "...", 3);
+		}
+	}
+
+	va_end(args);
+
+	error->format = nullptr;
+	AppendMessage(error, size_t(printedChars) + 1);
+}
+void TestFixture::AdoptResults(TestFixture& other)
+{
+	myNumTestsChecked += other.myNumTestsChecked;
+	myNumErrors += other.myNumErrors;
+	myNumDroppedMessages += other.myNumDroppedMessages;
+	myNumUnloggedFailures += other.myNumUnloggedFailures;
+
+	if (this == locStreamTest)
+	{
+		for (TestError const* i = other.myFirstError; i; i = i->next)
+			locStreamMessage(i);
+	}
+
+	if (other.myFirstError)
+	{
+		if (myLastError)
+			myLastError->next = other.myFirstError;
+		else
+			myFirstError = other.myFirstError;
+		myLastError = other.myLastError;
+	}
+
+	if (other.myErrorChunks)
+	{
+		// keep the chunk being written to at the front so new messages still go into it
+		if (myErrorChunks)
+		{
+			TestErrorChunk* last = other.myErrorChunks;
+			while (last->next)
+				last = last->next;
+			last->next = myErrorChunks->next;
+			myErrorChunks->next = other.myErrorChunks;
+		}
+		else
+		{
+			myErrorChunks = other.myErrorChunks;
+			myErrorWrite = other.myErrorWrite;
+		}
+		myErrorSpace += other.myErrorSpace;
+	}
+
+	other.myErrorChunks = nullptr;
+	other.myFirstError = other.myLastError = nullptr;
+	other.myErrorWrite = nullptr;
+	other.myErrorSpace = 0;
+	other.myNumDroppedMessages = other.myNumUnloggedFailures = 0;
+	other.myNumTestsChecked = other.myNumErrors = 0;
+}
+void TestFixture::AddResults(long long checks, long long errors)
+{
+	long long numTests = myNumTestsChecked + checks;
+	long long numErrors = myNumErrors + errors;
+	myNumTestsChecked = numTests < INT_MAX ? int(numTests) : INT_MAX;
+	myNumErrors = numErrors < INT_MAX ? int(numErrors) : INT_MAX;
+}
+void TestFixture::ReleaseErrors()
+{
+	TestFrameworkScope scope;
+	if (this == locStreamTest && myFirstError)
+		locStreamMessage(nullptr);
+
+	if (myErrorChunks)
+		locReleaseErrorChunks(myErrorChunks);
+
+	myErrorChunks = nullptr;
+	myFirstError = myLastError = nullptr;
+	myErrorWrite = nullptr;
+	myErrorSpace = 0;
+	myNumDroppedMessages = myNumUnloggedFailures = 0;
+}
+TestFixture const* TestFixture::LinkTest(TestFixture* test)
+{
+	test->myNextTest = TestFixture::ourFirstTest;
+	TestFixture::ourFirstTest = test;
+	return test;
+}
+
+//---------------------------------------------------------------------------------
+// Stand ins. Adopting folds the counts first so the test only ever gets them
+// through AddResults, which is the one place they're narrowed back to int.
+//---------------------------------------------------------------------------------
+void TestStandIn::Log(char const* header)
+{
+	myTest->LogMessage("%s", header);
+
+	char buffer[ERROR_CHUNK_SIZE];
+	for (TestError const* err = myFirstError; err; err = err->next)
+		myTest->LogMessage("%s", err->Text(buffer, sizeof(buffer)));
+	if (myNumDroppedMessages)
+		myTest->LogMessage("%d more messages were dropped", myNumDroppedMessages);
+}
+void TestStandIn::Reset()
+{
+	myTotalTests += myNumTestsChecked;
+	myTotalErrors += myNumErrors;
+	myNumTestsChecked = myNumErrors = 0;
+	ReleaseErrors();
+}
+void TestStandIn::Adopt()
+{
+	myTotalTests += myNumTestsChecked;
+	myTotalErrors += myNumErrors;
+	myNumTestsChecked = myNumErrors = 0;
+	myTest->AdoptResults(*this);
+	myTest->AddResults(myTotalTests, myTotalErrors);
+	myTotalTests = myTotalErrors = 0;
+}
+
+//---------------------------------------------------------------------------------
+// Lazily registered tests. Linker sections are bracketed by symbols the linker
+// (or the section name ordering on msvc) provides, the fallback is a plain list.
+//---------------------------------------------------------------------------------
+#if defined(_MSC_VER)
+#pragma section("stest$a", read)
+#pragma section("stest$z", read)
+__declspec(allocate("stest$a")) static TestDescriptor const* const locDescriptorsBegin = nullptr;
+__declspec(allocate("stest$z")) static TestDescriptor const* const locDescriptorsEnd = nullptr;
+#define TEST_DESCRIPTORS_BEGIN (&locDescriptorsBegin + 1)
+#define TEST_DESCRIPTORS_END (&locDescriptorsEnd)
+#elif defined(__APPLE__)
+extern TestDescriptor const* const locDescriptorsBegin __asm("section$start$__DATA$simpletest");
+extern TestDescriptor const* const locDescriptorsEnd __asm("section$end$__DATA$simpletest");
+#define TEST_DESCRIPTORS_BEGIN (&locDescriptorsBegin)
+#define TEST_DESCRIPTORS_END (&locDescriptorsEnd)
+#elif defined(__ELF__)
+extern "C" TestDescriptor const* const __start_simpletest_tests[] __attribute__((weak, visibility("hidden")));
+extern "C" TestDescriptor const* const __stop_simpletest_tests[] __attribute__((weak, visibility("hidden")));
+#define TEST_DESCRIPTORS_BEGIN __start_simpletest_tests
+#define TEST_DESCRIPTORS_END __stop_simpletest_tests
+#else
+TestDescriptorLink* TestDescriptorLink::ourFirst;
+#endif
+
+template <typename Function>
+static void locForEachDescriptor(Function function)
+{
+#if defined(TEST_DESCRIPTORS_BEGIN)
+	for (TestDescriptor const* const* i = TEST_DESCRIPTORS_BEGIN; i < TEST_DESCRIPTORS_END; ++i)
+	{
+		if (*i) // msvc can pad sections with zeros
+			function(*i);
+	}
+#else
+	for (TestDescriptorLink* i = TestDescriptorLink::ourFirst; i; i = i->next)
+		function(i->descriptor);
+#endif
+}
+
+//---------------------------------------------------------------------------------
+// Serial groups
+//---------------------------------------------------------------------------------
+TestSerialGroup* TestSerialGroup::ourFirst;
+
+TestSerialGroup::TestSerialGroup(char const* group)
+	: myGroup(group)
+	, myNext(ourFirst)
+{
+	ourFirst = this;
+}
+bool TestSerialGroup::IsSerial(char const* group)
+{
+	for (TestSerialGroup* i = ourFirst; i; i = i->myNext)
+	{
+		if (strcmp(i->myGroup, group) == 0)
+			return true;
+	}
+	return false;
+}
+
+//---------------------------------------------------------------------------------
+// Standard / Example runners
+//---------------------------------------------------------------------------------
+static FILE* locResultFile;
+static TestReporter* locReporter;
+static char const* const locDroppedMessages = "%d more messages were dropped, MESSAGE_SPACE or ERROR_ARENA_SIZE is too small.\n";
+static char const* const locUnloggedFailures = "%d more failures were counted but not logged.\n";
+
+// Messages can be longer than Printf's buffer, so they're handed straight to Print
+static void locPrintLine(char const* line)
+{
+	TestFixture::Print(line);
+	TestFixture::Print("\n");
+}
+
+// One "group/name seconds checked errors" line per test followed by its messages, each line indented by a tab
+static void locWriteResult(TestFixture* test)
+{
+	fprintf(locResultFile, "%s/%s %.9g %d %d\n", test->TestGroup(), test->TestName(), test->GetDuration(), test->NumTests(), test->NumErrors());
+
+	char buffer[ERROR_CHUNK_SIZE];
+	for (TestError const* err = test->GetFirstError(), *e = test->GetLastError(); err != e; err = err->next)
+	{
+		for (char const* line = err->Text(buffer, sizeof(buffer)); line;)
+		{
+			char const* end = strchr(line, '\n');
+			fprintf(locResultFile, "\t%.*s\n", int(end ? end - line : strlen(line)), line);
+			line = end ? end + 1 : nullptr;
+		}
+	}
+
+	if (test->NumDroppedMessages())
+	{
+		fputc('\t', locResultFile);
+		fprintf(locResultFile, locDroppedMessages, test->NumDroppedMessages());
+	}
+	if (test->NumUnloggedFailures())
+	{
+		fputc('\t', locResultFile);
+		fprintf(locResultFile, locUnloggedFailures, test->NumUnloggedFailures());
+	}
+}
+//---------------------------------------------------------------------------------
+// Baselines. Tests only regress when they're over the threshold and Welch's
+// t-test says it isn't noise, one sided at 99% confidence. The critical value
+// of Student's t is approximated with a Cornish-Fisher expansion around the
+// normal one, which is plenty for deciding this.
+//---------------------------------------------------------------------------------
+static FILE* locBaselineRecord;
+static bool locBaselineCompare;
+static double locRegressionThreshold;
+static bool locFailRegressions;
+static int locNumRegressions;
+
+static bool locSignificantlySlower(TestBaseline const& measured, TestBaseline const& baseline, double& t)
+{
+	t = 0;
+	if (measured.samples < 2 || baseline.samples < 2)
+		return true;
+
+	double measuredVariance = measured.stddev * measured.stddev / measured.samples;
+	double baselineVariance = baseline.stddev * baseline.stddev / baseline.samples;
+	double variance = measuredVariance + baselineVariance;
+	if (variance <= 0)
+		return true;
+
+	t = (measured.mean - baseline.mean) / sqrt(variance);
+	double df = variance * variance / (measuredVariance * measuredVariance / (measured.samples - 1) + baselineVariance * baselineVariance / (baseline.samples - 1));
+
+	double const z = 2.3263478740408408; // one sided 99% of the normal distribution
+	double const z2 = z * z;
+	double critical = z + z * (z2 + 1) / (4 * df) + z * ((5 * z2 + 16) * z2 + 3) / (96 * df * df) + z * (((3 * z2 + 19) * z2 + 17) * z2 - 15) / (384 * df * df * df);
+	return t > critical;
+}
+
+// Record the measurement or compare it against the baseline. Regressions are logged,
+// and either fail the test or return true with the message so it can be flagged.
+static bool locUpdateBaseline(TestFixture* test, TestBaseline const& measured, char* message, size_t size)
+{
+	if (locBaselineRecord)
+	{
+		fprintf(locBaselineRecord, "%s/%s %.9g %.9g %d\n", test->TestGroup(), test->TestName(), measured.mean, measured.stddev, measured.samples);
+		return false;
+	}
+
+	// when regressions fail the comparison counts as one more check
+	TestBaseline const* baseline = test->GetBaseline();
+	if (!locBaselineCompare || baseline == nullptr)
+		return false;
+	if (locFailRegressions)
+		test->AddTest();
+
+	double t;
+	if (measured.mean <= baseline->mean * (1 + locRegressionThreshold) || !locSignificantlySlower(measured, *baseline, t))
+		return false;
+
+	char took[32], expected[32];
+	locFormatTime(took, sizeof(took), measured.mean);
+	locFormatTime(expected, sizeof(expected), baseline->mean);
+	if (t > 0)
+		snprintf(message, size, "Took %s, %.0f%% slower than its baseline of %s (t = %.1f over %d samples)", took, (measured.mean / baseline->mean - 1) * 100, expected, t, measured.samples);
+	else
+		snprintf(message, size, "Took %s, %.0f%% slower than its baseline of %s", took, (measured.mean / baseline->mean - 1) * 100, expected);
+
+	if (locFailRegressions)
+		test->AddError();
+	test->LogMessage("%s", message);
+	if (locFailRegressions)
+		return false;
+
+	++locNumRegressions;
+	return true;
+}
+
+//---------------------------------------------------------------------------------
+// Run history. A memory mapped file with the last result and duration of every
+// test keyed by group/name, which the next run uses to put failures or slow tests
+// first. Entries are written in place as tests are reported, so whatever ran is
+// remembered even when the run crashes or stops early. Room for every selected
+// test is mapped up front and the file is trimmed back to the entries in use
+// when it's closed. Only one run should use a history file at a time.
+//---------------------------------------------------------------------------------
+#if RUN_HISTORY
+struct TestHistoryHeader
+{
+	char magic[8];
+	unsigned entrySize;
+	unsigned count;
+};
+struct TestHistoryEntry
+{
+	double duration;
+	int failed; // 1 when the test failed the last time it ran
+	unsigned failures; // runs in a row it's failed
+	char key[HISTORY_KEY_LENGTH]; // group/name
+};
+static char const locHistoryMagic[8] = { 's', 't', 'h', 'i', 's', 't', '1', '\n' };
+
+static TestHistoryHeader* locHistory;
+static unsigned locHistoryCapacity;
+#if defined(_WIN32)
+static HANDLE locHistoryFile = INVALID_HANDLE_VALUE;
+static HANDLE locHistoryMapping;
+#else
+static int locHistoryFile = -1;
+#endif
+
+static TestHistoryEntry* locHistoryEntries() { return (TestHistoryEntry*)(locHistory + 1); }
+static size_t locHistorySize(unsigned count) { return sizeof(TestHistoryHeader) + size_t(count) * sizeof(TestHistoryEntry); }
+
+// Map the history with room for extra more entries, a file that's missing or isn't a history starts out empty
+static bool locMapHistory(char const* path, unsigned extra)
+{
+	TestHistoryHeader header = {};
+#if defined(_WIN32)
+	locHistoryFile = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (locHistoryFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	DWORD read = 0;
+	if (!ReadFile(locHistoryFile, &header, sizeof(header), &read, nullptr) || read != sizeof(header))
+		header = TestHistoryHeader();
+	LARGE_INTEGER fileSize;
+	size_t existing = GetFileSizeEx(locHistoryFile, &fileSize) ? size_t(fileSize.QuadPart) : 0;
+#else
+	locHistoryFile = open(path, O_RDWR | O_CREAT, 0644);
+	if (locHistoryFile < 0)
+		return false;
+
+	struct stat info;
+	size_t existing = fstat(locHistoryFile, &info) == 0 ? size_t(info.st_size) : 0;
+	if (pread(locHistoryFile, &header, sizeof(header), 0) != ssize_t(sizeof(header)))
+		header = TestHistoryHeader();
+#endif
+
+	// anything that doesn't look like a history, or has entries cut off, is thrown away
+	bool valid = memcmp(header.magic, locHistoryMagic, sizeof(locHistoryMagic)) == 0 && header.entrySize == sizeof(TestHistoryEntry) && locHistorySize(header.count) <= existing;
+	unsigned count = valid ? header.count : 0;
+	locHistoryCapacity = count + extra;
+	size_t size = locHistorySize(locHistoryCapacity);
+
+#if defined(_WIN32)
+	locHistoryMapping = CreateFileMappingA(locHistoryFile, nullptr, PAGE_READWRITE, DWORD((unsigned long long)size >> 32), DWORD(size), nullptr);
+	locHistory = locHistoryMapping ? (TestHistoryHeader*)MapViewOfFile(locHistoryMapping, FILE_MAP_WRITE, 0, 0, size) : nullptr;
+	if (locHistory == nullptr)
+	{
+		if (locHistoryMapping)
+			CloseHandle(locHistoryMapping);
+		CloseHandle(locHistoryFile);
+		locHistoryFile = INVALID_HANDLE_VALUE;
+		return false;
+	}
+#else
+	void* data = existing < size && ftruncate(locHistoryFile, off_t(size)) != 0 ? MAP_FAILED : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, locHistoryFile, 0);
+	if (data == MAP_FAILED)
+	{
+		close(locHistoryFile);
+		locHistoryFile = -1;
+		return false;
+	}
+	locHistory = (TestHistoryHeader*)data;
+#endif
+
+	if (!valid)
+	{
+		memcpy(locHistory->magic, locHistoryMagic, sizeof(locHistoryMagic));
+		locHistory->entrySize = sizeof(TestHistoryEntry);
+		locHistory->count = 0;
+	}
+	return true;
+}
+static void locUnmapHistory()
+{
+	if (locHistory == nullptr)
+		return;
+
+	size_t used = locHistorySize(locHistory->count);
+#if defined(_WIN32)
+	UnmapViewOfFile(locHistory);
+	CloseHandle(locHistoryMapping);
+	LARGE_INTEGER end;
+	end.QuadPart = (long long)used;
+	if (SetFilePointerEx(locHistoryFile, end, nullptr, FILE_BEGIN))
+		SetEndOfFile(locHistoryFile);
+	CloseHandle(locHistoryFile);
+	locHistoryFile = INVALID_HANDLE_VALUE;
+	locHistoryMapping = nullptr;
+#else
+	munmap(locHistory, locHistorySize(locHistoryCapacity));
+	if (ftruncate(locHistoryFile, off_t(used)) != 0) {} // a longer file still reads back the same
+	close(locHistoryFile);
+	locHistoryFile = -1;
+#endif
+	locHistory = nullptr;
+}
+
+// Remember how a test did, giving it an entry when it's the first time it ran
+static void locRecordHistory(TestFixture* test, int& index)
+{
+	if (locHistory == nullptr)
+		return;
+
+	TestHistoryEntry* entries = locHistoryEntries();
+	if (index < 0)
+	{
+		char key[HISTORY_KEY_LENGTH];
+		int length = snprintf(key, sizeof(key), "%s/%s", test->TestGroup(), test->TestName());
+		if (length < 0 || length >= HISTORY_KEY_LENGTH || locHistory->count >= locHistoryCapacity)
+			return;
+
+		index = int(locHistory->count);
+		memset(&entries[index], 0, sizeof(TestHistoryEntry));
+		memcpy(entries[index].key, key, size_t(length));
+		++locHistory->count;
+	}
+
+	TestHistoryEntry& entry = entries[index];
+	entry.duration = test->GetDuration();
+	entry.failed = test->NumErrors() != 0;
+	entry.failures = entry.failed ? entry.failures + 1 : 0;
+}
+#else
+static void locUnmapHistory() {}
+static void locRecordHistory(TestFixture*, int&) {}
+#endif
+
+//---------------------------------------------------------------------------------
+// Fail fast. Runners stop handing out tests once one fails, tests that were
+// already running finish and are reported, everything else is left out.
+//---------------------------------------------------------------------------------
+static bool locFailFast;
+static std::atomic<bool> locStopRun;
+static int locNumReported;
+
+static void locCheckFailFast(TestFixture* test)
+{
+	if (locFailFast && test->NumErrors())
+		locStopRun.store(true, std::memory_order_relaxed);
+}
+
+static void locReportTest(TestFixture* test, TestFixture::OutputMode output, bool printedName, bool reportedBegin = false)
+{
+	++locNumReported;
+
+	char regression[256];
+	TestBaseline measured = { test->GetDuration(), test->GetDurationStddev(), test->NumSamples() };
+	bool flagged = test->NumErrors() == 0 && !test->GetBenchmark() && locUpdateBaseline(test, measured, regression, sizeof(regression));
+
+	if (locResultFile)
+		locWriteResult(test);
+
+	for (TestReporter* i = locReporter; i; i = i->myNext)
+	{
+		if (!reportedBegin)
+			i->BeginTest(*test);
+		i->EndTest(*test);
+	}
+
+	if (test->NumErrors() == 0)
+	{
+		if (output == TestFixture::Verbose)
+		{
+			if (!printedName)
+				TestFixture::Printf("Running [%s/%s]", test->TestGroup(), test->TestName());
+			TestFixture::Printf(": Passed %d out of %d tests in %g seconds\n", test->NumTests(), test->NumTests(), test->GetDuration());
+
+			// passing tests only have informational messages, i.e. from hooks
+			char buffer[ERROR_CHUNK_SIZE];
+			for (TestError const* err = test->GetFirstError(), *e = test->GetLastError(); err != e; err = err->next)
+				locPrintLine(err->Text(buffer, sizeof(buffer)));
+
+			if (test->NumDroppedMessages())
+				TestFixture::Printf(locDroppedMessages, test->NumDroppedMessages());
+			if (test->NumUnloggedFailures())
+				TestFixture::Printf(locUnloggedFailures, test->NumUnloggedFailures());
+		}
+		else if (flagged && output == TestFixture::Normal)
+		{
+			TestFixture::Printf("[%s/%s]: %s\n", test->TestGroup(), test->TestName(), regression);
+		}
+		return;
+	}
+
+	if (output != TestFixture::Silent)
+	{
+		if (!printedName)
+			TestFixture::Printf(output == TestFixture::Verbose ? "Running [%s/%s]" : "[%s/%s]", test->TestGroup(), test->TestName());
+
+		TestFixture::Printf(": Failed %d out of %d tests\n", test->NumErrors(), test->NumTests());
+
+		char buffer[ERROR_CHUNK_SIZE];
+		for (TestError const* err = test->GetFirstError(), *e = test->GetLastError(); err != e; err = err->next)
+		{
+			locPrintLine(err->Text(buffer, sizeof(buffer)));
+		}
+
+		if (test->NumDroppedMessages())
+			TestFixture::Printf(locDroppedMessages, test->NumDroppedMessages());
+		if (test->NumUnloggedFailures())
+			TestFixture::Printf(locUnloggedFailures, test->NumUnloggedFailures());
+	}
+}
+static bool locExecuteTest(TestFixture* test, TestFixture::OutputMode output)
+{
+	if (output == TestFixture::Verbose)
+		TestFixture::Printf("Running [%s/%s]", test->TestGroup(), test->TestName());
+	for (TestReporter* i = locReporter; i; i = i->myNext)
+		i->BeginTest(*test);
+
+	test->ExecuteTest();
+	locCheckFailFast(test);
+	locReportTest(test, output, output == TestFixture::Verbose, true);
+	test->ReleaseErrors();
+	return test->NumErrors() == 0;
+}
+void TestFixture::Printf(char const* string, ...)
+{
+	char tempSpace[4096];
+	va_list args;
+
+	va_start(args, string);
+
+	vsnprintf(tempSpace, sizeof(tempSpace), string, args);
+
+	va_end(args);
+
+	TestFixture::Print(tempSpace);
+}
+
+//---------------------------------------------------------------------------------
+// Watchdog. Tests with a timeout never run on the thread that reports them, so
+// that thread can give up on one that hangs. The hung thread is sent
+// WATCHDOG_SIGNAL, whose handler captures its stack and then parks it there for
+// good, and a fresh thread carries on with the rest of its queue. Worker
+// processes are stopped the same way before they're killed. A parked thread
+// keeps any locks it holds, a deadlocked test wasn't going to let go of them,
+// but it's never parked holding one of the framework's.
+//---------------------------------------------------------------------------------
+struct TestStack
+{
+	std::atomic<int> depth; // frames captured, -1 until the thread has stopped
+	void* frames[WATCHDOG_STACK_DEPTH];
+};
+
+static bool locWatching;
+static TestStack locStack;
+static TestStack* locStackOut = &locStack; // worker processes capture into their shared ring instead
+
+static double locNow() { return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+#if TEST_SIGNALS
+static struct sigaction locLastWatchdogAction;
+
+static void locParkThread(int)
+{
+	// a thread inside the framework parks as it leaves instead, with the stack it has then
+	if (locFrameworkDepth)
+	{
+		locParkPending = 1;
+		return;
+	}
+
+#if TEST_BACKTRACE
+	int depth = backtrace(locStackOut->frames, WATCHDOG_STACK_DEPTH);
+#else
+	int depth = 0;
+#endif
+	locPublishCounts();
+	locStackOut->depth.store(depth, std::memory_order_release);
+	for (;;)
+		pause();
+}
+#endif
+
+static void locBeginWatch()
+{
+#if TEST_SIGNALS
+#if TEST_BACKTRACE
+	// the first backtrace loads the unwinder, which is no job for a signal handler
+	void* frame;
+	backtrace(&frame, 1);
+#endif
+	struct sigaction action = {};
+	action.sa_handler = locParkThread;
+	sigemptyset(&action.sa_mask);
+	sigaction(WATCHDOG_SIGNAL, &action, &locLastWatchdogAction);
+#endif
+}
+static void locEndWatch()
+{
+#if TEST_SIGNALS
+	sigaction(WATCHDOG_SIGNAL, &locLastWatchdogAction, nullptr);
+#endif
+}
+
+// Give a stopped thread or process a second to capture its stack
+static bool locWaitForStack(TestStack const& stack)
+{
+	for (int i = 0; i < 1000 && stack.depth.load(std::memory_order_acquire) < 0; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return stack.depth.load(std::memory_order_acquire) >= 0;
+}
+
+// Stop the thread of a hung test for good, false when it's still running
+static bool locStopThread(std::thread& thread)
+{
+#if TEST_SIGNALS
+	locStack.depth.store(-1, std::memory_order_relaxed);
+	return pthread_kill(thread.native_handle(), WATCHDOG_SIGNAL) == 0 && locWaitForStack(locStack);
+#elif defined(_WIN32)
+	locStack.depth.store(0, std::memory_order_relaxed);
+	return SuspendThread(thread.native_handle()) != DWORD(-1);
+#else
+	(void)thread;
+	return false;
+#endif
+}
+
+//---------------------------------------------------------------------------------
+// Parallel runner. Every thread owns a deque of tests, popping work from the
+// front of its own deque and stealing from the back of the others when it
+// runs dry. Results stay in the fixtures and are reported by the calling thread
+// in registration order so output never interleaves.
+//---------------------------------------------------------------------------------
+struct alignas(64) TestWorker : TestSpinLock
+{
+	TestFixture* myHead;
+	TestFixture* myTail;
+	std::thread myThread;
+	std::atomic<TestFixture*> myRunning; // test with a timeout the thread is running, taken by the watchdog when it hangs
+	std::atomic<double> myDeadline;
+};
+
+static TestWorker locWorkers[MAX_JOBS];
+static std::atomic<int> locNumWorking; // worker threads still taking tests, threads the watchdog gave up on don't count
+
+struct TestRunner
+{
+	static void Push(TestWorker& worker, TestFixture* test)
+	{
+		test->myNextQueued = nullptr;
+		test->myPrevQueued = worker.myTail;
+		if (worker.myTail)
+			worker.myTail->myNextQueued = test;
+		else
+			worker.myHead = test;
+		worker.myTail = test;
+	}
+	static TestFixture* PopFront(TestWorker& worker)
+	{
+		worker.Lock();
+		TestFixture* test = worker.myHead;
+		if (test)
+		{
+			worker.myHead = test->myNextQueued;
+			if (worker.myHead)
+				worker.myHead->myPrevQueued = nullptr;
+			else
+				worker.myTail = nullptr;
+		}
+		worker.Unlock();
+		return test;
+	}
+	static TestFixture* PopBack(TestWorker& worker)
+	{
+		worker.Lock();
+		TestFixture* test = worker.myTail;
+		if (test)
+		{
+			worker.myTail = test->myPrevQueued;
+			if (worker.myTail)
+				worker.myTail->myNextQueued = nullptr;
+			else
+				worker.myHead = nullptr;
+		}
+		worker.Unlock();
+		return test;
+	}
+	static TestFixture* NextTest(int worker, int numWorkers)
+	{
+		if (locStopRun.load(std::memory_order_relaxed))
+			return nullptr;
+		if (TestFixture* test = PopFront(locWorkers[worker]))
+			return test;
+
+		for (int i = 1; i < numWorkers; ++i)
+		{
+			if (TestFixture* test = PopBack(locWorkers[(worker + i) % numWorkers]))
+				return test;
+		}
+		return nullptr;
+	}
+	static void Run(TestFixture* test)
+	{
+		test->ExecuteTest();
+		locCheckFailFast(test);
+		test->myFinished.store(true, std::memory_order_release);
+	}
+	// Work out how long each test may run, the watchdog is only needed when one of them has a limit
+	static bool SetTimeouts(TestFixture* first, double timeout)
+	{
+		bool watching = false;
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			double limit = i->Limits().timeout;
+			if (limit <= 0)
+				limit = timeout;
+			i->myTimeout = limit > 0 ? limit * TestFixture::ourNumSamples : 0;
+			watching |= limit > 0;
+		}
+		return watching;
+	}
+	// Report a finished test and remember how it did
+	static bool Report(TestFixture* test, TestFixture::OutputMode output)
+	{
+		if (test->myAbandoned)
+			return ReportAbandoned(test, output);
+
+		locReportTest(test, output, false);
+		test->ReleaseErrors();
+		locRecordHistory(test, test->myHistory);
+		return test->NumErrors() == 0;
+	}
+	// Tests that can be in flight together all begin on the calling thread before anything else runs, then end in order.
+	// Tests with a timeout are left to the watched threads since nothing could step in if one hung here.
+	static void RunOverlapped(TestFixture* first)
+	{
+		TestFixture* started = nullptr;
+		TestFixture** tail = &started;
+		for (TestFixture* i = first; i && !locStopRun.load(std::memory_order_relaxed); i = i->myNextSelected)
+		{
+			if (i->myTimeout <= 0 && i->BeginExecuteTest())
+			{
+				*tail = i;
+				tail = &i->myNextQueued;
+			}
+		}
+		*tail = nullptr;
+
+		for (TestFixture* i = started; i; i = i->myNextQueued)
+		{
+			i->EndExecuteTest();
+			locCheckFailFast(i);
+			i->myFinished.store(true, std::memory_order_release);
+		}
+	}
+	// Run a test the watchdog can see, false when it gave up on the test and this thread has been replaced
+	static bool RunWatched(TestWorker& worker, TestFixture* test)
+	{
+		if (test->myTimeout <= 0)
+		{
+			Run(test);
+			return true;
+		}
+
+		worker.myDeadline.store(locNow() + test->myTimeout, std::memory_order_relaxed);
+		worker.myRunning.store(test, std::memory_order_release);
+		test->ExecuteTest();
+		TestFixture* running = test;
+		if (!worker.myRunning.compare_exchange_strong(running, nullptr, std::memory_order_acq_rel))
+			return false;
+
+		locCheckFailFast(test);
+		test->myFinished.store(true, std::memory_order_release);
+		return true;
+	}
+	static void WorkerMain(int worker, int numWorkers)
+	{
+		while (TestFixture* test = NextTest(worker, numWorkers))
+		{
+			if (!RunWatched(locWorkers[worker], test))
+				return;
+		}
+		locNumWorking.fetch_sub(1, std::memory_order_release);
+	}
+	// Fail a test the watchdog gave up on, with where it was stuck when its stack was captured
+	static void TimedOut(TestFixture* test, char const* runner, char const* unstopped, bool stopped, TestStack const& stack)
+	{
+		char limit[32];
+		locFormatTime(limit, sizeof(limit), test->myTimeout);
+		test->myDuration = test->myTimeout;
+		test->myDurationStddev = 0;
+		test->AddTest();
+		test->AddError();
+
+		// the first two frames are the signal handler and the trampoline that called it
+		int depth = stopped ? stack.depth.load(std::memory_order_acquire) : 0;
+		if (!stopped)
+			test->LogMessage("Timed out after %s, its %s couldn't be stopped and %s", limit, runner, unstopped);
+		else if (depth <= 2)
+			test->LogMessage("Timed out after %s, its %s was stopped", limit, runner);
+		else
+			test->LogMessage("Timed out after %s, its %s was stopped in", limit, runner);
+#if TEST_BACKTRACE
+		if (depth > 2)
+		{
+			char** symbols = backtrace_symbols(stack.frames, depth);
+			for (int i = 2; i < depth; ++i)
+			{
+				if (symbols)
+					test->LogMessage("    %s", symbols[i]);
+				else
+					test->LogMessage("    %p", stack.frames[i]);
+			}
+			free(symbols);
+		}
+#endif
+
+		locCheckFailFast(test);
+		test->myFinished.store(true, std::memory_order_release);
+	}
+	// A test whose thread couldn't be stopped may still be writing to its fixture, so its
+	// timeout is reported through a stand in and the fixture itself is left alone for good
+	static TestFixture* ourAbandoned;
+
+	static bool ReportAbandoned(TestFixture* test, TestFixture::OutputMode output)
+	{
+		alignas(TestStandIn) char storage[sizeof(TestStandIn)];
+		TestStandIn& standIn = *TestStandIn::Construct(storage, *test);
+		TestFixture* fixture = &standIn;
+		fixture->myTimeout = test->myTimeout;
+		TimedOut(fixture, "thread", "was left running", false, locStack);
+		locReportTest(fixture, output, false);
+		locRecordHistory(fixture, test->myHistory);
+		standIn.~TestStandIn();
+		return false;
+	}
+	static bool IsAbandoned(TestDescriptor const* descriptor)
+	{
+		for (TestFixture* i = ourAbandoned; i; i = i->myNextQueued)
+		{
+			if (i->myDescriptor == descriptor)
+				return true;
+		}
+		return false;
+	}
+	// Give up on tests past their deadline, their threads are stopped and replaced by fresh ones
+	static void Watch(int numWorkers)
+	{
+		double now = locNow();
+		for (int i = 0; i < numWorkers; ++i)
+		{
+			TestWorker& worker = locWorkers[i];
+			TestFixture* test = worker.myRunning.load(std::memory_order_acquire);
+			if (test == nullptr || now < worker.myDeadline.load(std::memory_order_relaxed))
+				continue;
+			if (!worker.myRunning.compare_exchange_strong(test, nullptr, std::memory_order_acq_rel))
+				continue;
+
+			if (locStopThread(worker.myThread))
+			{
+				TimedOut(test, "thread", "was left running", true, locStack);
+			}
+			else
+			{
+				// queues are done with it, so it's kept on the abandoned list through myNextQueued
+				test->myAbandoned = true;
+				test->myNextQueued = ourAbandoned;
+				ourAbandoned = test;
+				if (locFailFast)
+					locStopRun.store(true, std::memory_order_relaxed);
+				test->myFinished.store(true, std::memory_order_release);
+			}
+			worker.myThread.detach();
+			worker.myThread = std::thread(WorkerMain, i, numWorkers);
+		}
+	}
+	//-----------------------------------------------------------------------------
+	// Index: tests are chained per group in registration order, groups are
+	// sorted by name and both groups and names are hashed for exact lookups.
+	// Names are also sorted, starting wherever each first character does.
+	//-----------------------------------------------------------------------------
+	static TestFixture* ourGroupBuckets[INDEX_BUCKETS];
+	static TestFixture* ourNameBuckets[INDEX_BUCKETS];
+	static TestFixture* ourNameStarts[256];
+	static TestFixture* ourFirstGroup;
+	static int ourNumIndexed;
+	static unsigned ourSelection;
+
+	static unsigned Hash(char const* begin, char const* end)
+	{
+		unsigned hash = 2166136261u;
+		for (; begin != end; ++begin)
+			hash = (hash ^ (unsigned char)*begin) * 16777619u;
+		return hash % INDEX_BUCKETS;
+	}
+	static bool Equals(char const* begin, char const* end, char const* text)
+	{
+		size_t length = end - begin;
+		return strncmp(begin, text, length) == 0 && text[length] == 0;
+	}
+
+	// Stable merge sort of an intrusive list
+	template <typename Less>
+	static TestFixture* Sort(TestFixture* list, TestFixture* TestFixture::*next, Less less)
+	{
+		if (list == nullptr || list->*next == nullptr)
+			return list;
+
+		TestFixture* slow = list;
+		for (TestFixture* fast = list->*next; fast && fast->*next; fast = fast->*next->*next)
+			slow = slow->*next;
+
+		TestFixture* right = slow->*next;
+		slow->*next = nullptr;
+
+		TestFixture* a = Sort(list, next, less);
+		TestFixture* b = Sort(right, next, less);
+
+		TestFixture* first = nullptr;
+		TestFixture** tail = &first;
+		while (a && b)
+		{
+			TestFixture*& smaller = less(b, a) ? b : a;
+			*tail = smaller;
+			tail = &(smaller->*next);
+			smaller = smaller->*next;
+		}
+		*tail = a ? a : b;
+		return first;
+	}
+
+	static void BuildIndex()
+	{
+		if (!TestFixture::ourIndexDirty)
+			return;
+
+		memset(ourGroupBuckets, 0, sizeof(ourGroupBuckets));
+		memset(ourNameBuckets, 0, sizeof(ourNameBuckets));
+		memset(ourNameStarts, 0, sizeof(ourNameStarts));
+		ourFirstGroup = nullptr;
+
+		int order = 0;
+		for (TestFixture* i = TestFixture::ourFirstTest; i; i = i->myNextTest)
+		{
+			i->myName = i->TestName();
+			i->myGroup = i->TestGroup();
+			i->myOrder = order++;
+			i->myNextInGroup = nullptr;
+			i->myNextName = i->myNextTest;
+
+			TestFixture*& nameBucket = ourNameBuckets[Hash(i->myName, i->myName + strlen(i->myName))];
+			i->myNextNameInBucket = nameBucket;
+			nameBucket = i;
+
+			TestFixture*& groupBucket = ourGroupBuckets[Hash(i->myGroup, i->myGroup + strlen(i->myGroup))];
+			TestFixture* group = groupBucket;
+			while (group && strcmp(group->myGroup, i->myGroup) != 0)
+				group = group->myNextGroupInBucket;
+
+			if (group)
+			{
+				group->myLastInGroup->myNextInGroup = i;
+				group->myLastInGroup = i;
+			}
+			else
+			{
+				i->myLastInGroup = i;
+				i->myNextGroupInBucket = groupBucket;
+				groupBucket = i;
+				i->myNextGroup = ourFirstGroup;
+				ourFirstGroup = i;
+			}
+		}
+
+		ourNumIndexed = order;
+		ourFirstGroup = Sort(ourFirstGroup, &TestFixture::myNextGroup, [](TestFixture* a, TestFixture* b) { return strcmp(a->myGroup, b->myGroup) < 0; });
+
+		TestFixture* names = Sort(TestFixture::ourFirstTest, &TestFixture::myNextName, [](TestFixture* a, TestFixture* b) { return strcmp(a->myName, b->myName) < 0; });
+		for (TestFixture* i = names; i; i = i->myNextName)
+		{
+			TestFixture*& start = ourNameStarts[(unsigned char)i->myName[0]];
+			if (start == nullptr)
+				start = i;
+		}
+		TestFixture::ourIndexDirty = false;
+	}
+	static TestFixture* FindGroup(char const* begin, char const* end)
+	{
+		for (TestFixture* i = ourGroupBuckets[Hash(begin, end)]; i; i = i->myNextGroupInBucket)
+		{
+			if (Equals(begin, end, i->myGroup))
+				return i;
+		}
+		return nullptr;
+	}
+
+	//-----------------------------------------------------------------------------
+	// Pattern lists are parsed in place each time they're used so filters never
+	// need to be copied anywhere
+	//-----------------------------------------------------------------------------
+	struct Pattern
+	{
+		char const* begin;
+		char const* end;
+		bool negative;
+		bool wildcard;
+	};
+	struct Filter
+	{
+		Filter(char const* filter) : myFilter(filter), myPositives(0), myWildcards(0), myPrefix(nullptr), myPrefixLength(0)
+		{
+			Pattern pattern;
+			for (char const* i = myFilter; NextPattern(i, pattern);)
+			{
+				if (!pattern.negative)
+				{
+					myPrefix = pattern.begin;
+					myPrefixLength = strcspn(pattern.begin, "*?,");
+				}
+				myPositives += !pattern.negative;
+				myWildcards += !pattern.negative && pattern.wildcard;
+			}
+		}
+		bool NextPattern(char const*& cursor, Pattern& pattern) const
+		{
+			if (cursor == nullptr)
+				return false;
+
+			while (*cursor == ',' || *cursor == ' ')
+				++cursor;
+			if (*cursor == 0)
+				return false;
+
+			pattern.negative = *cursor == '-';
+			pattern.begin = cursor + pattern.negative;
+			pattern.wildcard = false;
+			for (cursor = pattern.begin; *cursor && *cursor != ','; ++cursor)
+				pattern.wildcard |= *cursor == '*' || *cursor == '?';
+			pattern.end = cursor;
+			return true;
+		}
+		static bool Match(char const* begin, char const* end, char const* text)
+		{
+			// iterative glob, backtracking only to the most recent *
+			char const* star = nullptr;
+			char const* starText = nullptr;
+			while (*text)
+			{
+				if (begin != end && (*begin == '?' || *begin == *text))
+				{
+					++begin;
+					++text;
+				}
+				else if (begin != end && *begin == '*')
+				{
+					star = begin++;
+					starText = text;
+				}
+				else if (star)
+				{
+					begin = star + 1;
+					text = ++starText;
+				}
+				else
+				{
+					return false;
+				}
+			}
+			while (begin != end && *begin == '*')
+				++begin;
+			return begin == end;
+		}
+		bool Match(char const* text) const
+		{
+			bool matched = myPositives == 0;
+			Pattern pattern;
+			for (char const* i = myFilter; NextPattern(i, pattern);)
+			{
+				if (pattern.negative || !matched)
+				{
+					bool match = pattern.wildcard ? Match(pattern.begin, pattern.end, text) : Equals(pattern.begin, pattern.end, text);
+					if (match && pattern.negative)
+						return false;
+					matched |= match;
+				}
+			}
+			return matched;
+		}
+		bool ExactOnly() const { return myPositives > 0 && myWildcards == 0; }
+
+		// With a single pattern every match shares its literal prefix, so a sorted walk can stop once it's passed
+		bool PastPrefix(char const* text) const { return myPositives == 1 && strncmp(text, myPrefix, myPrefixLength) > 0; }
+
+		char const* myFilter;
+		int myPositives;
+		int myWildcards;
+		char const* myPrefix;
+		size_t myPrefixLength;
+	};
+
+	static void Add(TestFixture* test, TestFixture**& tail, int& count)
+	{
+		if (test->mySelection == ourSelection || test->myAbandoned)
+			return;
+
+		test->mySelection = ourSelection;
+		test->myNextSelected = nullptr;
+		test->myHistory = -1;
+		test->myFinished.store(false, std::memory_order_relaxed);
+		*tail = test;
+		tail = &test->myNextSelected;
+		++count;
+	}
+	static void AddGroup(TestFixture* group, Filter const& names, bool benchmarks, TestFixture**& tail, int& count)
+	{
+		for (TestFixture* i = group; i; i = i->myNextInGroup)
+		{
+			if ((i->myBenchmark != nullptr) == benchmarks && names.Match(i->myName))
+				Add(i, tail, count);
+		}
+	}
+
+	//-----------------------------------------------------------------------------
+	// Select tests matching the filters, linked through myNextSelected in
+	// registration order. Exact names and groups go straight to their hash
+	// bucket, a single name pattern with a literal prefix walks just the sorted
+	// names sharing it and other wildcards visit the sorted list of groups.
+	//-----------------------------------------------------------------------------
+	static TestFixture* Select(TestFixture::ExecuteOptions const& options, bool benchmarks, int& count)
+	{
+		BuildIndex();
+		++ourSelection;
+
+		Filter groups(options.groupFilter);
+		Filter names(options.nameFilter);
+
+		TestFixture* first = nullptr;
+		TestFixture** tail = &first;
+		count = 0;
+
+		Pattern pattern;
+		if (names.ExactOnly())
+		{
+			for (char const* i = names.myFilter; names.NextPattern(i, pattern);)
+			{
+				if (pattern.negative)
+					continue;
+
+				for (TestFixture* test = ourNameBuckets[Hash(pattern.begin, pattern.end)]; test; test = test->myNextNameInBucket)
+				{
+					if (Equals(pattern.begin, pattern.end, test->myName) && (test->myBenchmark != nullptr) == benchmarks && names.Match(test->myName) && groups.Match(test->myGroup))
+						Add(test, tail, count);
+				}
+			}
+		}
+		else if (groups.ExactOnly())
+		{
+			for (char const* i = groups.myFilter; groups.NextPattern(i, pattern);)
+			{
+				TestFixture* group = pattern.negative ? nullptr : FindGroup(pattern.begin, pattern.end);
+				if (group && groups.Match(group->myGroup))
+					AddGroup(group, names, benchmarks, tail, count);
+			}
+		}
+		else if (groups.myPositives == 0 && names.myPositives == 1 && names.myPrefixLength > 0)
+		{
+			for (TestFixture* test = ourNameStarts[(unsigned char)*names.myPrefix]; test && !names.PastPrefix(test->myName); test = test->myNextName)
+			{
+				if ((test->myBenchmark != nullptr) == benchmarks && names.Match(test->myName) && groups.Match(test->myGroup))
+					Add(test, tail, count);
+			}
+		}
+		else
+		{
+			for (TestFixture* group = ourFirstGroup; group && !groups.PastPrefix(group->myGroup); group = group->myNextGroup)
+			{
+				if (groups.Match(group->myGroup))
+					AddGroup(group, names, benchmarks, tail, count);
+			}
+		}
+
+		// lazily registered tests don't have an index, but scanning descriptors is cheap and needs no virtual calls
+		if (!benchmarks)
+		{
+			int order = ourNumIndexed;
+			locForEachDescriptor([&](TestDescriptor const* descriptor)
+			{
+				++order;
+				// an abandoned test still owns the storage its descriptor constructs into
+				if (groups.Match(descriptor->group) && names.Match(descriptor->name) && !IsAbandoned(descriptor))
+				{
+					TestFixture* test = descriptor->create();
+					test->myDescriptor = descriptor;
+					test->myName = descriptor->name;
+					test->myGroup = descriptor->group;
+					test->myOrder = order;
+					Add(test, tail, count);
+				}
+			});
+		}
+
+		// section order isn't declaration order, so lazy tests are put in file and line order instead
+		return Sort(first, &TestFixture::myNextSelected, [](TestFixture* a, TestFixture* b)
+		{
+			if (a->myDescriptor && b->myDescriptor)
+			{
+				int file = strcmp(a->myDescriptor->file, b->myDescriptor->file);
+				return file ? file < 0 : a->myDescriptor->line < b->myDescriptor->line;
+			}
+			return a->myOrder < b->myOrder;
+		});
+	}
+
+	// Destroy any lazily registered tests once everything is reported
+	static void Release(TestFixture* first)
+	{
+		while (first)
+		{
+			TestFixture* next = first->myNextSelected;
+			if (first->myDescriptor && !first->myAbandoned)
+				first->~TestFixture();
+			first = next;
+		}
+	}
+	//-----------------------------------------------------------------------------
+	// Sharding. Tests are dealt out round robin in selection order, or with a
+	// timing file the longest tests are placed first, each going to whichever
+	// shard has the least work so far. Either way every shard picks the same
+	// split, so no coordination is needed between them.
+	//-----------------------------------------------------------------------------
+	static TestFixture* ourLazyBuckets[INDEX_BUCKETS];
+	static double ourShardLoads[MAX_SHARDS];
+	static int ourShardHeap[MAX_SHARDS];
+
+	static TestFixture* FindSelected(char const* group, char const* groupEnd, char const* name, char const* nameEnd)
+	{
+		unsigned bucket = Hash(name, nameEnd);
+		TestFixture* const chains[] = { ourNameBuckets[bucket], ourLazyBuckets[bucket] };
+		for (TestFixture* chain : chains)
+		{
+			for (TestFixture* i = chain; i; i = i->myNextNameInBucket)
+			{
+				if (i->mySelection == ourSelection && Equals(name, nameEnd, i->myName) && Equals(group, groupEnd, i->myGroup))
+					return i;
+			}
+		}
+		return nullptr;
+	}
+	// Lazily registered tests aren't in the index, they get buckets of their own while looking tests up by name
+	static void IndexLazy(TestFixture* first)
+	{
+		memset(ourLazyBuckets, 0, sizeof(ourLazyBuckets));
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			if (i->myDescriptor)
+			{
+				TestFixture*& bucket = ourLazyBuckets[Hash(i->myName, i->myName + strlen(i->myName))];
+				i->myNextNameInBucket = bucket;
+				bucket = i;
+			}
+		}
+	}
+	// Call function with every selected test found in a result or baseline file and the values after its name
+	template <typename Function>
+	static bool ReadTestLines(char const* path, TestFixture* first, Function function)
+	{
+		FILE* file = fopen(path, "r");
+		if (file == nullptr)
+			return false;
+
+		IndexLazy(first);
+
+		char line[1024];
+		bool lineStart = true;
+		while (fgets(line, sizeof(line), file))
+		{
+			bool isStart = lineStart;
+			lineStart = strchr(line, '\n') != nullptr;
+			if (!isStart || line[0] == '\t')
+				continue;
+
+			char* slash = strchr(line, '/');
+			char* end = slash ? strchr(slash, ' ') : nullptr;
+			if (end == nullptr)
+				continue;
+
+			if (TestFixture* test = FindSelected(line, slash, slash + 1, end))
+				function(test, end);
+		}
+
+		fclose(file);
+		return true;
+	}
+	// Set the duration of every selected test found in the file, leaving the rest alone
+	static bool ReadTimings(char const* path, TestFixture* first)
+	{
+		return ReadTestLines(path, first, [](TestFixture* test, char const* values) { test->myDuration = strtod(values, nullptr); });
+	}
+	static bool ReadBaseline(char const* path, TestFixture* first)
+	{
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+			i->myBaseline = TestBaseline();
+
+		return ReadTestLines(path, first, [](TestFixture* test, char const* values)
+		{
+			char* end;
+			TestBaseline& baseline = test->myBaseline;
+			baseline.mean = strtod(values, &end);
+			baseline.stddev = strtod(end, &end);
+			baseline.samples = (int)strtol(end, &end, 10);
+			if (baseline.mean <= 0 || baseline.samples < 1)
+				baseline = TestBaseline();
+		});
+	}
+#if RUN_HISTORY
+	// Point every selected test at its entry in the history, tests without one get an entry when they're reported
+	static void MatchHistory(TestFixture* first)
+	{
+		IndexLazy(first);
+
+		TestHistoryEntry* entries = locHistoryEntries();
+		for (unsigned i = 0; i < locHistory->count; ++i)
+		{
+			char* key = entries[i].key;
+			key[HISTORY_KEY_LENGTH - 1] = 0;
+
+			char const* slash = strchr(key, '/');
+			TestFixture* test = slash ? FindSelected(key, slash, slash + 1, slash + strlen(slash)) : nullptr;
+			if (test && test->myHistory < 0)
+				test->myHistory = int(i);
+		}
+	}
+	//-----------------------------------------------------------------------------
+	// Ordering by history. Both sorts are stable so ties keep registration order.
+	// Tests the history doesn't know yet come straight after the failures when
+	// failed first and take the average duration when slowest first.
+	//-----------------------------------------------------------------------------
+	static int HistoryRank(TestFixture* test)
+	{
+		return test->myHistory < 0 ? 1 : locHistoryEntries()[test->myHistory].failed ? 0 : 2;
+	}
+	static TestFixture* Order(TestFixture* first, TestFixture::RunOrder order)
+	{
+		if (order == TestFixture::OrderFailedFirst)
+			return Sort(first, &TestFixture::myNextSelected, [](TestFixture* a, TestFixture* b) { return HistoryRank(a) < HistoryRank(b); });
+
+		if (order != TestFixture::OrderSlowestFirst)
+			return first;
+
+		double total = 0;
+		int known = 0;
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			if (i->myHistory >= 0)
+			{
+				total += locHistoryEntries()[i->myHistory].duration;
+				++known;
+			}
+		}
+		double average = known ? total / known : 0;
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+			i->myDuration = i->myHistory >= 0 ? locHistoryEntries()[i->myHistory].duration : average;
+
+		return Sort(first, &TestFixture::myNextSelected, [](TestFixture* a, TestFixture* b) { return a->myDuration > b->myDuration; });
+	}
+#endif
+	static bool LighterShard(int a, int b)
+	{
+		return ourShardLoads[a] < ourShardLoads[b] || (ourShardLoads[a] == ourShardLoads[b] && a < b);
+	}
+	static void BalanceShards(TestFixture* first, int shards)
+	{
+		// tests missing from the timing file are assumed to take an average amount of time
+		double total = 0;
+		int known = 0;
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			if (i->myDuration >= 0)
+			{
+				total += i->myDuration;
+				++known;
+			}
+		}
+		double average = known ? total / known : 1;
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			if (i->myDuration < 0)
+				i->myDuration = average;
+			i->myNextQueued = i->myNextSelected;
+		}
+
+		for (int i = 0; i < shards; ++i)
+		{
+			ourShardLoads[i] = 0;
+			ourShardHeap[i] = i;
+		}
+
+		// the sort is stable so equal durations keep selection order and every shard agrees on the result
+		TestFixture* longest = Sort(first, &TestFixture::myNextQueued, [](TestFixture* a, TestFixture* b) { return a->myDuration > b->myDuration; });
+		for (TestFixture* i = longest; i; i = i->myNextQueued)
+		{
+			// the top of the heap is always the lightest shard, add to it and sift it back down
+			int shard = ourShardHeap[0];
+			i->myShard = shard;
+			ourShardLoads[shard] += i->myDuration;
+
+			for (int node = 0;;)
+			{
+				int child = node * 2 + 1;
+				if (child >= shards)
+					break;
+				if (child + 1 < shards && LighterShard(ourShardHeap[child + 1], ourShardHeap[child]))
+					++child;
+				if (!LighterShard(ourShardHeap[child], shard))
+					break;
+				ourShardHeap[node] = ourShardHeap[child];
+				ourShardHeap[child] = shard;
+				node = child;
+			}
+		}
+	}
+	static TestFixture* Shard(TestFixture* first, int& count, TestFixture::ExecuteOptions const& options)
+	{
+		int shards = options.shardCount;
+		if (shards <= 1)
+			return first;
+
+		int position = 0;
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			i->myShard = position++ % shards;
+			i->myDuration = -1;
+		}
+
+		if (options.timingFile)
+		{
+			if (shards > MAX_SHARDS)
+				TestFixture::Printf("Only up to %d shards can be balanced by duration, MAX_SHARDS is too small. Sharding by test count.\n", MAX_SHARDS);
+			else if (!ReadTimings(options.timingFile, first))
+				TestFixture::Printf("Failed to read timing file '%s', sharding by test count.\n", options.timingFile);
+			else
+				BalanceShards(first, shards);
+		}
+
+		// keep this shard's tests in selection order, anything lazily created for the others is done with
+		TestFixture* kept = nullptr;
+		TestFixture** tail = &kept;
+		count = 0;
+		for (TestFixture* i = first, *next; i; i = next)
+		{
+			next = i->myNextSelected;
+			i->myNextQueued = nullptr;
+			i->myDuration = 0;
+			if (i->myShard == options.shardIndex)
+			{
+				*tail = i;
+				tail = &i->myNextSelected;
+				++count;
+			}
+			else if (i->myDescriptor)
+			{
+				i->~TestFixture();
+			}
+		}
+		*tail = nullptr;
+		return kept;
+	}
+	static bool ExecuteSequential(TestFixture* first, TestFixture::OutputMode output)
+	{
+		RunOverlapped(first);
+
+		bool passed = true;
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			if (i->myFinished.load(std::memory_order_relaxed))
+			{
+				passed &= Report(i, output);
+			}
+			else if (!locStopRun.load(std::memory_order_relaxed))
+			{
+				passed &= locExecuteTest(i, output);
+				locRecordHistory(i, i->myHistory);
+			}
+		}
+		return passed;
+	}
+	static bool ExecuteParallel(TestFixture* first, int jobs, TestFixture::OutputMode output, bool interleave)
+	{
+		// overlapped and then serial tests run first while nothing else is active, a single job has nothing to keep them apart from
+		RunOverlapped(first);
+
+		int parallelCount = 0;
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			if (i->myFinished.load(std::memory_order_relaxed))
+				continue;
+			else if (jobs <= 1 || !TestSerialGroup::IsSerial(i->myGroup))
+				++parallelCount;
+			else if (locWatching)
+				Push(locWorkers[0], i);
+			else if (!locStopRun.load(std::memory_order_relaxed))
+				Run(i);
+		}
+
+		// watched tests only run on threads the watchdog can give up on, the calling thread just watches and reports
+		if (locWatching && locWorkers[0].myHead)
+		{
+			RunWorkers(0, 1);
+			JoinWorkers(0, 1);
+		}
+
+		int numWorkers = jobs < parallelCount ? jobs : parallelCount;
+		if (numWorkers < 1)
+			numWorkers = 1;
+
+		// hand out contiguous blocks so neighbouring tests tend to share a thread, or deal
+		// them out in turn when the slowest come first so every thread starts on a long one
+		int queued = 0;
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			if (i->myFinished.load(std::memory_order_relaxed) || (jobs > 1 && TestSerialGroup::IsSerial(i->myGroup)))
+				continue;
+
+			int worker = interleave ? queued % numWorkers : int((long long)queued * numWorkers / parallelCount);
+			Push(locWorkers[worker], i);
+			++queued;
+		}
+
+		// the calling thread works as worker 0 unless it's watching, and reports whenever the next test in order is done
+		int firstThread = locWatching ? 0 : 1;
+		if (queued)
+			RunWorkers(firstThread, numWorkers);
+
+		bool passed = true;
+		TestFixture* next = first;
+		while (next)
+		{
+			if (next->myFinished.load(std::memory_order_acquire))
+			{
+				passed &= Report(next, output);
+				next = next->myNextSelected;
+			}
+			else if (TestFixture* test = locWatching ? nullptr : NextTest(0, numWorkers))
+			{
+				Run(test);
+			}
+			else if (locStopRun.load(std::memory_order_relaxed))
+			{
+				break;
+			}
+			else
+			{
+				if (locWatching)
+					Watch(numWorkers);
+				std::this_thread::yield();
+			}
+		}
+
+		if (queued)
+			JoinWorkers(firstThread, numWorkers);
+		for (int i = 0; i < numWorkers; ++i)
+			locWorkers[i].myHead = locWorkers[i].myTail = nullptr;
+
+		// after stopping early the tests that were still running are reported as well, the rest never started
+		for (; next; next = next->myNextSelected)
+		{
+			if (next->myFinished.load(std::memory_order_acquire))
+				passed &= Report(next, output);
+		}
+		return passed;
+	}
+	static void RunWorkers(int begin, int end)
+	{
+		locNumWorking.store(end - begin, std::memory_order_relaxed);
+		for (int i = begin; i < end; ++i)
+			locWorkers[i].myThread = std::thread(WorkerMain, i, end);
+	}
+	static void JoinWorkers(int begin, int end)
+	{
+		// keep watching until every thread is out of tests, a hung one would never be joined
+		while (locWatching && locNumWorking.load(std::memory_order_acquire) > 0)
+		{
+			Watch(end);
+			std::this_thread::yield();
+		}
+		for (int i = begin; i < end; ++i)
+			locWorkers[i].myThread.join();
+	}
+
+#if TEST_PROCESS_POOL
+	//-----------------------------------------------------------------------------
+	// Process pool. Workers are forked up front and claim tests from a counter in
+	// shared memory, streaming messages as they're logged and then results back
+	// through a ring buffer each. A worker that dies is replaced and the test it
+	// was running is marked as crashed, keeping the counts it last published.
+	//-----------------------------------------------------------------------------
+	enum RecordType
+	{
+		RecordPadding,
+		RecordError,
+		RecordClear, // the messages so far were released, i.e. by the next baseline sample
+		RecordResult,
+	};
+	struct Record
+	{
+		unsigned size; // including this header, records are kept 16 byte aligned
+		unsigned type;
+		int index;
+		int unused;
+	};
+	struct Result
+	{
+		int numTests;
+		int numErrors;
+		int numDropped;
+		int numUnlogged;
+		int numSamples;
+		double duration;
+		double durationStddev;
+	};
+	struct Ring
+	{
+		std::atomic<unsigned long long> head; // bytes written by the worker
+		std::atomic<unsigned long long> tail; // bytes consumed by the runner
+		std::atomic<int> current; // test the worker is running, -1 when idle
+		std::atomic<double> deadline; // when the watchdog gives up on the current test, 0 when it isn't watched
+		TestCounts counts; // of the current test, as of its last message or the signal that stopped the worker
+		TestStack stack; // where the worker was stopped when it hung
+		alignas(16) char data[PROCESS_RING_SIZE];
+	};
+	struct Pool
+	{
+		std::atomic<int> next;
+		int count;
+		Ring rings[1];
+	};
+	struct PoolWorker
+	{
+		pid_t pid;
+		TestFixture* cursor; // runner side position in the queue, workers only ever move forward
+		int cursorIndex;
+	};
+	static PoolWorker ourPoolWorkers[MAX_JOBS];
+	static constexpr unsigned long long ourRingSize = PROCESS_RING_SIZE; // the config macro is an unparenthesized expression
+
+	static_assert(ourRingSize % 16 == 0 && ourRingSize >= 4 * ERROR_CHUNK_SIZE, "PROCESS_RING_SIZE must be a multiple of 16 and fit several error messages");
+
+	static TestFixture* Advance(TestFixture*& cursor, int& cursorIndex, int index)
+	{
+		for (; cursorIndex < index; ++cursorIndex)
+			cursor = cursor->myNextQueued;
+		return cursor;
+	}
+	static void Write(Ring& ring, RecordType type, int index, void const* payload, size_t size)
+	{
+		unsigned total = unsigned((sizeof(Record) + size + 15) & ~size_t(15));
+		unsigned long long head = ring.head.load(std::memory_order_relaxed);
+		unsigned long long offset = head % ourRingSize;
+		unsigned long long padding = offset + total > ourRingSize ? ourRingSize - offset : 0;
+
+		while (head + padding + total - ring.tail.load(std::memory_order_acquire) > ourRingSize)
+			usleep(50);
+
+		if (padding)
+		{
+			Record* pad = (Record*)(ring.data + offset);
+			pad->size = unsigned(padding);
+			pad->type = RecordPadding;
+			head += padding;
+		}
+
+		Record* record = (Record*)(ring.data + head % ourRingSize);
+		record->size = total;
+		record->type = type;
+		record->index = index;
+		memcpy(record + 1, payload, size);
+		ring.head.store(head + total, std::memory_order_release);
+	}
+	static Ring* ourWorkerRing;
+
+	static void StreamMessage(TestError const* error)
+	{
+		Ring& ring = *ourWorkerRing;
+		int index = ring.current.load(std::memory_order_relaxed);
+		locPublishCounts();
+		if (error == nullptr)
+		{
+			Write(ring, RecordClear, index, "", 0);
+			return;
+		}
+
+		// a message can span several chunks, but has to leave the ring room for others
+		size_t const maxLength = ourRingSize / 4 - sizeof(Record) - 16;
+		char buffer[ERROR_CHUNK_SIZE];
+		char const* text = error->Text(buffer, sizeof(buffer));
+		size_t length = strlen(text);
+		length = length < maxLength ? length : maxLength;
+		Write(ring, RecordError, index, text, length + 1);
+	}
+	// Publish the counts of a test that crashed the worker before it dies the way it would have
+	static void WorkerCrashed(int signal)
+	{
+		locPublishCounts();
+		raise(signal);
+	}
+	static void PoolWorkerMain(Pool* pool, Ring& ring, TestFixture* first)
+	{
+		locStackOut = &ring.stack;
+		locStreamCounts = &ring.counts;
+		locStreamMessage = StreamMessage;
+		ourWorkerRing = &ring;
+
+		struct sigaction crashed = {};
+		crashed.sa_handler = WorkerCrashed;
+		crashed.sa_flags = SA_RESETHAND;
+		sigemptyset(&crashed.sa_mask);
+		static int const crashSignals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+		for (int signal : crashSignals)
+			sigaction(signal, &crashed, nullptr);
+
+		TestFixture* cursor = first;
+		int cursorIndex = 0;
+		for (;;)
+		{
+			int index = pool->next.fetch_add(1);
+			if (index >= pool->count)
+				break;
+
+			TestFixture* test = Advance(cursor, cursorIndex, index);
+			ring.deadline.store(test->myTimeout > 0 ? locNow() + test->myTimeout : 0, std::memory_order_relaxed);
+			ring.counts.numTests.store(0, std::memory_order_relaxed);
+			ring.counts.numErrors.store(0, std::memory_order_relaxed);
+			ring.counts.numUnlogged.store(0, std::memory_order_relaxed);
+			ring.current.store(index);
+			locStreamTest = test;
+			test->ExecuteTest();
+			locStreamTest = nullptr;
+
+			// the messages are already on their way
+			Result result = { test->myNumTestsChecked, test->myNumErrors, test->myNumDroppedMessages, test->myNumUnloggedFailures, test->myNumSamples, test->myDuration, test->myDurationStddev };
+			Write(ring, RecordResult, index, &result, sizeof(result));
+			test->ReleaseErrors();
+			ring.current.store(-1);
+		}
+
+		fflush(nullptr);
+		_exit(0);
+	}
+	static bool Spawn(Pool* pool, int worker, TestFixture* first)
+	{
+		Ring& ring = pool->rings[worker];
+		ring.head.store(0);
+		ring.tail.store(0);
+		ring.current.store(-1);
+		ring.deadline.store(0);
+		ring.counts.numTests.store(0);
+		ring.counts.numErrors.store(0);
+		ring.counts.numUnlogged.store(0);
+		ring.stack.depth.store(-1);
+		ourPoolWorkers[worker].cursor = first;
+		ourPoolWorkers[worker].cursorIndex = 0;
+
+		// anything still buffered would be written again by the child
+		fflush(nullptr);
+		pid_t pid = fork();
+		if (pid == 0)
+			PoolWorkerMain(pool, ring, first);
+
+		ourPoolWorkers[worker].pid = pid > 0 ? pid : 0;
+		return pid > 0;
+	}
+	static void Drain(Pool* pool, int worker)
+	{
+		Ring& ring = pool->rings[worker];
+		PoolWorker& state = ourPoolWorkers[worker];
+		unsigned long long tail = ring.tail.load(std::memory_order_relaxed);
+		unsigned long long head = ring.head.load(std::memory_order_acquire);
+		while (tail != head)
+		{
+			Record const* record = (Record const*)(ring.data + tail % ourRingSize);
+			if (record->type != RecordPadding)
+			{
+				TestFixture* test = Advance(state.cursor, state.cursorIndex, record->index);
+				if (test->myFinished.load(std::memory_order_relaxed))
+				{
+					// the watchdog already gave up on it
+				}
+				else if (record->type == RecordError)
+				{
+					test->LogMessage("%s", (char const*)(record + 1));
+				}
+				else if (record->type == RecordClear)
+				{
+					test->ReleaseErrors();
+				}
+				else
+				{
+					Result const* result = (Result const*)(record + 1);
+					test->myNumTestsChecked = result->numTests;
+					test->myNumErrors = result->numErrors;
+					test->myNumDroppedMessages += result->numDropped;
+					test->myNumUnloggedFailures += result->numUnlogged;
+					test->myDuration = result->duration;
+					test->myDurationStddev = result->durationStddev;
+					test->myNumSamples = result->numSamples;
+					locCheckFailFast(test);
+					test->myFinished.store(true, std::memory_order_relaxed);
+				}
+			}
+			tail += record->size;
+		}
+		ring.tail.store(tail, std::memory_order_release);
+	}
+	static bool Reap(Pool* pool, int worker, TestFixture* first)
+	{
+		int status = 0;
+		if (waitpid(ourPoolWorkers[worker].pid, &status, WNOHANG) != ourPoolWorkers[worker].pid)
+			return false;
+
+		// pick up whatever the worker managed to send before it went away
+		Drain(pool, worker);
+		ourPoolWorkers[worker].pid = 0;
+
+		Ring& ring = pool->rings[worker];
+		int current = ring.current.load();
+		if (current >= 0)
+		{
+			PoolWorker& state = ourPoolWorkers[worker];
+			TestFixture* test = Advance(state.cursor, state.cursorIndex, current);
+			if (!test->myFinished.load(std::memory_order_relaxed))
+			{
+				// the crash counts as one more failed check on top of what the test got through
+				test->myNumTestsChecked = ring.counts.numTests.load(std::memory_order_relaxed);
+				test->myNumErrors = ring.counts.numErrors.load(std::memory_order_relaxed);
+				test->myNumUnloggedFailures = ring.counts.numUnlogged.load(std::memory_order_relaxed);
+				test->AddTest();
+				test->AddError();
+				if (WIFSIGNALED(status))
+					test->LogMessage("Worker process crashed with signal %d (%s) while running this test", WTERMSIG(status), strsignal(WTERMSIG(status)));
+				else
+					test->LogMessage("Worker process exited with status %d while running this test", WEXITSTATUS(status));
+				locCheckFailFast(test);
+				test->myFinished.store(true, std::memory_order_relaxed);
+			}
+
+			if (pool->next.load() < pool->count && !locStopRun.load(std::memory_order_relaxed))
+				Spawn(pool, worker, first);
+		}
+		return true;
+	}
+	// Stop a worker whose test ran past its deadline and kill it, it's reaped and replaced like any other dead worker
+	static void WatchPool(Pool* pool, int worker)
+	{
+		Ring& ring = pool->rings[worker];
+		double deadline = ring.deadline.load(std::memory_order_relaxed);
+		if (ring.current.load() < 0 || deadline <= 0 || locNow() < deadline)
+			return;
+
+		ring.stack.depth.store(-1, std::memory_order_relaxed);
+		bool stopped = kill(ourPoolWorkers[worker].pid, WATCHDOG_SIGNAL) == 0 && locWaitForStack(ring.stack);
+
+		// a stopped worker has sent everything it's going to, the messages of the test go before the timeout
+		Drain(pool, worker);
+		int current = ring.current.load();
+		if (current >= 0)
+		{
+			PoolWorker& state = ourPoolWorkers[worker];
+			TestFixture* test = Advance(state.cursor, state.cursorIndex, current);
+			if (!test->myFinished.load(std::memory_order_relaxed))
+			{
+				test->myNumTestsChecked = ring.counts.numTests.load(std::memory_order_relaxed);
+				test->myNumErrors = ring.counts.numErrors.load(std::memory_order_relaxed);
+				test->myNumUnloggedFailures = ring.counts.numUnlogged.load(std::memory_order_relaxed);
+				TimedOut(test, "worker process", "was killed", stopped, ring.stack);
+			}
+		}
+		ring.deadline.store(0, std::memory_order_relaxed);
+		kill(ourPoolWorkers[worker].pid, SIGKILL);
+	}
+	static void RunPool(TestFixture* first, int count, int processes, TestFixture*& report, TestFixture::OutputMode output, bool& passed)
+	{
+		if (count == 0 || locStopRun.load(std::memory_order_relaxed))
+			return;
+
+		int numWorkers = processes < count ? processes : count;
+		size_t size = sizeof(Pool) + sizeof(Ring) * (numWorkers - 1);
+		Pool* pool = (Pool*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (pool == MAP_FAILED)
+		{
+			TestFixture::Printf("Failed to map memory for worker processes, running in process.\n");
+			for (TestFixture* i = first; i && !locStopRun.load(std::memory_order_relaxed); i = i->myNextQueued)
+				Run(i);
+			return;
+		}
+
+		pool->next.store(0);
+		pool->count = count;
+
+		int alive = 0;
+		for (int i = 0; i < numWorkers; ++i)
+			alive += Spawn(pool, i, first);
+
+		while (alive > 0)
+		{
+			bool idle = true;
+			for (int i = 0; i < numWorkers; ++i)
+			{
+				if (ourPoolWorkers[i].pid == 0)
+					continue;
+
+				Drain(pool, i);
+				if (locWatching)
+					WatchPool(pool, i);
+				if (Reap(pool, i, first))
+				{
+					idle = false;
+					alive -= ourPoolWorkers[i].pid == 0;
+				}
+			}
+
+			// workers stop claiming tests once one fails, the ones they're running still finish
+			if (locStopRun.load(std::memory_order_relaxed))
+				pool->next.store(pool->count);
+
+			for (; report && report->myFinished.load(std::memory_order_relaxed); report = report->myNextSelected, idle = false)
+				passed &= Report(report, output);
+
+			if (idle)
+				usleep(100);
+		}
+
+		// tests nobody could run because workers failed to start
+		for (TestFixture* i = first; i && !locStopRun.load(std::memory_order_relaxed); i = i->myNextQueued)
+		{
+			if (!i->myFinished.load(std::memory_order_relaxed))
+			{
+				i->AddError();
+				i->LogMessage("No worker process was available to run this test");
+				i->myFinished.store(true, std::memory_order_relaxed);
+			}
+		}
+
+		munmap(pool, size);
+	}
+	static bool ExecuteIsolated(TestFixture* first, int processes, TestFixture::OutputMode output)
+	{
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			i->myNumTestsChecked = i->myNumErrors = 0;
+			i->ReleaseErrors();
+		}
+
+		// overlapped tests can't be handed to another process, they run here first
+		RunOverlapped(first);
+
+		// serial tests get a pool with a single worker before everything else
+		bool passed = true;
+		TestFixture* report = first;
+		for (int serial = 1; serial >= 0; --serial)
+		{
+			TestFixture* queue = nullptr;
+			TestFixture** tail = &queue;
+			int count = 0;
+			for (TestFixture* i = first; i; i = i->myNextSelected)
+			{
+				if (!i->myFinished.load(std::memory_order_relaxed) && TestSerialGroup::IsSerial(i->myGroup) == (serial != 0))
+				{
+					*tail = i;
+					tail = &i->myNextQueued;
+					++count;
+				}
+			}
+			*tail = nullptr;
+
+			RunPool(queue, count, serial ? 1 : processes, report, output, passed);
+		}
+
+		// only a run that stopped early leaves tests unfinished
+		for (; report; report = report->myNextSelected)
+		{
+			if (report->myFinished.load(std::memory_order_relaxed))
+				passed &= Report(report, output);
+		}
+		return passed;
+	}
+#endif
+};
+
+TestFixture* TestRunner::ourGroupBuckets[INDEX_BUCKETS];
+TestFixture* TestRunner::ourNameBuckets[INDEX_BUCKETS];
+TestFixture* TestRunner::ourNameStarts[256];
+TestFixture* TestRunner::ourFirstGroup;
+int TestRunner::ourNumIndexed;
+unsigned TestRunner::ourSelection;
+TestFixture* TestRunner::ourLazyBuckets[INDEX_BUCKETS];
+double TestRunner::ourShardLoads[MAX_SHARDS];
+int TestRunner::ourShardHeap[MAX_SHARDS];
+TestFixture* TestRunner::ourAbandoned;
+#if TEST_PROCESS_POOL
+TestRunner::PoolWorker TestRunner::ourPoolWorkers[MAX_JOBS];
+TestRunner::Ring* TestRunner::ourWorkerRing;
+#endif
+
+int TestFixture::ListTests(ExecuteOptions const& options)
+{
+	// list the same selection a run makes, lazy tests included, so they come out in the order they'd run
+	int count = 0;
+	TestFixture* first = TestRunner::Shard(TestRunner::Select(options, false, count), count, options);
+	for (TestFixture* i = first; i; i = i->myNextSelected)
+		Printf("%s/%s\n", i->myGroup, i->myName);
+	TestRunner::Release(first);
+
+	int benchmarks = 0;
+	for (TestFixture* i = TestRunner::Select(options, true, benchmarks); i; i = i->myNextSelected)
+		Printf("%s/%s (benchmark)\n", i->myGroup, i->myName);
+	return count + benchmarks;
+}
+// Open the baseline being recorded or read the one being compared against
+static void locBeginBaseline(TestFixture::ExecuteOptions const& options, TestFixture* first)
+{
+	locNumRegressions = 0;
+	locRegressionThreshold = options.regressionThreshold;
+	locFailRegressions = options.failRegressions;
+	if (options.baselineFile == nullptr)
+		return;
+
+	if (options.recordBaseline)
+	{
+		if ((locBaselineRecord = fopen(options.baselineFile, "w")) == nullptr)
+			TestFixture::Printf("Failed to open baseline file '%s'.\n", options.baselineFile);
+	}
+	else if (TestRunner::ReadBaseline(options.baselineFile, first))
+	{
+		locBaselineCompare = true;
+	}
+	else
+	{
+		TestFixture::Printf("Failed to read baseline file '%s', not comparing against it.\n", options.baselineFile);
+	}
+}
+static void locEndBaseline(TestFixture::OutputMode output)
+{
+	if (locBaselineRecord)
+	{
+		fclose(locBaselineRecord);
+		locBaselineRecord = nullptr;
+	}
+	locBaselineCompare = false;
+
+	if (locNumRegressions && output != TestFixture::Silent)
+		TestFixture::Printf("%d tests were slower than their baseline.\n", locNumRegressions);
+}
+// Map the history and put the tests in the order asked for
+static TestFixture* locBeginHistory(TestFixture::ExecuteOptions const& options, TestFixture* first, int count)
+{
+#if !RUN_HISTORY
+	(void)count;
+	if (options.historyFile || options.order != TestFixture::OrderDefault)
+		TestFixture::Printf("The run history isn't compiled in, define RUN_HISTORY 1 to use it, running tests in registration order.\n");
+	return first;
+#else
+	if (options.historyFile == nullptr)
+	{
+		if (options.order != TestFixture::OrderDefault)
+			TestFixture::Printf("Ordering tests needs a history file, running them in registration order.\n");
+		return first;
+	}
+
+	if (!locMapHistory(options.historyFile, unsigned(count)))
+	{
+		TestFixture::Printf("Failed to open history file '%s', running tests in registration order.\n", options.historyFile);
+		return first;
+	}
+
+	TestRunner::MatchHistory(first);
+	return TestRunner::Order(first, options.order);
+#endif
+}
+static void locPrintSummary(int count, int passes, int fails, bool passed, TestFixture::OutputMode output)
+{
+	if (output == TestFixture::Silent)
+		return;
+
+	if (count == 0)
+		TestFixture::Printf("Failed to find any tests.\n");
+	else if (passed)
+		TestFixture::Printf("%d Tests finished. All %d assertions are passing.\n", count, passes);
+	else
+		TestFixture::Printf("%d Tests finished, %d of %d assertions failed. Some tests are reporting errors.\n", count, fails, passes);
+}
+//---------------------------------------------------------------------------------
+// Match --option value or --option=value, moving past the value if it was separate
+//---------------------------------------------------------------------------------
+static char const* locArgumentValue(char const* option, int argc, char const* const* argv, int& i)
+{
+	size_t length = strlen(option);
+	if (strncmp(argv[i], option, length) != 0)
+		return nullptr;
+	if (argv[i][length] == '=')
+		return argv[i] + length + 1;
+	if (argv[i][length] == 0 && i + 1 < argc)
+		return argv[++i];
+	return nullptr;
+}
+bool TestFixture::ParseArguments(int argc, char const* const* argv, ExecuteOptions& options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		char const* value;
+		if ((value = locArgumentValue("--group", argc, argv, i)) != nullptr)
+			options.groupFilter = value;
+		else if ((value = locArgumentValue("--name", argc, argv, i)) != nullptr)
+			options.nameFilter = value;
+		else if ((value = locArgumentValue("--jobs", argc, argv, i)) != nullptr)
+			options.jobs = atoi(value);
+		else if ((value = locArgumentValue("--processes", argc, argv, i)) != nullptr)
+			options.processes = atoi(value);
+		else if ((value = locArgumentValue("--shard", argc, argv, i)) != nullptr)
+		{
+			char* end;
+			options.shardIndex = (int)strtol(value, &end, 10);
+			options.shardCount = *end == '/' ? (int)strtol(end + 1, &end, 10) : 0;
+			if (*end != 0 || options.shardCount < 1 || options.shardIndex < 0 || options.shardIndex >= options.shardCount)
+			{
+				Printf("Bad shard '%s', expected index/count with 0 <= index < count\n", value);
+				return false;
+			}
+		}
+		else if ((value = locArgumentValue("--max-logged-failures", argc, argv, i)) != nullptr)
+			options.maxLoggedFailures = atoi(value);
+		else if ((value = locArgumentValue("--timings", argc, argv, i)) != nullptr)
+			options.timingFile = value;
+		else if ((value = locArgumentValue("--results", argc, argv, i)) != nullptr)
+			options.resultFile = value;
+		else if ((value = locArgumentValue("--baseline", argc, argv, i)) != nullptr)
+			options.baselineFile = value;
+		else if ((value = locArgumentValue("--record-baseline", argc, argv, i)) != nullptr)
+		{
+			options.baselineFile = value;
+			options.recordBaseline = true;
+		}
+		else if ((value = locArgumentValue("--samples", argc, argv, i)) != nullptr)
+			options.baselineSamples = atoi(value);
+		else if ((value = locArgumentValue("--regression-threshold", argc, argv, i)) != nullptr)
+			options.regressionThreshold = atof(value);
+		else if (strcmp(argv[i], "--fail-regressions") == 0)
+			options.failRegressions = true;
+		else if ((value = locArgumentValue("--history", argc, argv, i)) != nullptr)
+			options.historyFile = value;
+		else if (strcmp(argv[i], "--failed-first") == 0)
+			options.order = OrderFailedFirst;
+		else if (strcmp(argv[i], "--slowest-first") == 0)
+			options.order = OrderSlowestFirst;
+		else if (strcmp(argv[i], "--fail-fast") == 0)
+			options.failFast = true;
+		else if ((value = locArgumentValue("--timeout", argc, argv, i)) != nullptr)
+			options.timeout = atof(value);
+		else if (strcmp(argv[i], "--list") == 0)
+			options.list = true;
+		else if (strcmp(argv[i], "--verbose") == 0)
+			options.output = Verbose;
+		else if (strcmp(argv[i], "--silent") == 0)
+			options.output = Silent;
+		else
+		{
+			Printf("Unknown argument '%s'\n"
+				"Usage: %s [options]\n"
+				"  --group <patterns>  comma separated groups to run, * and ? are wildcards, -pattern excludes\n"
+				"  --name <patterns>   comma separated test names to run, same syntax as --group\n"
+				"  --jobs <count>      number of threads to run tests on, 0 uses all hardware threads\n"
+				"  --processes <count> run tests in worker processes so crashes only fail one test, 0 uses all hardware threads\n"
+				"  --shard <i/n>       run only shard i of n, counting from 0\n"
+				"  --max-logged-failures <count> only log the first failures of each test, the rest are just counted\n"
+				"  --timings <file>    balance shards using the durations in a previous result file\n"
+				"  --results <file>    write every test result to a file that MergeResults can combine\n"
+				"  --record-baseline <file> run every test several times and write their durations as a baseline\n"
+				"  --baseline <file>   run every test several times and flag the ones that got slower than the baseline\n"
+				"  --samples <count>   times each test is run when recording or comparing a baseline\n"
+				"  --regression-threshold <fraction> how much slower than the baseline a test has to be, i.e. 0.25\n"
+				"  --fail-regressions  fail tests that got slower than the baseline instead of just flagging them\n"
+				"  --history <file>    remember the result and duration of every test in this file, created if it's missing\n"
+				"  --failed-first      run the tests that failed last time first, then new ones, needs --history\n"
+				"  --slowest-first     run the tests that took longest last time first, needs --history\n"
+				"  --fail-fast         stop at the first failing test\n"
+				"  --timeout <seconds> fail tests that run longer than this, log where they were stuck and carry on without them\n"
+				"  --list              list the selected tests instead of running them\n"
+				"  --verbose           print every test and its timing\n"
+				"  --silent            print nothing\n", argv[i], argv[0]);
+			return false;
+		}
+	}
+	return true;
+}
+bool TestFixture::ExecuteAllTests(ExecuteOptions const& options)
+{
+	if (options.list)
+	{
+		ListTests(options);
+		return true;
+	}
+
+	char const* groupFilter = options.groupFilter;
+	char const* nameFilter = options.nameFilter;
+	OutputMode output = options.output;
+	ourOutput = output;
+	ourMaxLoggedFailures = options.maxLoggedFailures > 0 ? options.maxLoggedFailures : 0;
+
+	if (output != Silent)
+	{
+		if (groupFilter == nullptr && nameFilter == nullptr)
+			Printf("Running all tests.\n");
+		else if (groupFilter != nullptr && nameFilter == nullptr)
+			Printf("Running all tests in groups [%s].\n", groupFilter);
+		else if (groupFilter == nullptr && nameFilter != nullptr)
+			Printf("Running all tests named [%s].\n", nameFilter);
 		else
-			Printf("%d Tests finished, %d of %d assertions failed. Some tests are reporting errors.\n", count, fails, passes);
+			Printf("Running all tests named [%s/%s].\n", groupFilter, nameFilter);
+	}
+
+	int jobs = options.jobs;
+	if (jobs <= 0)
+		jobs = (int)std::thread::hardware_concurrency();
+	if (jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+
+	int processes = options.processes;
+	if (processes == 0)
+		processes = (int)std::thread::hardware_concurrency();
+	if (processes > MAX_JOBS)
+		processes = MAX_JOBS;
+#if !TEST_PROCESS_POOL
+	if (processes > 0)
+	{
+		Printf(PROCESS_POOL ? "Worker processes aren't supported on this platform, running in process.\n" : "Worker processes aren't compiled in, define PROCESS_POOL 1 to use them, running in process.\n");
+		processes = -1;
+	}
+#endif
+
+	if (options.shardCount > 1 && (options.shardIndex < 0 || options.shardIndex >= options.shardCount))
+	{
+		if (output != Silent)
+			Printf("Shard %d is out of range for %d shards.\n", options.shardIndex, options.shardCount);
+		return false;
+	}
+
+	int count = 0;
+	TestFixture* first = TestRunner::Select(options, false, count);
+	if (options.shardCount > 1)
+	{
+		int selected = count;
+		first = TestRunner::Shard(first, count, options);
+		if (output != Silent)
+			Printf("Running shard %d of %d, %d of %d selected tests.\n", options.shardIndex, options.shardCount, count, selected);
+	}
+
+	first = locBeginHistory(options, first, count);
+
+	// with fail fast some tests may never run, so nothing can be left over from a previous run
+	locFailFast = options.failFast;
+	locStopRun.store(false, std::memory_order_relaxed);
+	locNumReported = 0;
+	if (locFailFast)
+	{
+		for (TestFixture* i = first; i; i = i->myNextSelected)
+		{
+			i->myNumTestsChecked = i->myNumErrors = 0;
+			i->ReleaseErrors();
+		}
+	}
+
+	if (options.resultFile && (locResultFile = fopen(options.resultFile, "w")) == nullptr)
+		Printf("Failed to open result file '%s'.\n", options.resultFile);
+
+	locBeginBaseline(options, first);
+	ourNumSamples = options.baselineFile && options.baselineSamples > 1 ? options.baselineSamples : 1;
+
+	// sampled tests get their timeout for every sample
+	locWatching = TestRunner::SetTimeouts(first, options.timeout);
+	if (locWatching)
+		locBeginWatch();
+
+	locReporter = options.reporter;
+	for (TestReporter* i = locReporter; i; i = i->myNext)
+		i->BeginRun(count);
+
+	// tests that spread over threads of their own, i.e. cases, share the machine with the rest
+	ourConcurrency = processes > 0 ? processes : jobs > 1 ? jobs : 1;
+
+	bool passed;
+#if TEST_PROCESS_POOL
+	if (processes > 0)
+		passed = TestRunner::ExecuteIsolated(first, processes, output);
+	else
+#endif
+	if (jobs > 1 || locWatching)
+		passed = TestRunner::ExecuteParallel(first, jobs, output, RUN_HISTORY && options.order == OrderSlowestFirst && options.historyFile);
+	else
+		passed = TestRunner::ExecuteSequential(first, output);
+
+	if (locResultFile)
+	{
+		fclose(locResultFile);
+		locResultFile = nullptr;
+	}
+
+	if (locWatching)
+		locEndWatch();
+	locWatching = false;
+
+	ourNumSamples = 1;
+	ourConcurrency = 1;
+	locEndBaseline(output);
+	locUnmapHistory();
+
+	if (locStopRun.load(std::memory_order_relaxed))
+	{
+		if (output != Silent)
+			Printf("Stopped at the first failure, %d of %d tests didn't run.\n", count - locNumReported, count);
+		count = locNumReported;
+	}
+	locFailFast = false;
+
+	int passes = 0;
+	int fails = 0;
+	for (TestFixture* i = first; i; i = i->myNextSelected)
+	{
+		// an abandoned test's counts may still be changing, it was reported as one failed check
+		passes += i->myAbandoned ? 1 : i->NumTests();
+		fails += i->myAbandoned ? 1 : i->NumErrors();
+	}
+
+	for (TestReporter* i = locReporter; i; i = i->myNext)
+		i->EndRun(count, passes, fails, passed);
+	locReporter = nullptr;
+
+	locPrintSummary(count, passes, fails, passed, output);
+
+	TestRunner::Release(first);
+	return passed;
+}
+bool TestFixture::MergeResults(char const* const* resultFiles, int numFiles, OutputMode output)
+{
+	bool passed = true;
+	int count = 0;
+	int passes = 0;
+	int fails = 0;
+
+	for (int f = 0; f < numFiles; ++f)
+	{
+		FILE* file = fopen(resultFiles[f], "r");
+		if (file == nullptr)
+		{
+			if (output != Silent)
+				Printf("Failed to read result file '%s'.\n", resultFiles[f]);
+			passed = false;
+			continue;
+		}
+
+		// replay the report of every failing test, messages are stored exactly as they were printed
+		char line[4096];
+		bool lineStart = true;
+		bool printing = false;
+		while (fgets(line, sizeof(line), file))
+		{
+			bool isStart = lineStart;
+			lineStart = strchr(line, '\n') != nullptr;
+			if (!isStart || line[0] == '\t')
+			{
+				if (printing)
+					Printf("%s", isStart ? line + 1 : line);
+				continue;
+			}
+
+			char* end = strchr(line, ' ');
+			double duration;
+			int checked;
+			int errors;
+			printing = false;
+			if (end == nullptr || sscanf(end, "%lf %d %d", &duration, &checked, &errors) != 3)
+				continue;
+
+			*end = 0;
+			++count;
+			passes += checked;
+			fails += errors;
+
+			if (errors == 0 && output == Verbose)
+			{
+				Printf("Running [%s]: Passed %d out of %d tests in %g seconds\n", line, checked, checked, duration);
+				printing = true;
+			}
+			else if (errors != 0 && output != Silent)
+			{
+				Printf(output == Verbose ? "Running [%s]: Failed %d out of %d tests\n" : "[%s]: Failed %d out of %d tests\n", line, errors, checked);
+				printing = true;
+			}
+		}
+
+		fclose(file);
 	}
+
+	passed &= fails == 0;
+	locPrintSummary(count, passes, fails, passed, output);
 	return passed;
 }
+
+//---------------------------------------------------------------------------------
+// Benchmarks
+//---------------------------------------------------------------------------------
+#if TEST_TSC_CLOCK
+static double locCalibrateTsc()
+{
+	auto start = std::chrono::steady_clock::now();
+	unsigned long long startTicks = __rdtsc();
+	while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20)) {}
+	unsigned long long ticks = __rdtsc() - startTicks;
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / double(ticks);
+}
+unsigned long long TestClock::Now()
+{
+	return __rdtsc();
+}
+double TestClock::ToSeconds(unsigned long long ticks)
+{
+	static double const secondsPerTick = locCalibrateTsc();
+	return double(ticks) * secondsPerTick;
+}
+#else
+unsigned long long TestClock::Now()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+double TestClock::ToSeconds(unsigned long long ticks)
+{
+	return double(ticks) * 1e-9;
+}
+#endif
+
+static void locFormatTime(char* buffer, size_t size, double seconds)
+{
+	if (seconds < 1e-6)
+		snprintf(buffer, size, "%.2f ns", seconds * 1e9);
+	else if (seconds < 1e-3)
+		snprintf(buffer, size, "%.2f us", seconds * 1e6);
+	else if (seconds < 1)
+		snprintf(buffer, size, "%.2f ms", seconds * 1e3);
+	else
+		snprintf(buffer, size, "%.2f s", seconds);
+}
+static void locFormatRate(char* buffer, size_t size, double perSecond, char const* unit)
+{
+	if (perSecond >= 1e9)
+		snprintf(buffer, size, ", %.2f G%s/s", perSecond * 1e-9, unit);
+	else if (perSecond >= 1e6)
+		snprintf(buffer, size, ", %.2f M%s/s", perSecond * 1e-6, unit);
+	else if (perSecond >= 1e3)
+		snprintf(buffer, size, ", %.2f k%s/s", perSecond * 1e-3, unit);
+	else
+		snprintf(buffer, size, ", %.2f %s/s", perSecond, unit);
+}
+
+//---------------------------------------------------------------------------------
+// Grow the iteration count until a sample takes BENCHMARK_SAMPLE_TIME, run the
+// warmup samples and then collect the timed samples.
+//---------------------------------------------------------------------------------
+static bool locExecuteBenchmark(TestFixture* test, TestBenchmark& bench)
+{
+	bench.iterations = 1;
+	for (;;)
+	{
+		if (!test->ExecuteTest())
+			return false;
+
+		double elapsed = TestClock::ToSeconds(bench.ticks);
+		if (elapsed >= BENCHMARK_SAMPLE_TIME || bench.iterations >= (1ull << 40))
+			break;
+
+		double scale = elapsed > 0 ? BENCHMARK_SAMPLE_TIME * 1.2 / elapsed : 100;
+		scale = scale < 2 ? 2 : scale > 100 ? 100 : scale;
+		bench.iterations = (unsigned long long)(double(bench.iterations) * scale);
+	}
+
+	for (int i = 0; i < BENCHMARK_WARMUP_SAMPLES; ++i)
+	{
+		if (!test->ExecuteTest())
+			return false;
+	}
+
+	double samples[BENCHMARK_SAMPLES];
+	double sum = 0;
+	for (int i = 0; i < BENCHMARK_SAMPLES; ++i)
+	{
+		if (!test->ExecuteTest())
+			return false;
+
+		// insertion sort as we go so the median is easy to find
+		double sample = TestClock::ToSeconds(bench.ticks) / double(bench.iterations);
+		int j = i;
+		for (; j > 0 && samples[j - 1] > sample; --j)
+			samples[j] = samples[j - 1];
+		samples[j] = sample;
+		sum += sample;
+	}
+
+	bench.min = samples[0];
+	bench.mean = sum / BENCHMARK_SAMPLES;
+	bench.median = BENCHMARK_SAMPLES % 2 ? samples[BENCHMARK_SAMPLES / 2] : (samples[BENCHMARK_SAMPLES / 2 - 1] + samples[BENCHMARK_SAMPLES / 2]) * 0.5;
+
+	double variance = 0;
+	for (double sample : samples)
+		variance += (sample - bench.mean) * (sample - bench.mean);
+	bench.stddev = BENCHMARK_SAMPLES > 1 ? sqrt(variance / (BENCHMARK_SAMPLES - 1)) : 0;
+	return true;
+}
+bool TestFixture::ExecuteAllBenchmarks(ExecuteOptions const& options)
+{
+	OutputMode output = options.output;
+	if (output != Silent)
+	{
+		if (options.groupFilter == nullptr && options.nameFilter == nullptr)
+			Printf("Running all benchmarks.\n");
+		else if (options.groupFilter != nullptr && options.nameFilter == nullptr)
+			Printf("Running all benchmarks in groups [%s].\n", options.groupFilter);
+		else if (options.groupFilter == nullptr && options.nameFilter != nullptr)
+			Printf("Running all benchmarks named [%s].\n", options.nameFilter);
+		else
+			Printf("Running all benchmarks named [%s/%s].\n", options.groupFilter, options.nameFilter);
+	}
+
+	int count = 0;
+	int fails = 0;
+	TestFixture* first = TestRunner::Select(options, true, count);
+	locBeginBaseline(options, first);
+	for (TestFixture* i = first; i; i = i->myNextSelected)
+	{
+		TestBenchmark& bench = *i->myBenchmark;
+		bench.bytesPerIteration = bench.itemsPerIteration = 0;
+
+		if (output == Verbose)
+			Printf("Running [%s/%s]", i->TestGroup(), i->TestName());
+
+		if (!locExecuteBenchmark(i, bench))
+		{
+			++fails;
+			locReportTest(i, output, output == Verbose);
+			i->ReleaseErrors();
+			continue;
+		}
+
+		if (output != Silent)
+		{
+			char min[32], median[32], mean[32], stddev[32], bytes[32] = "", items[32] = "";
+			locFormatTime(min, sizeof(min), bench.min);
+			locFormatTime(median, sizeof(median), bench.median);
+			locFormatTime(mean, sizeof(mean), bench.mean);
+			locFormatTime(stddev, sizeof(stddev), bench.stddev);
+			if (bench.bytesPerIteration > 0)
+				locFormatRate(bytes, sizeof(bytes), bench.bytesPerIteration / bench.mean, "B");
+			if (bench.itemsPerIteration > 0)
+				locFormatRate(items, sizeof(items), bench.itemsPerIteration / bench.mean, "items");
+
+			if (output != Verbose)
+				Printf("[%s/%s]", i->TestGroup(), i->TestName());
+			Printf(": %llu iterations x %d samples, min %s, median %s, mean %s, stddev %s%s%s\n",
+				bench.iterations, BENCHMARK_SAMPLES, min, median, mean, stddev, bytes, items);
+		}
+
+		// baselines of benchmarks are per iteration
+		char regression[256];
+		TestBaseline measured = { bench.mean, bench.stddev, BENCHMARK_SAMPLES };
+		if (locUpdateBaseline(i, measured, regression, sizeof(regression)) && output != Silent)
+			Printf("[%s/%s]: %s\n", i->TestGroup(), i->TestName(), regression);
+		if (i->NumErrors())
+		{
+			++fails;
+			locReportTest(i, output, false);
+		}
+		i->ReleaseErrors();
+	}
+	locEndBaseline(output);
+
+	if (output != Silent)
+	{
+		if (count == 0)
+			Printf("Failed to find any benchmarks.\n");
+		else if (fails == 0)
+			Printf("%d Benchmarks finished.\n", count);
+		else
+			Printf("%d Benchmarks finished, %d reported errors.\n", count, fails);
+	}
+	return fails == 0;
+}
+
+//---------------------------------------------------------------------------------
+// Stress tests. Every thread gets a fixture of its own standing in for the test,
+// so assertions never touch anything shared, and waits on a spin barrier so
+// they all start hammering at the same moment. The calling thread is thread 0.
+//---------------------------------------------------------------------------------
+void TestFixture::RunStress(void (*iteration)(TestFixture& test, TestStressThread const& stress))
+{
+	TestStress& stress = *myStress;
+	int count = stress.threads > 0 ? stress.threads : (int)std::thread::hardware_concurrency();
+	count = count < 1 ? 1 : count > STRESS_MAX_THREADS ? STRESS_MAX_THREADS : count;
+	stress.numThreads = count;
+
+	alignas(TestStandIn) char storage[STRESS_MAX_THREADS][sizeof(TestStandIn)];
+	TestStandIn* fixtures[STRESS_MAX_THREADS];
+	for (int i = 0; i < count; ++i)
+		fixtures[i] = TestStandIn::Construct(storage[i], *this);
+
+	std::atomic<int> arrived(0);
+	auto hammer = [&](int index)
+	{
+		arrived.fetch_add(1, std::memory_order_acq_rel);
+		while (arrived.load(std::memory_order_acquire) < count)
+			std::this_thread::yield();
+
+		TestStressThread thread = { index, count, 0 };
+		unsigned long long start = TestClock::Now();
+		if (stress.iterations)
+		{
+			for (; thread.iteration < stress.iterations; ++thread.iteration)
+				iteration(*this, thread);
+		}
+		else
+		{
+			do
+			{
+				iteration(*this, thread);
+				++thread.iteration;
+			} while (TestClock::ToSeconds(TestClock::Now() - start) < stress.duration);
+		}
+
+		stress.threadSeconds[index] = TestClock::ToSeconds(TestClock::Now() - start);
+		stress.threadIterations[index] = thread.iteration;
+	};
+	auto run = [&](int index) { fixtures[index]->Run([&] { hammer(index); }); };
+
+	std::thread threads[STRESS_MAX_THREADS];
+	for (int i = 1; i < count; ++i)
+		threads[i] = std::thread(run, i);
+	run(0);
+	for (int i = 1; i < count; ++i)
+		threads[i].join();
+
+	// threads that failed always get their line, the rest only when someone will read it
+	bool logInfo = ShouldLogInfo();
+	for (int i = 0; i < count; ++i)
+		logInfo = logInfo || fixtures[i]->NumErrors();
+
+	for (int i = 0; i < count; ++i)
+	{
+		TestStandIn& fixture = *fixtures[i];
+		char time[32], rate[32] = "";
+		locFormatTime(time, sizeof(time), stress.threadSeconds[i]);
+		if (stress.threadSeconds[i] > 0)
+			locFormatRate(rate, sizeof(rate), double(stress.threadIterations[i]) / stress.threadSeconds[i], "ops");
+
+		if (fixture.NumErrors())
+			LogMessage("Thread %d: %llu iterations in %s%s, failed %d of %d checks", i, stress.threadIterations[i], time, rate, fixture.NumErrors(), fixture.NumTests());
+		else if (logInfo)
+			LogMessage("Thread %d: %llu iterations in %s%s", i, stress.threadIterations[i], time, rate);
+
+		fixture.Adopt();
+		fixture.~TestStandIn();
+	}
+}
@@ -1,10 +1,24 @@
 #pragma once
 
+#include <atomic>
+#include <new>
+#include <stddef.h>
+#include <type_traits>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 //---------------------------------------------------------------------------------
 // Config
 //---------------------------------------------------------------------------------
 #if !defined(MESSAGE_SPACE)
-#define MESSAGE_SPACE 10 * 1024 // default 10k of message space is reserved per test
+#define MESSAGE_SPACE 10 * 1024 // default 10k of message space a single test can claim
+#endif
+#if !defined(ERROR_ARENA_SIZE)
+#define ERROR_ARENA_SIZE 256 * 1024 // default 256k of message space shared by all failing tests
+#endif
+#if !defined(ERROR_CHUNK_SIZE)
+#define ERROR_CHUNK_SIZE 2 * 1024 // granularity that tests claim message space from the arena
 #endif
 #if !defined(STRING_LENGTH)
 #define STRING_LENGTH 64 // size of temp strings for converting types
@@ -12,20 +26,93 @@
 #if !defined(STRING_EQ_PRINT_LENGTH)
 #define STRING_EQ_PRINT_LENGTH 80 // max line length to show when comparing two strings
 #endif
+#if !defined(STRING_EQ_CONTEXT_LINES)
+#define STRING_EQ_CONTEXT_LINES 2 // lines to show before and after the first difference when comparing multi-line strings
+#endif
+#if !defined(ARRAY_EQ_PRINT_COUNT)
+#define ARRAY_EQ_PRINT_COUNT 4 // max number of differences to show when comparing arrays, each with the elements around it
+#endif
 #if !defined(BASE_FIXTURE)
 #define BASE_FIXTURE TestFixture // use TestFixture as the test base class by default
 #endif
+#if !defined(MAX_JOBS)
+#define MAX_JOBS 256 // maximum number of threads the parallel runner will use
+#endif
+#if !defined(PROCESS_RING_SIZE)
+#define PROCESS_RING_SIZE 64 * 1024 // size of the shared buffer each worker process streams results through
+#endif
+#if !defined(WATCHDOG_STACK_DEPTH)
+#define WATCHDOG_STACK_DEPTH 32 // most frames of a hung test's stack that are logged when it times out
+#endif
+#if !defined(WATCHDOG_SIGNAL)
+#define WATCHDOG_SIGNAL SIGUSR2 // signal that stops the thread of a hung test and captures its stack (unix only)
+#endif
+#if !defined(MAX_SHARDS)
+#define MAX_SHARDS 1024 // maximum number of shards when balancing shards by duration
+#endif
+#if !defined(INDEX_BUCKETS)
+#define INDEX_BUCKETS 1024 // hash buckets used to look up tests by group and name
+#endif
+#if !defined(BENCHMARK_SAMPLES)
+#define BENCHMARK_SAMPLES 16 // number of timed samples taken for each benchmark
+#endif
+#if !defined(BENCHMARK_WARMUP_SAMPLES)
+#define BENCHMARK_WARMUP_SAMPLES 2 // untimed samples run before measuring
+#endif
+#if !defined(BENCHMARK_SAMPLE_TIME)
+#define BENCHMARK_SAMPLE_TIME 0.01 // seconds a sample should take, iteration counts are scaled to match
+#endif
+#if !defined(STRESS_MAX_THREADS)
+#define STRESS_MAX_THREADS 64 // most threads a stress test will run its body on
+#endif
+#if !defined(STRESS_DURATION)
+#define STRESS_DURATION 0.1 // seconds each thread of a stress test runs for when it isn't given an iteration count
+#endif
+#if !defined(BASELINE_SAMPLES)
+#define BASELINE_SAMPLES 5 // times each test is run when recording or comparing against a baseline
+#endif
+#if !defined(BASELINE_THRESHOLD)
+#define BASELINE_THRESHOLD 0.25 // tests this fraction slower than their baseline are regressions, as long as it's significant
+#endif
+#if !defined(HISTORY_KEY_LENGTH)
+#define HISTORY_KEY_LENGTH 112 // longest group/name kept in the run history, tests with longer ones aren't tracked
+#endif
+#if !defined(FAST_ASSERTIONS)
+#define FAST_ASSERTIONS 0 // 1 gives test bodies a local assertion scope, passing checks are only added to NumTests when the body returns
+#endif
+#if !defined(DEFERRED_MESSAGES)
+#define DEFERRED_MESSAGES 0 // 1 stores the format and arguments of messages and only formats them when they're printed
+#endif
+#if !defined(PROCESS_POOL)
+#define PROCESS_POOL 0 // 1 compiles in the pool of worker processes behind --processes (unix only)
+#endif
+#if !defined(RUN_HISTORY)
+#define RUN_HISTORY 0 // 1 compiles in the memory mapped run history behind --history, --failed-first and --slowest-first
+#endif
 #if !defined(ERROR_ACTION)
 #define ERROR_ACTION // Defined any code to run on error. You can use this to debug break or do anything really
 #endif
 
 //---------------------------------------------------------------------------------
-// Link list of errors build into MESSAGE_SPACE
+// Link list of errors built into chunks claimed from the shared error arena.
+// Chunks are only claimed once a test logs something and are handed back once
+// the test has been reported. With DEFERRED_MESSAGES the message holds a copy
+// of the arguments until the text is needed, so always read it through Text.
 //---------------------------------------------------------------------------------
 struct TestError
 {
 	TestError* next;
+	char const* format; // set while the message is deferred
 	char message[1];
+
+	// Text of the message, deferred messages are formatted into the buffer
+	char const* Text(char* buffer, size_t size) const;
+};
+
+struct TestErrorChunk
+{
+	TestErrorChunk* next;
+	size_t size; // a run of several chunks when a long message needed the room
 };
 
 //---------------------------------------------------------------------------------
@@ -81,6 +168,160 @@ TempString TypeToString(T* pointer) { return TypeToString((T const*)pointer); }
 
 inline TempString TypeToStringFallback(TempString string, char const* fallback) { return (*string)[0] ?  string : TempString(fallback); }
 
+//---------------------------------------------------------------------------------
+// How TestArrays finds and prints differing elements. find returns the index of
+// the first element from start that differs, or count if the rest match.
+// Without toString elements are bytes and printed as hex.
+//---------------------------------------------------------------------------------
+struct TestArrayCompare
+{
+	size_t (*find)(void const* left, void const* right, size_t count, size_t start, double tolerance);
+	TempString (*toString)(void const* array, size_t index);
+	double tolerance;
+};
+
+// Vectorized searches used by the array tests, SSE2 or AVX2 where the cpu has it
+size_t TestFindMismatch(void const* left, void const* right, size_t size, size_t start);
+size_t TestFindNotClose(float const* left, float const* right, size_t count, size_t start, double tolerance);
+size_t TestFindNotClose(double const* left, double const* right, size_t count, size_t start, double tolerance);
+
+// Elements compare with their own operators, except for integers and enums which
+// compare as memory and floats which have their own vectorized search
+template <typename T>
+struct TestArrayValues
+{
+	static size_t FindUnequal(void const* left, void const* right, size_t count, size_t start, double)
+	{
+		T const* l = (T const*)left;
+		T const* r = (T const*)right;
+		for (; start < count && l[start] == r[start]; ++start) {}
+		return start;
+	}
+	static size_t FindNotClose(void const* left, void const* right, size_t count, size_t start, double tolerance)
+	{
+		T const* l = (T const*)left;
+		T const* r = (T const*)right;
+		for (; start < count && (l[start] == r[start] || (l[start] > r[start] ? l[start] - r[start] : r[start] - l[start]) <= tolerance); ++start) {}
+		return start;
+	}
+	static TempString ToString(void const* array, size_t index) { return TypeToStringFallback(TypeToString(((T const*)array)[index]), "?"); }
+};
+
+template <typename T>
+struct TestArrayMemory : TestArrayValues<T>
+{
+	static size_t FindUnequal(void const* left, void const* right, size_t count, size_t start, double)
+	{
+		return TestFindMismatch(left, right, count * sizeof(T), start * sizeof(T)) / sizeof(T);
+	}
+};
+
+template <typename T>
+struct TestArrayFloats : TestArrayValues<T>
+{
+	static size_t FindUnequal(void const* left, void const* right, size_t count, size_t start, double) { return TestFindNotClose((T const*)left, (T const*)right, count, start, 0); }
+	static size_t FindNotClose(void const* left, void const* right, size_t count, size_t start, double tolerance) { return TestFindNotClose((T const*)left, (T const*)right, count, start, tolerance); }
+};
+
+template <typename T>
+struct TestArrayElements : std::conditional<std::is_integral<T>::value || std::is_enum<T>::value, TestArrayMemory<T>, TestArrayValues<T>>::type {};
+template <> struct TestArrayElements<float> : TestArrayFloats<float> {};
+template <> struct TestArrayElements<double> : TestArrayFloats<double> {};
+
+//---------------------------------------------------------------------------------
+// Monotonic high resolution clock used for benchmarks. Defining BENCHMARK_USE_TSC
+// reads the time stamp counter directly on x86, calibrated against the system clock.
+//---------------------------------------------------------------------------------
+struct TestClock
+{
+	static unsigned long long Now();
+	static double ToSeconds(unsigned long long ticks);
+};
+
+//---------------------------------------------------------------------------------
+// State and results of a benchmark, owned by the fixture that DEFINE_BENCHMARK creates
+//---------------------------------------------------------------------------------
+struct TestBenchmark
+{
+	unsigned long long iterations; // iterations to run in the next sample
+	unsigned long long ticks; // time taken by the last sample
+	double bytesPerIteration;
+	double itemsPerIteration;
+
+	// Results in seconds per iteration
+	double min;
+	double median;
+	double mean;
+	double stddev;
+};
+
+//---------------------------------------------------------------------------------
+// Settings and results of a stress test, owned by the fixture that
+// DEFINE_STRESS_TEST creates. Change the settings through the fixture in Setup.
+//---------------------------------------------------------------------------------
+struct TestStress
+{
+	int threads; // threads running the body at once, 0 uses all hardware threads
+	unsigned long long iterations; // iterations each thread runs, 0 runs each thread for duration seconds instead
+	double duration;
+
+	// Results of the last run
+	int numThreads;
+	unsigned long long threadIterations[STRESS_MAX_THREADS];
+	double threadSeconds[STRESS_MAX_THREADS];
+};
+
+// Handed to every iteration of a stress test
+struct TestStressThread
+{
+	int index; // thread running the iteration, in [0, count)
+	int count;
+	unsigned long long iteration; // iterations this thread has run so far
+};
+
+//---------------------------------------------------------------------------------
+// Limits declared along with a test through the _L variants of DEFINE_TEST, i.e.
+// DEFINE_TEST_L(Parse, TestLimits().Budget(0.01)) fails if Parse takes over 10ms.
+// A budget is checked once the test is done, a timeout is enforced by a watchdog
+// that gives up on the test while it's still running.
+//---------------------------------------------------------------------------------
+struct TestLimits
+{
+	TestLimits() : budget(0), timeout(0) {}
+
+	TestLimits& Budget(double seconds) { budget = seconds; return *this; }
+	TestLimits& Timeout(double seconds) { timeout = seconds; return *this; }
+
+	double budget; // seconds the test may take, 0 for no limit
+	double timeout; // seconds the test may run before it's failed and left behind, 0 uses the run's timeout
+};
+
+//---------------------------------------------------------------------------------
+// Wall time of a test from a baseline file, or per iteration for benchmarks
+//---------------------------------------------------------------------------------
+struct TestBaseline
+{
+	double mean;
+	double stddev;
+	int samples;
+};
+
+//---------------------------------------------------------------------------------
+// Constant description of a test that is only constructed when it's selected.
+// These are emitted into a linker section so registering them costs nothing at startup.
+//---------------------------------------------------------------------------------
+class TestFixture;
+struct TestReporter;
+
+struct TestDescriptor
+{
+	char const* name;
+	char const* group;
+	char const* file;
+	int line;
+	TestFixture* (*create)(); // construct the fixture into its own static storage
+};
+
 //---------------------------------------------------------------------------------
 // Test fixture is the core of SimpleTest. It provides fixture behavior, access
 // to registered tests and stores the results of a test run
@@ -90,34 +331,114 @@ class TestFixture
 {
 public:
 	TestFixture();
-	virtual ~TestFixture() {};
+	virtual ~TestFixture() { ReleaseErrors(); }
 
 	virtual bool ExecuteTest();
 
+	// Tests that spend their time waiting, i.e. on timers or sockets, can start
+	// and be finished later. Runners begin every test that accepts before anything
+	// else and end them in order on the calling thread, so they're all in flight
+	// at once. Tests that return false from Begin run through ExecuteTest instead.
+	virtual bool BeginExecuteTest() { return false; }
+	virtual bool EndExecuteTest() { return myNumErrors == 0; }
+
 	virtual char const* TestName() const = 0;
 	virtual char const* TestGroup() const = 0;
+	virtual TestLimits Limits() const { return TestLimits(); }
 
 	// Reporting used during testing process
 	void AddTest() { ++myNumTestsChecked; }
+	void AddTests(int count) { myNumTestsChecked += count; }
 	void AddError() { ++myNumErrors; }
-	void LogMessage(char const* string, ...);
+	void AddResults(long long checks, long long errors); // counts from elsewhere, i.e. many cases or threads, they stop at INT_MAX
+	void LogMessage(char const* string, ...); // with DEFERRED_MESSAGES the format has to outlive the report, i.e. a string literal
+
+	// False once the test has more failures than messages are logged for, counting the failure as unlogged. Checks ask
+	// once per failure before logging it, LogMessage itself always logs so framework messages like timeouts aren't lost.
+	bool ShouldLogFailure() { return ourMaxLoggedFailures == 0 || myNumErrors <= ourMaxLoggedFailures || (++myNumUnloggedFailures, false); }
 
-	// Custom test for strings to print out where the comparison failed
+	// Informational messages, i.e. from hooks, are only printed for verbose runs or next to failures, so they aren't worth
+	// arena space otherwise. Ask at the end of the work being described so failures it ran into count.
+	bool ShouldLogInfo() const { return ourOutput == Verbose || myNumErrors > 0; }
+
+	// Custom test for strings to print out where the comparison failed. The prefix is a format taking the condition and then
+	// three strings, the left string, a caret under the difference and the right string, i.e. TEST_ERROR_PREFIX_ "\n%s\n%s\n%s".
 	bool TestStrings(char const* left, char const* right, char const* prefix, char const* condition);
+	// Lengths allow embedded nulls and strings that aren't terminated, the prefix takes the condition and the whole report as one string
+	bool TestStrings(char const* left, size_t leftLength, char const* right, size_t rightLength, char const* prefix, char const* condition);
+
+	// Custom tests for arrays that count every differing element, but only print the first few along with their neighbours
+	bool TestArrays(void const* left, void const* right, size_t count, TestArrayCompare const& compare, char const* prefix, char const* condition);
+	bool TestMemory(void const* left, void const* right, size_t size, char const* prefix, char const* condition)
+	{
+		TestArrayCompare compare = { &TestArrayElements<unsigned char>::FindUnequal, nullptr, 0 };
+		return TestArrays(left, right, size, compare, prefix, condition);
+	}
+	template <typename T>
+	bool TestArrays(T const* left, T const* right, size_t count, char const* prefix, char const* condition)
+	{
+		TestArrayCompare compare = { &TestArrayElements<T>::FindUnequal, &TestArrayElements<T>::ToString, 0 };
+		return TestArrays(left, right, count, compare, prefix, condition);
+	}
+	template <typename T>
+	bool TestArraysClose(T const* left, T const* right, size_t count, double tolerance, char const* prefix, char const* condition)
+	{
+		TestArrayCompare compare = { &TestArrayElements<T>::FindNotClose, &TestArrayElements<T>::ToString, tolerance };
+		return TestArrays(left, right, count, compare, prefix, condition);
+	}
+
+	// Throughput reporting for benchmarks, ignored by regular tests
+	void SetBytesPerIteration(double bytes) { if (myBenchmark) myBenchmark->bytesPerIteration = bytes; }
+	void SetItemsPerIteration(double items) { if (myBenchmark) myBenchmark->itemsPerIteration = items; }
+	TestBenchmark const* GetBenchmark() const { return myBenchmark; }
+
+	// Settings for stress tests, call them from Setup. Ignored by regular tests
+	void SetStressThreads(int threads) { if (myStress) myStress->threads = threads; }
+	void SetStressIterations(unsigned long long iterations) { if (myStress) myStress->iterations = iterations; }
+	void SetStressDuration(double seconds) { if (myStress) myStress->duration = seconds; }
+	TestStress const* GetStress() const { return myStress; }
 
 	// Stats from execution
 	int NumTests() const { return myNumTestsChecked; }
 	int NumErrors() const { return myNumErrors; }
+	double GetDuration() const { return myDuration; } // wall time of the last execution in seconds, the mean when it was sampled more than once
+	double GetDurationStddev() const { return myDurationStddev; }
+	int NumSamples() const { return myNumSamples; }
+
+	// Baseline of the test when comparing against one
+	TestBaseline const* GetBaseline() const { return myBaseline.samples ? &myBaseline : nullptr; }
 
 	// Access to any errrors generated
-	TestError const* GetFirstError() const { return (TestError*)myMessageSpace; }
-	TestError const* GetLastError() const { return myNextError; }
+	TestError const* GetFirstError() const { return myFirstError; }
+	TestError const* GetLastError() const { return nullptr; }
+
+	// Messages that didn't fit in MESSAGE_SPACE or the error arena
+	int NumDroppedMessages() const { return myNumDroppedMessages; }
+
+	// Failures past ExecuteOptions::maxLoggedFailures, which were counted but not logged
+	int NumUnloggedFailures() const { return myNumUnloggedFailures; }
+
+	// Return message space to the arena, invalidates any errors
+	void ReleaseErrors();
+
+	// Construct a fixture without adding it to the registry
+	template <typename T>
+	static T* ConstructUnregistered(void* storage)
+	{
+		ourSkipRegistration = true;
+		T* fixture = new(storage) T;
+		ourSkipRegistration = false;
+		return fixture;
+	}
 
 	// Access to registered tests
 	static TestFixture* GetFirstTest() { return ourFirstTest; }
 	static TestFixture* GetCurrentTest() { return ourCurrentTest; }
 	TestFixture* GetNextTest() const { return myNextTest; }
 
+	// Tests the runner keeps in flight at once over its threads or worker processes, 1 outside of ExecuteAllTests
+	static int GetConcurrency() { return ourConcurrency; }
+
 	enum OutputMode
 	{
 		Silent,
@@ -125,6 +446,14 @@ public:
 		Verbose
 	};
 
+	// Order tests run and are reported in, anything but the default needs a history file
+	enum RunOrder
+	{
+		OrderDefault, // registration order
+		OrderFailedFirst, // tests that failed last time, then ones that aren't in the history yet, then the rest
+		OrderSlowestFirst, // longest last duration first, which keeps parallel runs from waiting on one slow test at the end
+	};
+
 	enum PrintMethod
 	{
 		PrintDefault,
@@ -138,11 +467,58 @@ public:
 	static void (*Print)(char const* string);
 	static void Printf(char const* string, ...);
 
-	static bool ExecuteAllTests(char const* groupFilter = nullptr, char const* nameFilter = nullptr, OutputMode output = Normal);
+	// Filters are comma separated lists of patterns. Patterns can use * and ?
+	// wildcards and patterns starting with - exclude anything they match.
+	// i.e. "Parse*,-ParseSlow" runs all groups starting with Parse except ParseSlow
+	struct ExecuteOptions
+	{
+		ExecuteOptions(char const* aGroupFilter = nullptr, char const* aNameFilter = nullptr, OutputMode anOutput = Normal, int aJobs = 1)
+			: groupFilter(aGroupFilter), nameFilter(aNameFilter), output(anOutput), jobs(aJobs), processes(-1), shardIndex(0), shardCount(1), maxLoggedFailures(0), timingFile(nullptr), resultFile(nullptr), reporter(nullptr)
+			, baselineFile(nullptr), baselineSamples(BASELINE_SAMPLES), regressionThreshold(BASELINE_THRESHOLD), recordBaseline(false), failRegressions(false)
+			, historyFile(nullptr), order(OrderDefault), failFast(false), list(false), timeout(0) {}
+
+		char const* groupFilter;
+		char const* nameFilter;
+		OutputMode output;
+		int jobs; // number of threads to run tests on, 0 uses all hardware threads
+		int processes; // run tests in this many pre-forked worker processes so a crash only fails one test, 0 uses all hardware threads (unix only)
+		int shardIndex; // run only the selected tests that fall in shard [0, shardCount)
+		int shardCount;
+		int maxLoggedFailures; // only log messages for the first failures of each test, 0 logs all of them
+		char const* timingFile; // results of a previous run, shards are balanced by duration instead of test count when set
+		char const* resultFile; // write the result of every test to this file, for MergeResults or as a later timing file
+		TestReporter* reporter; // receives structured results alongside the printed output, chain more through myNext
+		char const* baselineFile; // compare durations against this baseline, or write it when recordBaseline is set
+		int baselineSamples; // times each test is run when there's a baseline file
+		double regressionThreshold; // fraction slower than the baseline a test has to be before it's a regression
+		bool recordBaseline;
+		bool failRegressions; // regressions fail the test instead of only being flagged
+		char const* historyFile; // memory mapped record of the last result and duration of every test, created if it's missing
+		RunOrder order;
+		bool failFast; // stop at the first failing test, tests already running on other threads or processes still finish
+		bool list; // print the selected tests instead of running them
+		double timeout; // seconds any test may run before the watchdog fails it, logs its stack and carries on without it, 0 for no limit
+	};
+
+	// Fill options from command line arguments, prints usage and returns false on bad arguments
+	static bool ParseArguments(int argc, char const* const* argv, ExecuteOptions& options);
+
+	static bool ExecuteAllTests(ExecuteOptions const& options);
+	static bool ExecuteAllTests(char const* groupFilter = nullptr, char const* nameFilter = nullptr, OutputMode output = Normal) { return ExecuteAllTests(ExecuteOptions(groupFilter, nameFilter, output)); }
 	static bool ExecuteAllTests(OutputMode output) { return ExecuteAllTests(nullptr, nullptr, output); }
 
 	static bool ExecuteTestGroup(char const* groupFilter, OutputMode output = Normal) { return ExecuteAllTests(groupFilter, nullptr, output); }
 
+	// Benchmarks are skipped by ExecuteAllTests and only run when asked for
+	static bool ExecuteAllBenchmarks(ExecuteOptions const& options);
+	static bool ExecuteAllBenchmarks(char const* groupFilter = nullptr, char const* nameFilter = nullptr, OutputMode output = Normal) { return ExecuteAllBenchmarks(ExecuteOptions(groupFilter, nameFilter, output)); }
+
+	// Print group/name of every test matching the filters in this shard, then the benchmarks marked as such, returns the number found
+	static int ListTests(ExecuteOptions const& options);
+
+	// Print the failures and summary of several shards' result files as if they were a single run
+	static bool MergeResults(char const* const* resultFiles, int numFiles, OutputMode output = Normal);
+
 protected:
 	virtual void RunTest() = 0;
 	virtual void Setup() {}
@@ -154,41 +530,430 @@ protected:
 	static TestFixture* ourLastTest;
 
 	TestFixture* myNextTest;
-	TestError* myNextError;
+	TestErrorChunk* myErrorChunks;
+	TestError* myFirstError;
+	TestError* myLastError;
+	char* myErrorWrite;
+	int myErrorSpace;
+	int myNumDroppedMessages;
+	int myNumUnloggedFailures;
 
 	int myNumTestsChecked;
 	int myNumErrors;
 
 	PrintMethod myPrintMethod;
 
-	char myMessageSpace[MESSAGE_SPACE];
+	double myDuration;
+	double myDurationStddev;
+	int myNumSamples;
+	TestBaseline myBaseline;
+
+	TestBenchmark* myBenchmark;
+	TestStress* myStress;
+
+	// Count the budget as a check, failing it when the last duration went over
+	void CheckBudget();
+
+	// Run iteration on every thread of a stress test, each one checking into a fixture of its own
+	void RunStress(void (*iteration)(TestFixture& test, TestStressThread const& stress));
 
 	// allow access to current test outside of main code block
 	static thread_local TestFixture* ourCurrentTest;
+	static thread_local bool ourSkipRegistration;
+	static int ourMaxLoggedFailures;
+	static int ourNumSamples;
+	static int ourConcurrency;
+	static OutputMode ourOutput;
+
+private:
+	TestError* ClaimMessage(size_t size);
+	void AppendMessage(TestError* error, size_t size);
+	void AdoptResults(TestFixture& other); // move the counts and messages of other onto the end of this one
+
+	// Registry index, built on first use so selecting tests doesn't need to
+	// visit every test or call virtual functions
+	friend struct TestRunner;
+	friend class TestStandIn;
+	char const* myName;
+	char const* myGroup;
+	int myOrder;
+	unsigned mySelection;
+	TestFixture* myNextInGroup;
+	TestFixture* myLastInGroup;
+	TestFixture* myNextGroup;
+	TestFixture* myNextGroupInBucket;
+	TestFixture* myNextNameInBucket;
+	TestFixture* myNextName; // all tests sorted by name, for wildcards with a literal prefix
+	TestDescriptor const* myDescriptor; // set while a lazily registered test is constructed
+	static bool ourIndexDirty;
+
+	// Runner bookkeeping, intrusive so scheduling tests never allocates
+	TestFixture* myNextSelected;
+	TestFixture* myNextQueued;
+	TestFixture* myPrevQueued;
+	int myShard;
+	int myHistory; // entry in the run history, -1 when the test doesn't have one
+	double myTimeout; // seconds the watchdog gives the test this run, 0 when it isn't watched
+	std::atomic<bool> myFinished;
+	bool myAbandoned; // the watchdog couldn't stop the thread running it, so it's never touched, selected or destroyed again
 };
 
+//---------------------------------------------------------------------------------
+// Stands in for a test while part of it runs, i.e. one case or one thread, so its
+// checks and messages are kept apart. Afterwards they're logged to the test under
+// a header or adopted by it. Reset keeps the counts, which add up as long longs,
+// and drops the messages.
+//---------------------------------------------------------------------------------
+class TestStandIn final : public TestFixture
+{
+public:
+	TestStandIn() : myTest(nullptr), myTotalTests(0), myTotalErrors(0) {}
+
+	static TestStandIn* Construct(void* storage, TestFixture& test)
+	{
+		TestStandIn* standIn = ConstructUnregistered<TestStandIn>(storage);
+		standIn->myTest = &test;
+		return standIn;
+	}
+
+	char const* TestName() const override { return myTest->TestName(); }
+	char const* TestGroup() const override { return myTest->TestGroup(); }
+
+	// Run part of the test with this as the current test, returns true if it failed
+	template <typename Function>
+	bool Run(Function&& function)
+	{
+		TestFixture* lastCurrent = ourCurrentTest;
+		ourCurrentTest = this;
+		function();
+		ourCurrentTest = lastCurrent;
+		return myNumErrors != 0;
+	}
+
+	void Log(char const* header); // log the header and then the messages to the test, the counts are left alone
+	void Reset();
+	void Adopt(); // add every count to the test and move the messages onto the end of its own
+
+	TestFixture& Test() const { return *myTest; }
+	long long TotalTests() const { return myTotalTests + myNumTestsChecked; }
+	long long TotalErrors() const { return myTotalErrors + myNumErrors; }
+
+protected:
+	void RunTest() override {}
+
+private:
+	TestFixture* myTest;
+	long long myTotalTests;
+	long long myTotalErrors;
+};
+
+//---------------------------------------------------------------------------------
+// Groups that touch global state can opt out of parallel execution. Tests in a
+// serial group run alone on the calling thread before any workers are started.
+//---------------------------------------------------------------------------------
+struct TestSerialGroup
+{
+	TestSerialGroup(char const* group);
+
+	static bool IsSerial(char const* group);
+
+	char const* myGroup;
+	TestSerialGroup* myNext;
+	static TestSerialGroup* ourFirst;
+};
+
+//---------------------------------------------------------------------------------
+// Held around framework code that takes locks other tests need. The watchdog
+// doesn't park a hung thread inside one, it parks it as the outermost scope ends.
+//---------------------------------------------------------------------------------
+struct TestFrameworkScope
+{
+	TestFrameworkScope();
+	~TestFrameworkScope();
+
+	TestFrameworkScope(TestFrameworkScope const&) = delete;
+	TestFrameworkScope& operator=(TestFrameworkScope const&) = delete;
+};
+
+//---------------------------------------------------------------------------------
+// Hooks are called around every phase of a test on the thread running it, i.e.
+// to take measurements or check global state. Declare a static instance to
+// install one, they're called in order of construction.
+//---------------------------------------------------------------------------------
+enum TestPhase
+{
+	TestPhaseSetup,
+	TestPhaseRunTest,
+	TestPhaseTearDown,
+};
+
+struct TestHook
+{
+	TestHook();
+	virtual ~TestHook() {}
+
+	virtual void BeginPhase(TestFixture& /*test*/, TestPhase /*phase*/) {}
+	virtual void EndPhase(TestFixture& /*test*/, TestPhase /*phase*/) {}
+
+	// Phases of overlapped tests, i.e. async ones, interleave with other tests on the
+	// one thread, so anything kept per thread would be clobbered. They only get these,
+	// which skip the test unless a hook can tell the tests apart itself.
+	virtual void BeginOverlappedPhase(TestFixture& /*test*/, TestPhase /*phase*/) {}
+	virtual void EndOverlappedPhase(TestFixture& /*test*/, TestPhase /*phase*/) {}
+
+	TestHook* myNext;
+	static TestHook* ourFirst;
+};
+
+//---------------------------------------------------------------------------------
+// Reporters receive the results of a run as structured events, i.e. to write them
+// in a format CI understands. Everything is called from the thread that called
+// ExecuteAllTests, in selection order. Tests that ran on other threads or in
+// worker processes begin right before they end, once their results are in.
+//---------------------------------------------------------------------------------
+struct TestReporter
+{
+	TestReporter() : myNext(nullptr) {}
+	virtual ~TestReporter() {}
+
+	virtual void BeginRun(int /*numTests*/) {}
+	virtual void BeginTest(TestFixture const& /*test*/) {}
+	virtual void EndTest(TestFixture const& /*test*/) {} // counts, duration and messages are all on the fixture
+	virtual void EndRun(int /*numTests*/, int /*numChecks*/, int /*numErrors*/, bool /*passed*/) {}
+
+	TestReporter* myNext;
+};
+
+//---------------------------------------------------------------------------------
+// Assertions go through whichever test_scope_ is visible. By default that's the
+// global one, which looks up the current test every time. With FAST_ASSERTIONS
+// test bodies get a local scope as a parameter instead, caching the fixture and
+// counting passing checks until the body returns. Copies, i.e. lambdas
+// capturing by value, count their own checks.
+//---------------------------------------------------------------------------------
+struct TestAssertScope
+{
+	explicit TestAssertScope(TestFixture* test) : myTest(test), myChecked(0) {}
+	TestAssertScope(TestAssertScope const& other) : myTest(other.myTest), myChecked(0) {}
+	TestAssertScope& operator=(TestAssertScope const&) = delete;
+	~TestAssertScope() { myTest->AddTests(myChecked); }
+
+	TestFixture* Fixture() const { return myTest; }
+	void Check() const { ++myChecked; }
+
+	TestFixture* myTest;
+	mutable int myChecked;
+};
+
+struct TestGlobalAssertScope
+{
+	static TestFixture* Fixture() { return TestFixture::GetCurrentTest(); }
+	static void Check() { TestFixture::GetCurrentTest()->AddTest(); }
+};
+
+static TestGlobalAssertScope const test_scope_ = {};
+
+#if defined(__GNUC__)
+#define TEST_UNUSED_ __attribute__((unused))
+#else
+#define TEST_UNUSED_
+#endif
+
+#if FAST_ASSERTIONS
+#define TEST_DECLARE_BODY_ \
+	void RunTest() override { TestAssertScope test_scope_(this); RunTestBody(test_scope_); } \
+	void RunTestBody(TestAssertScope const& test_scope_);
+#define TEST_DEFINE_BODY_(type) void type::RunTestBody(TestAssertScope const& test_scope_ TEST_UNUSED_)
+#else
+#define TEST_DECLARE_BODY_ void RunTest() override;
+#define TEST_DEFINE_BODY_(type) void type::RunTest()
+#endif
+
 //---------------------------------------------------------------------------------
 // Test definition macros
 //---------------------------------------------------------------------------------
+#define DEFINE_TEST_FULL_L(name, group, fixture, limits) \
+struct TOK(group, name) final : public fixture { \
+	char const* TestName() const override { return #name; } \
+	char const* TestGroup() const override { return #group; } \
+	TestLimits Limits() const override { return limits; } \
+	TEST_DECLARE_BODY_ \
+} TOK(TOK(group, name), Instance); \
+TEST_DEFINE_BODY_(TOK(group, name))
+
 #define DEFINE_TEST_FULL(name, group, fixture) \
 struct TOK(group, name) final : public fixture { \
 	char const* TestName() const override { return #name; } \
 	char const* TestGroup() const override { return #group; } \
-	void RunTest() override; \
+	TEST_DECLARE_BODY_ \
 } TOK(TOK(group, name), Instance); \
-void TOK(group, name)::RunTest()
+TEST_DEFINE_BODY_(TOK(group, name))
+
+//---------------------------------------------------------------------------------
+// Lazy registration emits a constant TestDescriptor instead of a global fixture.
+// The fixture is only constructed, into storage reserved for it, when the test
+// is selected and it's destroyed again once it has been reported. Define
+// LAZY_REGISTRATION to make every DEFINE_TEST register this way.
+//---------------------------------------------------------------------------------
+template <typename T>
+TestFixture* TestCreateLazy()
+{
+	alignas(T) static char storage[sizeof(T)];
+	return TestFixture::ConstructUnregistered<T>(storage);
+}
+
+#if defined(_MSC_VER)
+#pragma section("stest$m", read)
+#define TEST_DESCRIPTOR_SECTION __declspec(allocate("stest$m"))
+#elif defined(__APPLE__)
+#define TEST_DESCRIPTOR_SECTION __attribute__((used, section("__DATA,simpletest")))
+#elif defined(__ELF__)
+#define TEST_DESCRIPTOR_SECTION __attribute__((used, section("simpletest_tests")))
+#endif
+
+#if defined(TEST_DESCRIPTOR_SECTION)
+#define TEST_REGISTER_DESCRIPTOR(descriptor) TEST_DESCRIPTOR_SECTION static TestDescriptor const* const TOK(descriptor, Entry) = &descriptor;
+#else
+// no linker section support, fall back to linking descriptors at startup which is still only a pointer swap
+struct TestDescriptorLink
+{
+	TestDescriptorLink(TestDescriptor const* aDescriptor) : descriptor(aDescriptor), next(ourFirst) { ourFirst = this; }
+
+	TestDescriptor const* descriptor;
+	TestDescriptorLink* next;
+	static TestDescriptorLink* ourFirst;
+};
+#define TEST_REGISTER_DESCRIPTOR(descriptor) static TestDescriptorLink TOK(descriptor, Link)(&descriptor);
+#endif
+
+#define DEFINE_LAZY_TEST_FULL(name, group, fixture) \
+struct TOK(group, name) final : public fixture { \
+	char const* TestName() const override { return #name; } \
+	char const* TestGroup() const override { return #group; } \
+	TEST_DECLARE_BODY_ \
+}; \
+static TestDescriptor const TOK(TOK(group, name), Descriptor) = { #name, #group, __FILE__, __LINE__, &TestCreateLazy<TOK(group, name)> }; \
+TEST_REGISTER_DESCRIPTOR(TOK(TOK(group, name), Descriptor)) \
+TEST_DEFINE_BODY_(TOK(group, name))
+
+#define DEFINE_LAZY_TEST_FULL_L(name, group, fixture, limits) \
+struct TOK(group, name) final : public fixture { \
+	char const* TestName() const override { return #name; } \
+	char const* TestGroup() const override { return #group; } \
+	TestLimits Limits() const override { return limits; } \
+	TEST_DECLARE_BODY_ \
+}; \
+static TestDescriptor const TOK(TOK(group, name), Descriptor) = { #name, #group, __FILE__, __LINE__, &TestCreateLazy<TOK(group, name)> }; \
+TEST_REGISTER_DESCRIPTOR(TOK(TOK(group, name), Descriptor)) \
+TEST_DEFINE_BODY_(TOK(group, name))
+
+#if defined(LAZY_REGISTRATION)
+#undef DEFINE_TEST_FULL
+#define DEFINE_TEST_FULL(name, group, fixture) DEFINE_LAZY_TEST_FULL(name, group, fixture)
+#undef DEFINE_TEST_FULL_L
+#define DEFINE_TEST_FULL_L(name, group, fixture, limits) DEFINE_LAZY_TEST_FULL_L(name, group, fixture, limits)
+#endif
 
 #define DEFINE_TEST(name) DEFINE_TEST_FULL(name, Global, BASE_FIXTURE)
 #define DEFINE_TEST_G(name, group) DEFINE_TEST_FULL(name, group, BASE_FIXTURE)
 #define DEFINE_TEST_F(name, fixture) DEFINE_TEST_FULL(name, Global, fixture)
 #define DEFINE_TEST_GF(name, group, fixture) DEFINE_TEST_FULL(name, group, fixture)
 
+// Tests with limits, i.e. DEFINE_TEST_GL(Parse, Text, TestLimits().Budget(0.01))
+#define DEFINE_TEST_L(name, limits) DEFINE_TEST_FULL_L(name, Global, BASE_FIXTURE, limits)
+#define DEFINE_TEST_GL(name, group, limits) DEFINE_TEST_FULL_L(name, group, BASE_FIXTURE, limits)
+#define DEFINE_TEST_FL(name, fixture, limits) DEFINE_TEST_FULL_L(name, Global, fixture, limits)
+#define DEFINE_TEST_GFL(name, group, fixture, limits) DEFINE_TEST_FULL_L(name, group, fixture, limits)
+
+//---------------------------------------------------------------------------------
+// Benchmark definition macros. The body is a single iteration, it's run in a
+// loop that is scaled to BENCHMARK_SAMPLE_TIME and timed outside of Setup and
+// TearDown. TEST macros can still be used inside the body.
+//---------------------------------------------------------------------------------
+#define DEFINE_BENCHMARK_FULL(name, group, fixture) \
+struct TOK(group, name) final : public fixture { \
+	TOK(group, name)() { myBenchmark = &myBenchmarkState; } \
+	char const* TestName() const override { return #name; } \
+	char const* TestGroup() const override { return #group; } \
+	void RunTest() override { \
+		unsigned long long start = TestClock::Now(); \
+		for (unsigned long long i = myBenchmarkState.iterations; i; --i) RunIteration(); \
+		myBenchmarkState.ticks = TestClock::Now() - start; \
+	} \
+	void RunIteration(); \
+	TestBenchmark myBenchmarkState = {}; \
+} TOK(TOK(group, name), Instance); \
+void TOK(group, name)::RunIteration()
+
+#define DEFINE_BENCHMARK(name) DEFINE_BENCHMARK_FULL(name, Global, BASE_FIXTURE)
+#define DEFINE_BENCHMARK_G(name, group) DEFINE_BENCHMARK_FULL(name, group, BASE_FIXTURE)
+#define DEFINE_BENCHMARK_F(name, fixture) DEFINE_BENCHMARK_FULL(name, Global, fixture)
+#define DEFINE_BENCHMARK_GF(name, group, fixture) DEFINE_BENCHMARK_FULL(name, group, fixture)
+
+//---------------------------------------------------------------------------------
+// Stress test definition macros. The body is a single iteration that's run on
+// many threads at once, i.e. to hammer a lock free queue, with stress.index
+// telling the threads apart. Threads wait on a barrier so they all start at
+// once. TEST macros work from any of them, each thread checks into its own
+// counters and messages which are merged into the test in thread order.
+//---------------------------------------------------------------------------------
+#define DEFINE_STRESS_TEST_FULL(name, group, fixture) \
+struct TOK(group, name) final : public fixture { \
+	TOK(group, name)() { myStressState.duration = STRESS_DURATION; myStress = &myStressState; } \
+	char const* TestName() const override { return #name; } \
+	char const* TestGroup() const override { return #group; } \
+	void RunTest() override { RunStress([](TestFixture& test, TestStressThread const& stress) { static_cast<TOK(group, name)&>(test).RunIteration(stress); }); } \
+	void RunIteration(TestStressThread const& stress); \
+	TestStress myStressState = {}; \
+} TOK(TOK(group, name), Instance); \
+void TOK(group, name)::RunIteration(TestStressThread const& stress TEST_UNUSED_)
+
+#define DEFINE_STRESS_TEST(name) DEFINE_STRESS_TEST_FULL(name, Global, BASE_FIXTURE)
+#define DEFINE_STRESS_TEST_G(name, group) DEFINE_STRESS_TEST_FULL(name, group, BASE_FIXTURE)
+#define DEFINE_STRESS_TEST_F(name, fixture) DEFINE_STRESS_TEST_FULL(name, Global, fixture)
+#define DEFINE_STRESS_TEST_GF(name, group, fixture) DEFINE_STRESS_TEST_FULL(name, group, fixture)
+
+#define DEFINE_SERIAL_GROUP(group) static TestSerialGroup TOK(group, SerialGroup)(#group)
+
 //---------------------------------------------------------------------------------
 // Utils
 //---------------------------------------------------------------------------------
 template <typename T>
 T TestDifference(T const& a, T const& b) { return a > b ? a - b : b - a; }
 
+// Keep the compiler from optimizing away benchmark results or memory writes
+extern void const volatile* volatile ourBenchmarkSink;
+
+template <typename T>
+inline void DoNotOptimize(T const& value)
+{
+#if defined(_MSC_VER)
+	ourBenchmarkSink = &value;
+	_ReadWriteBarrier();
+#else
+	asm volatile("" : : "r,m"(value) : "memory");
+#endif
+}
+
+inline void ClobberMemory()
+{
+#if defined(_MSC_VER)
+	_ReadWriteBarrier();
+#else
+	asm volatile("" : : : "memory");
+#endif
+}
+
+#if defined(__GNUC__)
+#define TEST_LIKELY(x) __builtin_expect(!!(x), 1)
+#define TEST_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define TEST_COLD_ __attribute__((noinline, cold))
+#else
+#define TEST_LIKELY(x) (x)
+#define TEST_UNLIKELY(x) (x)
+#define TEST_COLD_
+#endif
+
 // why are these still needed?
 #define STR2(x) #x
 #define STR(x) STR2(x)
@@ -201,9 +966,10 @@ T TestDifference(T const& a, T const& b) { return a > b ? a - b : b - a; }
 //---------------------------------------------------------------------------------
 #define TEST_TYPE_TO_STRING(var, arg) *TypeToStringFallback(TypeToString(var), STR(arg))
 #define TEST_ERROR_PREFIX_ __FILE__ "(" STR(__LINE__) "): Condition [%s] Failed. "
-#define TEST_ERROR_(message, ...) do { TestFixture* __fx = TestFixture::GetCurrentTest(); __fx->AddError(); __fx->LogMessage(TEST_ERROR_PREFIX_ message, ##__VA_ARGS__); ERROR_ACTION; } while(0)
+#define TEST_ERROR_(message, ...) do { TestFixture* __fx = test_scope_.Fixture(); __fx->AddError(); if (__fx->ShouldLogFailure()) __fx->LogMessage(TEST_ERROR_PREFIX_ message, ##__VA_ARGS__); } while(0)
 #define TEST_BEGIN_(a) do { auto const& test_value_ = a
-#define TEST_CHECK_(cond, condtext, message, ...) do { TestFixture::GetCurrentTest()->AddTest(); if (!(cond)) TEST_ERROR_(message, condtext, ##__VA_ARGS__); } while(0)
+// failures are formatted in a cold lambda so the passing path stays small enough to sit in tight loops
+#define TEST_CHECK_(cond, condtext, message, ...) do { test_scope_.Check(); if (TEST_UNLIKELY(!(cond))) { [&]() TEST_COLD_ { TEST_ERROR_(message, condtext, ##__VA_ARGS__); }(); ERROR_ACTION; } } while(0)
 #define TEST_END_ } while(0)
 
 //---------------------------------------------------------------------------------
@@ -229,7 +995,11 @@ T TestDifference(T const& a, T const& b) { return a > b ? a - b : b - a; }
 #define TEST_LESS(a, b) TEST_OPERATOR(a, b, <, >=)
 #define TEST_LESS_EQUAL(a, b) TEST_OPERATOR(a, b, <=, >)
 
-#define TEST_STR_EQ(a, b) do { if(!TestFixture::GetCurrentTest()->TestStrings(a, b, TEST_ERROR_PREFIX_ "\n%s\n%s\n%s", STR(a) " == " STR(b))) { ERROR_ACTION; } } while(0)
+#define TEST_STR_EQ(a, b) do { if(TEST_UNLIKELY(!test_scope_.Fixture()->TestStrings(a, b, TEST_ERROR_PREFIX_ "\n%s\n%s\n%s", STR(a) " == " STR(b)))) { ERROR_ACTION; } } while(0)
+#define TEST_STR_EQ_LEN(a, aLength, b, bLength) do { if(TEST_UNLIKELY(!test_scope_.Fixture()->TestStrings(a, aLength, b, bLength, TEST_ERROR_PREFIX_ "%s", STR(a) " == " STR(b)))) { ERROR_ACTION; } } while(0)
+#define TEST_ARRAY_EQ(a, b, count) do { if(TEST_UNLIKELY(!test_scope_.Fixture()->TestArrays(a, b, count, TEST_ERROR_PREFIX_ "%s", STR(a) " == " STR(b)))) { ERROR_ACTION; } } while(0)
+#define TEST_ARRAY_CLOSE(a, b, count, eps) do { if(TEST_UNLIKELY(!test_scope_.Fixture()->TestArraysClose(a, b, count, eps, TEST_ERROR_PREFIX_ "%s", STR(a) " Close to " STR(b)))) { ERROR_ACTION; } } while(0)
+#define TEST_MEM_EQ(a, b, size) do { if(TEST_UNLIKELY(!test_scope_.Fixture()->TestMemory(a, b, size, TEST_ERROR_PREFIX_ "%s", STR(a) " == " STR(b)))) { ERROR_ACTION; } } while(0)
 #define TEST_CLOSE(a, b, eps) TEST_BEGIN_(TestDifference(a, b)); TEST_CHECK_(test_value_ <= eps, STR(a) " Close to " STR(b), "Difference of %s is greater than expected amount of " STR(eps) " when comparing %s and %s", TEST_TYPE_TO_STRING(test_value_, TestDifference(a, b)), TEST_TYPE_TO_STRING(a, a), TEST_TYPE_TO_STRING(b, b)); TEST_END_
 #define TEST_DIFFERS(a, b, eps) TEST_BEGIN_(TestDifference(a, b)); TEST_CHECK_(test_value_ >= eps, STR(a) " Differs from " STR(b), "Difference of %s is less than expected amount of " STR(eps) " when comparing %s and %s", TEST_TYPE_TO_STRING(test_value_, TestDifference(a, b)), TEST_TYPE_TO_STRING(a, a), TEST_TYPE_TO_STRING(b, b)); TEST_END_
 #define TEST_MESSAGE(cond, message, ...) TEST_BEGIN_(cond); TEST_CHECK_(test_value_, STR(cond), message, ##__VA_ARGS__); TEST_END_
@@ -0,0 +1,503 @@
+#include "simpletest_alloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <atomic>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#define TEST_ALLOC_MALLOC 1
+#endif
+
+// Counters are touched from inside malloc, so they can't use a TLS model that might allocate
+#if defined(__GNUC__)
+#define TEST_ALLOC_TLS __attribute__((tls_model("initial-exec")))
+#else
+#define TEST_ALLOC_TLS
+#endif
+
+//---------------------------------------------------------------------------------
+// Raw allocation, straight to the C runtime without any tracking
+//---------------------------------------------------------------------------------
+#if TEST_ALLOC_MALLOC
+extern "C"
+{
+	void* __libc_malloc(size_t size);
+	void* __libc_calloc(size_t count, size_t size);
+	void* __libc_realloc(void* block, size_t size);
+	void __libc_free(void* block);
+}
+static void* locRawMalloc(size_t size) { return __libc_malloc(size); }
+static void* locRawCalloc(size_t size) { return __libc_calloc(1, size); }
+static void* locRawRealloc(void* block, size_t size) { return __libc_realloc(block, size); }
+static void locRawFree(void* block) { __libc_free(block); }
+#else
+static void* locRawMalloc(size_t size) { return malloc(size); }
+static void locRawFree(void* block) { free(block); }
+#endif
+
+//---------------------------------------------------------------------------------
+// Every block has a header naming the account it was counted on, so a block freed
+// on another thread, i.e. a std::thread's state or anything handed between stress
+// test threads, still comes off the live bytes of the right account. Threads
+// started from inside a test share the account of the thread that started them,
+// so whatever they allocate belongs to that test too. Only the thread an account
+// belongs to writes its own counters, shared threads and frees from elsewhere go
+// through counters of their own. Accounts are never freed since their blocks can
+// outlive the thread.
+//---------------------------------------------------------------------------------
+struct TestAllocAccount
+{
+	// written by the owning thread only, the peak includes whatever was on the account at the time
+	std::atomic<long long> allocations;
+	std::atomic<long long> frees;
+	std::atomic<long long> bytes;
+	std::atomic<long long> liveBytes;
+	std::atomic<long long> peakLiveBytes;
+
+	// allocations made on threads sharing the account and frees made anywhere else
+	std::atomic<long long> sharedAllocations;
+	std::atomic<long long> sharedBytes;
+	std::atomic<long long> remoteFrees;
+	std::atomic<long long> remoteBytes;
+};
+struct alignas(16) TestAllocHeader
+{
+	uintptr_t owner; // the low bit is set when the block was padded for alignment, with the raw block stored just before the header
+	size_t size; // as asked for
+};
+static_assert(sizeof(TestAllocHeader) == 16, "the header has to keep blocks aligned like malloc does");
+
+static thread_local TestAllocAccount* locAccount TEST_ALLOC_TLS;
+static thread_local bool locShared TEST_ALLOC_TLS; // locAccount belongs to the thread that started this one
+static thread_local int locUntracked TEST_ALLOC_TLS;
+static TestAllocAccount locUntrackedAccount; // owns blocks nobody counts, only ever touched through its remote counters
+
+static TestAllocAccount& locThisAccount()
+{
+	TestAllocAccount* account = locAccount;
+	if (account == nullptr)
+	{
+		void* storage = locRawMalloc(sizeof(TestAllocAccount));
+		if (storage == nullptr)
+			abort();
+		account = locAccount = new (storage) TestAllocAccount();
+	}
+	return *account;
+}
+// Only the owning thread adds to its own counters, so it doesn't need a locked instruction
+static void locAdd(std::atomic<long long>& counter, long long value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+static long long locLiveBytes(TestAllocAccount const& account)
+{
+	return account.liveBytes.load(std::memory_order_relaxed) + account.sharedBytes.load(std::memory_order_relaxed) - account.remoteBytes.load(std::memory_order_relaxed);
+}
+static void locSetPeak(long long peak)
+{
+	if (!locShared)
+		locThisAccount().peakLiveBytes.store(peak, std::memory_order_relaxed);
+}
+static TestAllocStats locCurrent()
+{
+	TestAllocAccount const& account = locThisAccount();
+	TestAllocStats stats;
+	stats.allocations = account.allocations.load(std::memory_order_relaxed) + account.sharedAllocations.load(std::memory_order_relaxed);
+	stats.frees = account.frees.load(std::memory_order_relaxed) + account.remoteFrees.load(std::memory_order_relaxed);
+	stats.bytes = account.bytes.load(std::memory_order_relaxed) + account.sharedBytes.load(std::memory_order_relaxed);
+	stats.liveBytes = locLiveBytes(account);
+	stats.peakLiveBytes = account.peakLiveBytes.load(std::memory_order_relaxed);
+	return stats;
+}
+static TestAllocStats locSince(TestAllocStats const& start)
+{
+	TestAllocStats const now = locCurrent();
+	TestAllocStats stats;
+	stats.allocations = now.allocations - start.allocations;
+	stats.frees = now.frees - start.frees;
+	stats.bytes = now.bytes - start.bytes;
+	stats.liveBytes = now.liveBytes - start.liveBytes;
+	stats.peakLiveBytes = now.peakLiveBytes - start.liveBytes;
+	return stats;
+}
+
+//---------------------------------------------------------------------------------
+// Tracking
+//---------------------------------------------------------------------------------
+static TestAllocHeader* locHeader(void* block) { return (TestAllocHeader*)block - 1; }
+static TestAllocAccount* locOwner(TestAllocHeader const* header) { return (TestAllocAccount*)(header->owner & ~uintptr_t(1)); }
+static void* locRawBlock(TestAllocHeader* header) { return header->owner & 1 ? ((void**)header)[-1] : header; }
+
+// Put the header at offset bytes into a raw block and count it against this thread
+static void* locTrackAllocation(void* raw, size_t size, size_t offset)
+{
+	if (raw == nullptr)
+		return nullptr;
+
+	TestAllocAccount& account = locUntracked ? locUntrackedAccount : locThisAccount();
+	void* block = (char*)raw + offset;
+	TestAllocHeader* header = locHeader(block);
+	bool padded = offset != sizeof(TestAllocHeader);
+	header->owner = uintptr_t(&account) | padded;
+	header->size = size;
+	if (padded)
+		((void**)header)[-1] = raw;
+	if (locUntracked)
+		return block;
+
+	if (locShared)
+	{
+		account.sharedAllocations.fetch_add(1, std::memory_order_relaxed);
+		account.sharedBytes.fetch_add((long long)size, std::memory_order_relaxed);
+		return block;
+	}
+
+	locAdd(account.allocations, 1);
+	locAdd(account.bytes, (long long)size);
+	locAdd(account.liveBytes, (long long)size);
+	long long live = locLiveBytes(account);
+	if (live > account.peakLiveBytes.load(std::memory_order_relaxed))
+		account.peakLiveBytes.store(live, std::memory_order_relaxed);
+	return block;
+}
+static void locTrackFree(TestAllocAccount* owner, size_t size)
+{
+	if (owner == locAccount && !locShared)
+	{
+		locAdd(owner->frees, 1);
+		locAdd(owner->liveBytes, -(long long)size);
+	}
+	else
+	{
+		owner->remoteFrees.fetch_add(1, std::memory_order_relaxed);
+		owner->remoteBytes.fetch_add((long long)size, std::memory_order_relaxed);
+	}
+}
+
+// Blocks aligned past what malloc guarantees are padded so the header can sit right before them
+static void* locAllocate(size_t size, size_t alignment = 0)
+{
+	if (alignment <= alignof(max_align_t))
+	{
+		if (size > SIZE_MAX - sizeof(TestAllocHeader))
+			return nullptr;
+		return locTrackAllocation(locRawMalloc(size + sizeof(TestAllocHeader)), size, sizeof(TestAllocHeader));
+	}
+
+	size_t padding = sizeof(TestAllocHeader) + sizeof(void*) + alignment - 1;
+	if (size > SIZE_MAX - padding)
+		return nullptr;
+
+	void* raw = locRawMalloc(size + padding);
+	if (raw == nullptr)
+		return nullptr;
+
+	uintptr_t block = (uintptr_t(raw) + sizeof(TestAllocHeader) + sizeof(void*) + alignment - 1) & ~uintptr_t(alignment - 1);
+	return locTrackAllocation(raw, size, block - uintptr_t(raw));
+}
+static void locFree(void* block)
+{
+	if (block == nullptr)
+		return;
+
+	TestAllocHeader* header = locHeader(block);
+	locTrackFree(locOwner(header), header->size);
+	locRawFree(locRawBlock(header));
+}
+static size_t locAlignment(size_t alignment)
+{
+	size_t power = alignof(max_align_t);
+	while (power < alignment)
+		power <<= 1;
+	return power;
+}
+
+//---------------------------------------------------------------------------------
+// C allocation functions, glibc supports replacing these and calls them internally too
+//---------------------------------------------------------------------------------
+#if TEST_ALLOC_MALLOC
+extern "C"
+{
+void* malloc(size_t size)
+{
+	void* block = locAllocate(size);
+	if (block == nullptr)
+		errno = ENOMEM;
+	return block;
+}
+void* calloc(size_t count, size_t size)
+{
+	if (size && count > (SIZE_MAX - sizeof(TestAllocHeader)) / size)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	size_t total = count * size;
+	void* block = locTrackAllocation(locRawCalloc(total + sizeof(TestAllocHeader)), total, sizeof(TestAllocHeader));
+	if (block == nullptr)
+		errno = ENOMEM;
+	return block;
+}
+void* realloc(void* block, size_t size)
+{
+	if (block == nullptr)
+		return malloc(size);
+	if (size == 0)
+	{
+		free(block);
+		return nullptr;
+	}
+
+	TestAllocHeader* header = locHeader(block);
+	TestAllocAccount* owner = locOwner(header);
+	size_t oldSize = header->size;
+
+	// padded blocks would lose their alignment in place, they're moved instead
+	if (header->owner & 1)
+	{
+		void* result = malloc(size);
+		if (result)
+		{
+			memcpy(result, block, oldSize < size ? oldSize : size);
+			free(block);
+		}
+		return result;
+	}
+
+	// a failed realloc leaves the old block alone
+	void* raw = size <= SIZE_MAX - sizeof(TestAllocHeader) ? locRawRealloc(header, size + sizeof(TestAllocHeader)) : nullptr;
+	if (raw == nullptr)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	locTrackFree(owner, oldSize);
+	return locTrackAllocation(raw, size, sizeof(TestAllocHeader));
+}
+void* reallocarray(void* block, size_t count, size_t size)
+{
+	if (size && count > SIZE_MAX / size)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+	return realloc(block, count * size);
+}
+void free(void* block)
+{
+	locFree(block);
+}
+// Threads started from inside a test, or from a thread that was, share the account
+// of the thread starting them. glibc keeps the TLS vector of a new thread with its
+// stack, which is cached for reuse, so whatever creating a thread allocates isn't
+// counted against anyone.
+struct TestAllocThreadStart
+{
+	void* (*start)(void*);
+	void* argument;
+	TestAllocAccount* account;
+
+	static void* Run(void* self)
+	{
+		TestAllocThreadStart start = *(TestAllocThreadStart*)self;
+		locRawFree(self);
+		locAccount = start.account;
+		locShared = true;
+		return start.start(start.argument);
+	}
+};
+int pthread_create(pthread_t* thread, pthread_attr_t const* attributes, void* (*start)(void*), void* argument)
+{
+	using Create = int (*)(pthread_t*, pthread_attr_t const*, void* (*)(void*), void*);
+	static Create const create = (Create)dlsym(RTLD_NEXT, "pthread_create");
+
+	TestAllocThreadStart* shared = nullptr;
+	if (locShared || TestFixture::GetCurrentTest())
+	{
+		shared = (TestAllocThreadStart*)locRawMalloc(sizeof(TestAllocThreadStart));
+		if (shared == nullptr)
+			return EAGAIN;
+		shared->start = start;
+		shared->argument = argument;
+		shared->account = &locThisAccount();
+	}
+
+	++locUntracked;
+	int result = shared ? create(thread, attributes, &TestAllocThreadStart::Run, shared) : create(thread, attributes, start, argument);
+	--locUntracked;
+	if (result != 0 && shared)
+		locRawFree(shared);
+	return result;
+}
+size_t malloc_usable_size(void* block)
+{
+	return block ? locHeader(block)->size : 0;
+}
+void* memalign(size_t alignment, size_t size)
+{
+	void* block = locAllocate(size, locAlignment(alignment));
+	if (block == nullptr)
+		errno = ENOMEM;
+	return block;
+}
+void* aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+int posix_memalign(void** result, size_t alignment, size_t size)
+{
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	void* block = locAllocate(size, alignment);
+	if (block == nullptr)
+		return ENOMEM;
+
+	*result = block;
+	return 0;
+}
+void* valloc(size_t size)
+{
+	return memalign(size_t(sysconf(_SC_PAGESIZE)), size);
+}
+void* pvalloc(size_t size)
+{
+	size_t page = size_t(sysconf(_SC_PAGESIZE));
+	return memalign(page, size ? (size + page - 1) & ~(page - 1) : page);
+}
+}
+#endif
+
+//---------------------------------------------------------------------------------
+// Global operator new and delete
+//---------------------------------------------------------------------------------
+static void* locNew(size_t size, size_t alignment = 0)
+{
+	void* block = locAllocate(size ? size : 1, alignment);
+	if (block == nullptr)
+		throw std::bad_alloc();
+	return block;
+}
+
+void* operator new(size_t size) { return locNew(size); }
+void* operator new[](size_t size) { return locNew(size); }
+void* operator new(size_t size, std::nothrow_t const&) noexcept { return locAllocate(size ? size : 1); }
+void* operator new[](size_t size, std::nothrow_t const&) noexcept { return locAllocate(size ? size : 1); }
+void operator delete(void* block) noexcept { locFree(block); }
+void operator delete[](void* block) noexcept { locFree(block); }
+void operator delete(void* block, std::nothrow_t const&) noexcept { locFree(block); }
+void operator delete[](void* block, std::nothrow_t const&) noexcept { locFree(block); }
+#if defined(__cpp_sized_deallocation)
+void operator delete(void* block, size_t) noexcept { locFree(block); }
+void operator delete[](void* block, size_t) noexcept { locFree(block); }
+#endif
+
+#if defined(__cpp_aligned_new)
+void* operator new(size_t size, std::align_val_t alignment) { return locNew(size, size_t(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return locNew(size, size_t(alignment)); }
+void* operator new(size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept { return locAllocate(size ? size : 1, size_t(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept { return locAllocate(size ? size : 1, size_t(alignment)); }
+void operator delete(void* block, std::align_val_t) noexcept { locFree(block); }
+void operator delete[](void* block, std::align_val_t) noexcept { locFree(block); }
+void operator delete(void* block, size_t, std::align_val_t) noexcept { locFree(block); }
+void operator delete[](void* block, size_t, std::align_val_t) noexcept { locFree(block); }
+void operator delete(void* block, std::align_val_t, std::nothrow_t const&) noexcept { locFree(block); }
+void operator delete[](void* block, std::align_val_t, std::nothrow_t const&) noexcept { locFree(block); }
+#endif
+
+//---------------------------------------------------------------------------------
+TestAllocStats TestAlloc::Current()
+{
+	return locCurrent();
+}
+bool TestAlloc::TracksMalloc()
+{
+#if TEST_ALLOC_MALLOC
+	return true;
+#else
+	return false;
+#endif
+}
+
+//---------------------------------------------------------------------------------
+// Peaks are relative to the live bytes when a scope starts, so the thread's peak
+// is lowered for the lifetime of the scope and put back after
+//---------------------------------------------------------------------------------
+TestAllocScope::TestAllocScope()
+	: myStart(locCurrent())
+	, myOuterPeak(myStart.peakLiveBytes)
+{
+	locSetPeak(myStart.liveBytes);
+}
+TestAllocScope::~TestAllocScope()
+{
+	if (locCurrent().peakLiveBytes < myOuterPeak)
+		locSetPeak(myOuterPeak);
+}
+TestAllocStats TestAllocScope::Get() const
+{
+	return locSince(myStart);
+}
+
+bool TestAllocBudget::Check() const
+{
+	TestFixture* test = TestFixture::GetCurrentTest();
+	if (test == nullptr)
+		return true;
+
+	TestAllocStats stats = Get();
+	test->AddTest();
+	if (stats.allocations <= myMaxAllocations && stats.bytes <= myMaxBytes)
+		return true;
+
+	test->AddError();
+	if (test->ShouldLogFailure())
+		test->LogMessage("%s%lld allocations of %lld bytes, at most %lld allocations of %lld bytes are allowed", myPrefix, stats.allocations, stats.bytes, myMaxAllocations, myMaxBytes);
+	return false;
+}
+
+//---------------------------------------------------------------------------------
+// Test phases run back to back on one thread, so the hook only needs per thread state
+//---------------------------------------------------------------------------------
+static thread_local TestAllocStats locTestStart;
+static thread_local long long locTestOuterPeak;
+
+void TestAllocHook::BeginPhase(TestFixture& test, TestPhase phase)
+{
+	if (phase != TestPhaseSetup || test.GetBenchmark())
+		return;
+
+	locTestStart = locCurrent();
+	locTestOuterPeak = locTestStart.peakLiveBytes;
+	locSetPeak(locTestStart.liveBytes);
+}
+void TestAllocHook::EndPhase(TestFixture& test, TestPhase phase)
+{
+	if (phase != TestPhaseTearDown || test.GetBenchmark())
+		return;
+
+	TestAllocStats stats = locSince(locTestStart);
+	if (locCurrent().peakLiveBytes < locTestOuterPeak)
+		locSetPeak(locTestOuterPeak);
+
+	if (stats.allocations && test.ShouldLogInfo())
+		test.LogMessage("Allocated %lld bytes in %lld allocations with %lld frees, peak of %lld bytes live", stats.bytes, stats.allocations, stats.frees, stats.peakLiveBytes);
+
+	if (myFailOnLeaks)
+	{
+		test.AddTest();
+		if (stats.liveBytes > 0 || stats.allocations > stats.frees)
+		{
+			test.AddError();
+			test.LogMessage("Leaked %lld bytes, %lld allocations were never freed", stats.liveBytes, stats.allocations - stats.frees);
+		}
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "simpletest.h"
+
+//---------------------------------------------------------------------------------
+// Optional allocation tracking. Linking simpletest_alloc.cpp replaces the global
+// operator new and delete, and on glibc malloc, calloc, realloc and free as well.
+// Allocations are counted per thread so they belong to the test running on that
+// thread. Threads a test starts, and any they start, count towards the test's
+// thread, and every block remembers where it was counted so freeing it on any
+// other thread still balances out. Peaks only see the test's own thread allocate. Sizes are the size asked for,
+// each block carries a 16 byte header on top. Don't combine it with sanitizers
+// or other allocator replacements.
+//---------------------------------------------------------------------------------
+struct TestAllocStats
+{
+	long long allocations;
+	long long frees;
+	long long bytes; // total allocated
+	long long liveBytes; // allocated and not freed yet
+	long long peakLiveBytes;
+};
+
+struct TestAlloc
+{
+	// Running totals for the calling thread, including threads sharing its count and frees of its blocks on other threads
+	static TestAllocStats Current();
+
+	// True when malloc and friends are tracked as well as operator new
+	static bool TracksMalloc();
+};
+
+//---------------------------------------------------------------------------------
+// Allocations made on this thread since the scope was created. Frees of memory
+// from before the scope count too, so live bytes can go negative.
+//---------------------------------------------------------------------------------
+struct TestAllocScope
+{
+	TestAllocScope();
+	~TestAllocScope();
+
+	TestAllocStats Get() const;
+
+private:
+	TestAllocStats myStart;
+	long long myOuterPeak;
+};
+
+//---------------------------------------------------------------------------------
+// Fails the current test if the rest of the enclosing scope allocates more than allowed
+//---------------------------------------------------------------------------------
+struct TestAllocBudget : TestAllocScope
+{
+	TestAllocBudget(long long maxAllocations, long long maxBytes, char const* prefix)
+		: myMaxAllocations(maxAllocations), myMaxBytes(maxBytes), myPrefix(prefix) {}
+	~TestAllocBudget() { if (!Check()) { ERROR_ACTION; } }
+
+	bool Check() const;
+
+private:
+	long long myMaxAllocations;
+	long long myMaxBytes;
+	char const* myPrefix;
+};
+
+//---------------------------------------------------------------------------------
+// Declare a static instance to report the allocations of every test and fail
+// tests that don't free everything they allocate by the end of TearDown.
+// Benchmarks are left alone.
+//---------------------------------------------------------------------------------
+struct TestAllocHook : TestHook
+{
+	explicit TestAllocHook(bool failOnLeaks = true) : myFailOnLeaks(failOnLeaks) {}
+
+	void BeginPhase(TestFixture& test, TestPhase phase) override;
+	void EndPhase(TestFixture& test, TestPhase phase) override;
+
+private:
+	bool myFailOnLeaks;
+};
+
+//---------------------------------------------------------------------------------
+// Budgets for the rest of the current scope
+//---------------------------------------------------------------------------------
+#define TEST_ALLOC_BUDGET(maxAllocations, maxBytes) TestAllocBudget TOK(test_alloc_budget_, __LINE__)(maxAllocations, maxBytes, __FILE__ "(" STR(__LINE__) "): Condition [TEST_ALLOC_BUDGET(" STR(maxAllocations) ", " STR(maxBytes) ")] Failed. ")
+#define TEST_NO_ALLOCATIONS() TEST_ALLOC_BUDGET(0, 0)
+
+// Checks on an explicit scope
+#define TEST_ALLOCATIONS_LESS_EQUAL(scope, count) TEST_LESS_EQUAL((scope).Get().allocations, count)
+#define TEST_ALLOCATED_BYTES_LESS_EQUAL(scope, bytes) TEST_LESS_EQUAL((scope).Get().bytes, bytes)
+#define TEST_PEAK_BYTES_LESS_EQUAL(scope, bytes) TEST_LESS_EQUAL((scope).Get().peakLiveBytes, bytes)
+#define TEST_NO_LEAKS(scope) TEST_LESS_EQUAL((scope).Get().liveBytes, 0)
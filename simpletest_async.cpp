@@ -0,0 +1,419 @@
+#include "simpletest_async.h"
+
+#if TEST_COROUTINES
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define TEST_EPOLL 1
+#else
+#include <poll.h>
+#endif
+
+static double locNow() { return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+//---------------------------------------------------------------------------------
+// Frame pool, a free list behind a spin lock since frames are small and quickly
+// claimed. Frames that don't fit or don't find room go to the heap.
+//---------------------------------------------------------------------------------
+static_assert(ASYNC_FRAME_SIZE % alignof(std::max_align_t) == 0, "Frame size must keep frames aligned");
+
+alignas(std::max_align_t) static char locFrames[ASYNC_FRAME_COUNT][ASYNC_FRAME_SIZE];
+static int locNextFrame[ASYNC_FRAME_COUNT];
+static int locFreeFrame = -1;
+static int locNumFramesUsed; // frames handed out at least once, the free list only holds returned ones
+static std::atomic_flag locFrameLock = ATOMIC_FLAG_INIT;
+
+void* TestAsyncFrames::Allocate(size_t size)
+{
+	int frame = -1;
+	if (size <= ASYNC_FRAME_SIZE)
+	{
+		TestFrameworkScope scope;
+		while (locFrameLock.test_and_set(std::memory_order_acquire)) {}
+		if (locFreeFrame >= 0)
+		{
+			frame = locFreeFrame;
+			locFreeFrame = locNextFrame[frame];
+		}
+		else if (locNumFramesUsed < ASYNC_FRAME_COUNT)
+		{
+			frame = locNumFramesUsed++;
+		}
+		locFrameLock.clear(std::memory_order_release);
+	}
+	return frame >= 0 ? locFrames[frame] : ::operator new(size);
+}
+void TestAsyncFrames::Free(void* frame, size_t size)
+{
+	char* pointer = (char*)frame;
+	if (pointer < locFrames[0] || pointer >= locFrames[ASYNC_FRAME_COUNT])
+	{
+		::operator delete(frame, size);
+		return;
+	}
+
+	int index = int((pointer - locFrames[0]) / ASYNC_FRAME_SIZE);
+	TestFrameworkScope scope;
+	while (locFrameLock.test_and_set(std::memory_order_acquire)) {}
+	locNextFrame[index] = locFreeFrame;
+	locFreeFrame = index;
+	locFrameLock.clear(std::memory_order_release);
+}
+
+//---------------------------------------------------------------------------------
+// Event loop, one per thread. Every wait takes a slot, descriptors are dup'd so
+// each wait has a registration of its own that survives the test closing the
+// original. Slots with a timeout sit in a min-heap on their deadline. Waits that
+// complete are collected first and resumed after, so resumed coroutines can
+// start new waits without disturbing the ones still being looked at.
+//---------------------------------------------------------------------------------
+struct TestAsyncSlot
+{
+	std::coroutine_handle<> handle;
+	TestFixture* test;
+	TestAsyncWait* wait;
+	double deadline;
+	int fd;
+	int heapIndex;
+	unsigned generation;
+	int nextFree;
+};
+
+struct TestAsyncLoop
+{
+	TestAsyncLoop() : myPoll(-1), myFree(-1), myNumUsed(0), myNumWaiting(0), myHeapSize(0) {}
+	~TestAsyncLoop()
+	{
+#if TEST_EPOLL
+		if (myPoll >= 0)
+			close(myPoll);
+#endif
+	}
+
+	static TestAsyncLoop& Get()
+	{
+		static thread_local TestAsyncLoop loop;
+#if TEST_EPOLL
+		if (loop.myPoll < 0)
+			loop.myPoll = epoll_create1(EPOLL_CLOEXEC);
+#endif
+		return loop;
+	}
+
+	bool Start(TestAsyncWait& wait, std::coroutine_handle<> handle);
+	bool RunOnce(); // false when nothing is waiting
+
+private:
+	int Claim()
+	{
+		int slot = myFree;
+		if (slot >= 0)
+			myFree = mySlots[slot].nextFree;
+		else if (myNumUsed < ASYNC_MAX_WAITS)
+			mySlots[slot = myNumUsed++].generation = 0;
+		return slot;
+	}
+	void Release(int slot)
+	{
+		TestAsyncSlot& entry = mySlots[slot];
+		if (entry.heapIndex >= 0)
+			HeapRemove(entry.heapIndex);
+		if (entry.fd >= 0)
+		{
+#if TEST_EPOLL
+			epoll_ctl(myPoll, EPOLL_CTL_DEL, entry.fd, nullptr);
+#endif
+			close(entry.fd);
+		}
+		++entry.generation;
+		entry.handle = nullptr;
+		entry.nextFree = myFree;
+		myFree = slot;
+		--myNumWaiting;
+	}
+	void Complete(int slot, bool ready, int& numReady)
+	{
+		TestAsyncSlot& entry = mySlots[slot];
+		entry.wait->myReady = ready;
+		myReady[numReady].handle = entry.handle;
+		myReady[numReady].test = entry.test;
+		++numReady;
+		Release(slot);
+	}
+
+	// min-heap of slots on their deadline
+	void HeapSet(int index, int slot) { myHeap[index] = slot; mySlots[slot].heapIndex = index; }
+	void HeapUp(int index)
+	{
+		int slot = myHeap[index];
+		for (; index > 0 && mySlots[myHeap[(index - 1) / 2]].deadline > mySlots[slot].deadline; index = (index - 1) / 2)
+			HeapSet(index, myHeap[(index - 1) / 2]);
+		HeapSet(index, slot);
+	}
+	void HeapDown(int index)
+	{
+		int slot = myHeap[index];
+		for (;;)
+		{
+			int child = index * 2 + 1;
+			if (child >= myHeapSize)
+				break;
+			if (child + 1 < myHeapSize && mySlots[myHeap[child + 1]].deadline < mySlots[myHeap[child]].deadline)
+				++child;
+			if (!(mySlots[myHeap[child]].deadline < mySlots[slot].deadline))
+				break;
+			HeapSet(index, myHeap[child]);
+			index = child;
+		}
+		HeapSet(index, slot);
+	}
+	void HeapRemove(int index)
+	{
+		mySlots[myHeap[index]].heapIndex = -1;
+		if (--myHeapSize == index)
+			return;
+		HeapSet(index, myHeap[myHeapSize]);
+		HeapUp(index);
+		HeapDown(mySlots[myHeap[index]].heapIndex);
+	}
+
+	struct Ready
+	{
+		std::coroutine_handle<> handle;
+		TestFixture* test;
+	};
+
+	int myPoll;
+	int myFree;
+	int myNumUsed;
+	int myNumWaiting;
+	int myHeapSize;
+	TestAsyncSlot mySlots[ASYNC_MAX_WAITS];
+	int myHeap[ASYNC_MAX_WAITS];
+	Ready myReady[ASYNC_MAX_WAITS];
+#if TEST_EPOLL
+	epoll_event myEvents[ASYNC_MAX_WAITS];
+#else
+	pollfd myPollFds[ASYNC_MAX_WAITS];
+	int myPollSlots[ASYNC_MAX_WAITS];
+#endif
+};
+
+bool TestAsyncLoop::Start(TestAsyncWait& wait, std::coroutine_handle<> handle)
+{
+	TestFixture* test = TestFixture::GetCurrentTest();
+	int slot = Claim();
+	if (slot < 0)
+	{
+		if (test)
+		{
+			test->AddError();
+			test->LogMessage("More than %d waits at once, raise ASYNC_MAX_WAITS", ASYNC_MAX_WAITS);
+		}
+		return false;
+	}
+
+	TestAsyncSlot& entry = mySlots[slot];
+	entry.handle = handle;
+	entry.test = test;
+	entry.wait = &wait;
+	entry.fd = -1;
+	entry.heapIndex = -1;
+	++myNumWaiting;
+
+	if (wait.myEvents != TestAsyncTimer)
+	{
+		// regular files can't be waited on and are always ready
+		int error = 0;
+#if TEST_EPOLL
+		if (myPoll < 0)
+			error = EBADF;
+		if (error == 0 && (entry.fd = fcntl(wait.myFd, F_DUPFD_CLOEXEC, 0)) < 0)
+			error = errno;
+		if (error == 0)
+		{
+			epoll_event event = {};
+			event.events = (wait.myEvents & TestAsyncRead ? EPOLLIN : 0u) | (wait.myEvents & TestAsyncWrite ? EPOLLOUT : 0u) | EPOLLONESHOT;
+			event.data.u64 = (unsigned long long)entry.generation << 32 | unsigned(slot);
+			if (epoll_ctl(myPoll, EPOLL_CTL_ADD, entry.fd, &event) < 0)
+			{
+				error = errno;
+				close(entry.fd);
+				entry.fd = -1;
+			}
+		}
+#else
+		if ((entry.fd = fcntl(wait.myFd, F_DUPFD_CLOEXEC, 0)) < 0)
+			error = errno;
+#endif
+		if (error)
+		{
+			Release(slot);
+			wait.myReady = error == EPERM;
+			if (error != EPERM && test)
+			{
+				test->AddError();
+				test->LogMessage("Can't wait on descriptor %d, error %d", wait.myFd, error);
+			}
+			return false;
+		}
+	}
+
+	if (wait.myTimeout >= 0)
+	{
+		entry.deadline = locNow() + wait.myTimeout;
+		myHeap[myHeapSize] = slot;
+		HeapUp(myHeapSize++);
+	}
+	return true;
+}
+
+bool TestAsyncLoop::RunOnce()
+{
+	if (myNumWaiting == 0)
+		return false;
+
+	// sleep until the nearest deadline, rounding up so timers never fire early
+	int timeout = -1;
+	if (myHeapSize)
+	{
+		double wait = (mySlots[myHeap[0]].deadline - locNow()) * 1000;
+		timeout = wait <= 0 ? 0 : wait >= INT_MAX ? INT_MAX : int(wait) + 1;
+	}
+
+	int numReady = 0;
+#if TEST_EPOLL
+	int numEvents = epoll_wait(myPoll, myEvents, ASYNC_MAX_WAITS, timeout);
+	for (int i = 0; i < numEvents; ++i)
+	{
+		int slot = int(myEvents[i].data.u64 & 0xffffffffu);
+		if (unsigned(myEvents[i].data.u64 >> 32) == mySlots[slot].generation)
+			Complete(slot, true, numReady);
+	}
+#else
+	int numFds = 0;
+	for (int slot = 0; slot < myNumUsed; ++slot)
+	{
+		TestAsyncSlot const& entry = mySlots[slot];
+		if (entry.handle && entry.fd >= 0)
+		{
+			myPollFds[numFds].fd = entry.fd;
+			myPollFds[numFds].events = short((entry.wait->myEvents & TestAsyncRead ? POLLIN : 0) | (entry.wait->myEvents & TestAsyncWrite ? POLLOUT : 0));
+			myPollFds[numFds].revents = 0;
+			myPollSlots[numFds++] = slot;
+		}
+	}
+	int numEvents = poll(myPollFds, nfds_t(numFds), timeout);
+	for (int i = 0; i < numFds && numEvents > 0; ++i)
+	{
+		if (myPollFds[i].revents)
+			Complete(myPollSlots[i], true, numReady);
+	}
+#endif
+
+	double now = locNow();
+	while (myHeapSize && mySlots[myHeap[0]].deadline <= now)
+		Complete(myHeap[0], false, numReady);
+
+	for (int i = 0; i < numReady; ++i)
+		TestAsyncFixture::Resume(myReady[i].test, myReady[i].handle);
+	return true;
+}
+
+bool TestAsyncWait::await_suspend(std::coroutine_handle<> handle)
+{
+	return TestAsyncLoop::Get().Start(*this, handle);
+}
+
+//---------------------------------------------------------------------------------
+// Fixture
+//---------------------------------------------------------------------------------
+void TestAsyncFixture::Resume(TestFixture* test, std::coroutine_handle<> handle)
+{
+	TestFixture* lastCurrent = ourCurrentTest;
+	ourCurrentTest = test;
+	handle.resume();
+	ourCurrentTest = lastCurrent;
+}
+
+void TestAsyncFixture::RunUntilDone(TestTask const& task)
+{
+	while (!task.Done())
+	{
+		if (!TestAsyncLoop::Get().RunOnce())
+		{
+			AddError();
+			LogMessage("Suspended without waiting on a timer or descriptor, the test never finished");
+			return;
+		}
+	}
+}
+
+void TestAsyncFixture::RunAlone(TestTask task)
+{
+	Resume(this, task.GetHandle());
+	RunUntilDone(task);
+}
+
+// other tests run while a phase is suspended, so hooks are told it's overlapped
+static void locBeginPhase(TestFixture& test, TestPhase phase)
+{
+	for (TestHook* i = TestHook::ourFirst; i; i = i->myNext)
+		i->BeginOverlappedPhase(test, phase);
+}
+static void locEndPhase(TestFixture& test, TestPhase phase)
+{
+	for (TestHook* i = TestHook::ourFirst; i; i = i->myNext)
+		i->EndOverlappedPhase(test, phase);
+}
+
+TestTask TestAsyncFixture::Execute()
+{
+	locBeginPhase(*this, TestPhaseSetup);
+	co_await SetupAsync();
+	locEndPhase(*this, TestPhaseSetup);
+	locBeginPhase(*this, TestPhaseRunTest);
+	co_await RunTestAsync();
+	locEndPhase(*this, TestPhaseRunTest);
+	locBeginPhase(*this, TestPhaseTearDown);
+	co_await TearDownAsync();
+	locEndPhase(*this, TestPhaseTearDown);
+
+	// ended in order, so the duration has to be taken as soon as the test is done
+	myDuration = locNow() - myStart;
+}
+
+bool TestAsyncFixture::BeginExecuteTest()
+{
+	// sampled runs measure every test on its own
+	if (ourNumSamples > 1)
+		return false;
+
+	myNumTestsChecked = myNumErrors = 0;
+	ReleaseErrors();
+	myNumSamples = 1;
+	myDurationStddev = 0;
+	myStart = locNow();
+
+	myExecution = Execute();
+	Resume(this, myExecution.GetHandle());
+	return true;
+}
+
+bool TestAsyncFixture::EndExecuteTest()
+{
+	RunUntilDone(myExecution);
+	if (!myExecution.Done())
+		myDuration = locNow() - myStart;
+	myExecution = TestTask();
+
+	CheckBudget();
+	return myNumErrors == 0;
+}
+#endif
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "simpletest.h"
+
+//---------------------------------------------------------------------------------
+// Optional coroutine tests, C++20 on unix. The body of a DEFINE_ASYNC_TEST is a
+// coroutine that can co_await timers and file descriptors becoming readable or
+// writable. A test that's waiting doesn't hold up anything, every async test of
+// a run is in flight at once on the calling thread, driven by one event loop
+// (epoll on Linux, poll elsewhere). The current test is switched on every
+// resume so TEST macros check into whichever test is running. Frames come from
+// a fixed pool so starting hundreds of tests doesn't allocate.
+//---------------------------------------------------------------------------------
+#if defined(__cpp_impl_coroutine) && (defined(__unix__) || defined(__APPLE__))
+#define TEST_COROUTINES 1
+#endif
+
+#if !defined(ASYNC_FRAME_SIZE)
+#define ASYNC_FRAME_SIZE 1024 // coroutine frames up to this size come from the pool, bigger ones from the heap
+#endif
+#if !defined(ASYNC_FRAME_COUNT)
+#define ASYNC_FRAME_COUNT 256 // frames in the pool, shared by every thread
+#endif
+#if !defined(ASYNC_MAX_WAITS)
+#define ASYNC_MAX_WAITS 1024 // most timers and descriptors one thread's loop waits on at once
+#endif
+
+#if TEST_COROUTINES
+#include <coroutine>
+#include <exception>
+
+//---------------------------------------------------------------------------------
+// Coroutine frames, pooled while there's room
+//---------------------------------------------------------------------------------
+struct TestAsyncFrames
+{
+	static void* Allocate(size_t size);
+	static void Free(void* frame, size_t size);
+};
+
+//---------------------------------------------------------------------------------
+// A coroutine returning nothing. It starts when it's awaited and the awaiting
+// coroutine carries on as soon as it's done, so helpers can be split out of
+// test bodies and awaited like any other wait.
+//---------------------------------------------------------------------------------
+struct TestTask
+{
+	struct promise_type;
+	typedef std::coroutine_handle<promise_type> Handle;
+
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(Handle handle) noexcept
+		{
+			std::coroutine_handle<> continuation = handle.promise().myContinuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	struct promise_type
+	{
+		TestTask get_return_object() { return TestTask(Handle::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		FinalAwaiter final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+
+		static void* operator new(size_t size) { return TestAsyncFrames::Allocate(size); }
+		static void operator delete(void* frame, size_t size) { TestAsyncFrames::Free(frame, size); }
+
+		std::coroutine_handle<> myContinuation;
+	};
+
+	TestTask() : myHandle(nullptr) {}
+	explicit TestTask(Handle handle) : myHandle(handle) {}
+	TestTask(TestTask&& other) noexcept : myHandle(other.myHandle) { other.myHandle = nullptr; }
+	TestTask& operator=(TestTask&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (myHandle)
+				myHandle.destroy();
+			myHandle = other.myHandle;
+			other.myHandle = nullptr;
+		}
+		return *this;
+	}
+	~TestTask() { if (myHandle) myHandle.destroy(); }
+
+	TestTask(TestTask const&) = delete;
+	TestTask& operator=(TestTask const&) = delete;
+
+	bool Done() const { return !myHandle || myHandle.done(); }
+	Handle GetHandle() const { return myHandle; }
+
+	bool await_ready() const { return Done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+	{
+		myHandle.promise().myContinuation = awaiting;
+		return myHandle;
+	}
+	void await_resume() {}
+
+private:
+	Handle myHandle;
+};
+
+//---------------------------------------------------------------------------------
+// Waits on the calling thread's loop. co_await gives true once the descriptor
+// is ready and false when the timeout passed first, sleeps always give false.
+// Negative timeouts wait for as long as it takes. Timers have millisecond
+// resolution and a sleep of 0 lets every other ready test run first.
+//---------------------------------------------------------------------------------
+enum TestAsyncEvents
+{
+	TestAsyncTimer = 0,
+	TestAsyncRead = 1,
+	TestAsyncWrite = 2,
+};
+
+struct TestAsyncWait
+{
+	TestAsyncWait(int fd, TestAsyncEvents events, double timeout) : myFd(fd), myEvents(events), myTimeout(timeout), myReady(false) {}
+
+	bool await_ready() const { return false; }
+	bool await_suspend(std::coroutine_handle<> handle); // false resumes straight away when the wait can't be started
+	bool await_resume() const { return myReady; }
+
+	int myFd;
+	TestAsyncEvents myEvents;
+	double myTimeout;
+	bool myReady;
+};
+
+inline TestAsyncWait TestSleep(double seconds) { return TestAsyncWait(-1, TestAsyncTimer, seconds > 0 ? seconds : 0); }
+inline TestAsyncWait TestReadable(int fd, double timeout = -1) { return TestAsyncWait(fd, TestAsyncRead, timeout); }
+inline TestAsyncWait TestWritable(int fd, double timeout = -1) { return TestAsyncWait(fd, TestAsyncWrite, timeout); }
+
+//---------------------------------------------------------------------------------
+// Fixture for coroutine tests, derive from it to share async Setup and TearDown.
+// Runners begin every async test up front and end them in order. Run on their
+// own, i.e. when sampling for baselines, each test has the loop to itself.
+//---------------------------------------------------------------------------------
+class TestAsyncFixture : public TestFixture
+{
+public:
+	bool BeginExecuteTest() override;
+	bool EndExecuteTest() override;
+
+	// Resume a coroutine with test as the current test, for the loop
+	static void Resume(TestFixture* test, std::coroutine_handle<> handle);
+
+protected:
+	virtual TestTask SetupAsync() { co_return; }
+	virtual TestTask RunTestAsync() = 0;
+	virtual TestTask TearDownAsync() { co_return; }
+
+	// ExecuteTest runs each phase to completion before the next one
+	void Setup() final { RunAlone(SetupAsync()); }
+	void RunTest() final { RunAlone(RunTestAsync()); }
+	void TearDown() final { RunAlone(TearDownAsync()); }
+
+private:
+	void RunAlone(TestTask task);
+	void RunUntilDone(TestTask const& task);
+	TestTask Execute();
+
+	TestTask myExecution;
+	double myStart;
+};
+
+//---------------------------------------------------------------------------------
+// Async test definition macros, the body is a coroutine, i.e.
+// DEFINE_ASYNC_TEST_G(Echo, Socket) { ... co_await TestReadable(fd, 1.0) ... }
+//---------------------------------------------------------------------------------
+#define DEFINE_ASYNC_TEST_FULL(name, group, fixture) \
+struct TOK(group, name) final : public fixture { \
+	char const* TestName() const override { return #name; } \
+	char const* TestGroup() const override { return #group; } \
+	TestTask RunTestAsync() override; \
+} TOK(TOK(group, name), Instance); \
+TestTask TOK(group, name)::RunTestAsync()
+
+#define DEFINE_ASYNC_TEST(name) DEFINE_ASYNC_TEST_FULL(name, Global, TestAsyncFixture)
+#define DEFINE_ASYNC_TEST_G(name, group) DEFINE_ASYNC_TEST_FULL(name, group, TestAsyncFixture)
+#define DEFINE_ASYNC_TEST_F(name, fixture) DEFINE_ASYNC_TEST_FULL(name, Global, fixture)
+#define DEFINE_ASYNC_TEST_GF(name, group, fixture) DEFINE_ASYNC_TEST_FULL(name, group, fixture)
+
+#endif
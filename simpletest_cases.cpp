@@ -0,0 +1,158 @@
+#include "simpletest_cases.h"
+#include <string.h>
+#include <thread>
+
+static std::atomic<int> locThreads;
+static std::atomic<unsigned long long> locSeed;
+
+void TestCases::SetThreads(int threads) { locThreads.store(threads); }
+int TestCases::GetThreads() { return locThreads.load(); }
+void TestCases::SetSeed(unsigned long long seed) { locSeed.store(seed); }
+unsigned long long TestCases::GetSeed() { return locSeed.load(); }
+
+//---------------------------------------------------------------------------------
+// Every case checks into a fixture standing in for the test. Each thread reuses
+// one fixture while its cases pass and sets it aside when one fails, until it
+// has CASES_LOGGED of them. Threads claim cases in increasing order, so their
+// first failures are their lowest ones and the lowest of all of them are
+// always among the fixtures that were set aside.
+//---------------------------------------------------------------------------------
+struct TestCaseThread
+{
+	alignas(TestStandIn) char storage[CASES_LOGGED + 1][sizeof(TestStandIn)];
+	TestStandIn* fixtures[CASES_LOGGED + 1];
+	unsigned long long indices[CASES_LOGGED + 1]; // case each fixture was set aside for, ~0 once it's logged
+	int numKept;
+	unsigned long long numFailed;
+};
+
+unsigned long long TestCases::Run(TestFixture& test, unsigned long long count, void const* generator, RunFunction run, DescribeFunction describe)
+{
+	if (count == 0)
+	{
+		test.LogMessage("The generator has no cases");
+		return 0;
+	}
+
+	// by default cases get the hardware threads the runner isn't already using for tests of its own
+	int numThreads = GetThreads() > 0 ? GetThreads() : (int)std::thread::hardware_concurrency() / TestFixture::GetConcurrency();
+	numThreads = numThreads < 1 ? 1 : numThreads > CASES_MAX_THREADS ? CASES_MAX_THREADS : numThreads;
+	if ((unsigned long long)numThreads > count)
+		numThreads = int(count);
+
+	// chunks are small enough to even out slow cases, and big enough that claiming them is rare
+	unsigned long long chunk = count / ((unsigned long long)numThreads * 64);
+	chunk = chunk < 1 ? 1 : chunk > 4096 ? 4096 : chunk;
+
+	TestCaseThread threads[CASES_MAX_THREADS];
+	std::atomic<unsigned long long> next(0);
+	auto work = [&](int index)
+	{
+		TestCaseThread& thread = threads[index];
+		thread.numKept = 0;
+		thread.numFailed = 0;
+		for (int i = 0; i <= CASES_LOGGED; ++i)
+			thread.fixtures[i] = TestStandIn::Construct(thread.storage[i], test);
+
+		for (;;)
+		{
+			unsigned long long begin = next.fetch_add(chunk, std::memory_order_relaxed);
+			if (begin >= count)
+				break;
+
+			unsigned long long end = count - begin < chunk ? count : begin + chunk;
+			for (unsigned long long i = begin; i < end; ++i)
+			{
+				TestStandIn& fixture = *thread.fixtures[thread.numKept];
+				if (!fixture.Run([&] { run(test, generator, i); }))
+				{
+					fixture.Reset();
+					continue;
+				}
+
+				++thread.numFailed;
+				thread.indices[thread.numKept] = i;
+				if (thread.numKept < CASES_LOGGED)
+					++thread.numKept;
+				else
+					fixture.Reset();
+			}
+		}
+	};
+
+	std::thread workers[CASES_MAX_THREADS];
+	for (int i = 1; i < numThreads; ++i)
+		workers[i] = std::thread(work, i);
+	work(0);
+	for (int i = 1; i < numThreads; ++i)
+		workers[i].join();
+
+	// log the lowest failing cases in order, everything else is only counted
+	unsigned long long numFailed = 0;
+	for (int i = 0; i < numThreads; ++i)
+		numFailed += threads[i].numFailed;
+
+	unsigned long long lowest = count;
+	for (int logged = 0; logged < CASES_LOGGED; ++logged)
+	{
+		TestCaseThread* owner = nullptr;
+		int kept = 0;
+		for (int i = 0; i < numThreads; ++i)
+		{
+			for (int k = 0; k < threads[i].numKept; ++k)
+			{
+				if (threads[i].indices[k] != ~0ull && (owner == nullptr || threads[i].indices[k] < owner->indices[kept]))
+				{
+					owner = &threads[i];
+					kept = k;
+				}
+			}
+		}
+		if (owner == nullptr)
+			break;
+
+		TestStandIn& fixture = *owner->fixtures[kept];
+		unsigned long long index = owner->indices[kept];
+		char header[256];
+		TempString value = describe(generator, index);
+		if ((*value)[0])
+			snprintf(header, sizeof(header), "Case %llu of %llu failed %d of %d checks with %s:", index, count, fixture.NumErrors(), fixture.NumTests(), *value);
+		else
+			snprintf(header, sizeof(header), "Case %llu of %llu failed %d of %d checks:", index, count, fixture.NumErrors(), fixture.NumTests());
+		fixture.Log(header);
+		fixture.Reset();
+
+		lowest = lowest < index ? lowest : index;
+		owner->indices[kept] = ~0ull;
+	}
+
+	if (numFailed)
+		test.LogMessage("%llu of %llu cases failed on %d threads, seed %llu", numFailed, count, numThreads, GetSeed());
+	else if (test.ShouldLogInfo())
+		test.LogMessage("%llu cases passed on %d threads", count, numThreads);
+
+	// every message worth keeping is logged by now, so adopting only adds up the counts
+	for (int i = 0; i < numThreads; ++i)
+	{
+		for (int k = 0; k <= CASES_LOGGED; ++k)
+		{
+			threads[i].fixtures[k]->Reset();
+			threads[i].fixtures[k]->Adopt();
+			threads[i].fixtures[k]->~TestStandIn();
+		}
+	}
+	return lowest;
+}
+
+bool TestCases::Fails(TestFixture& test, void (*run)(TestFixture& test, void const* value), void const* value, char const* logHeader)
+{
+	alignas(TestStandIn) char storage[sizeof(TestStandIn)];
+	TestStandIn& fixture = *TestStandIn::Construct(storage, test);
+	bool failed = fixture.Run([&] { run(test, value); });
+
+	if (logHeader)
+		fixture.Log(logHeader);
+
+	fixture.~TestStandIn();
+	return failed;
+}
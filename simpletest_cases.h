@@ -0,0 +1,348 @@
+#pragma once
+
+#include "simpletest.h"
+#include <stdio.h>
+
+//---------------------------------------------------------------------------------
+// Optional parameterized and property based tests. The body of a DEFINE_CASES
+// test runs once for every value of a generator, each case checking into a
+// fixture of its own so it passes or fails on its own. Generators compute any
+// case straight from its index, so cases are claimed in chunks by as many
+// threads as there are cores without allocating or sharing anything. The
+// lowest failing cases are logged along with their values and random cases
+// are shrunk to the smallest value that still fails.
+//---------------------------------------------------------------------------------
+#if !defined(CASES_MAX_THREADS)
+#define CASES_MAX_THREADS 64 // most threads the cases of a test are spread over
+#endif
+#if !defined(CASES_LOGGED)
+#define CASES_LOGGED 4 // failing cases whose messages are logged, the rest are only counted
+#endif
+#if !defined(CASES_SHRINK_STEPS)
+#define CASES_SHRINK_STEPS 1000 // most candidates a failing case is run with while shrinking it
+#endif
+
+static_assert(CASES_MAX_THREADS >= 1 && CASES_LOGGED >= 1, "Cases need at least one thread and one logged failure");
+
+//---------------------------------------------------------------------------------
+// Counter based random numbers. Bits are a pure function of the seed and index
+// (SplitMix64), so any case can be generated on any thread in any order. A
+// stream hands out a sequence of them for building more complicated inputs.
+//---------------------------------------------------------------------------------
+struct TestRandomStream
+{
+	TestRandomStream(unsigned long long seed, unsigned long long index) : mySeed(Bits(seed, index)), myCounter(0) {}
+
+	static unsigned long long Bits(unsigned long long seed, unsigned long long index)
+	{
+		unsigned long long z = seed + (index + 1) * 0x9e3779b97f4a7c15ull;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	unsigned long long Next() { return Bits(mySeed, myCounter++); }
+
+	// Uniform in [0, bound), bound 0 gives the full 64 bits
+	unsigned long long Below(unsigned long long bound)
+	{
+		if (bound == 0)
+			return Next();
+
+		// high half of a 64x64 bit multiply, Lemire's method without the 128 bit type
+		unsigned long long x = Next();
+		unsigned long long lo = (x & 0xffffffffull) * (bound & 0xffffffffull);
+		unsigned long long mid1 = (x >> 32) * (bound & 0xffffffffull);
+		unsigned long long mid2 = (x & 0xffffffffull) * (bound >> 32);
+		unsigned long long carry = ((lo >> 32) + (mid1 & 0xffffffffull) + (mid2 & 0xffffffffull)) >> 32;
+		return (x >> 32) * (bound >> 32) + (mid1 >> 32) + (mid2 >> 32) + carry;
+	}
+
+	// Uniform in [0, 1)
+	double Real() { return double(Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+	unsigned long long mySeed;
+	unsigned long long myCounter;
+};
+
+//---------------------------------------------------------------------------------
+// Running cases, used by DEFINE_CASES. Settings are global and apply to every
+// parameterized test, set them before running tests.
+//---------------------------------------------------------------------------------
+struct TestCases
+{
+	// Threads cases are spread over, 0 splits the hardware threads between the tests the runner has in flight at once
+	static void SetThreads(int threads);
+	static int GetThreads();
+
+	// Mixed into every random generator, change it to explore new cases. It's logged with failures so they can be reproduced.
+	static void SetSeed(unsigned long long seed);
+	static unsigned long long GetSeed();
+
+	typedef void (*RunFunction)(TestFixture& test, void const* generator, unsigned long long index);
+	typedef TempString (*DescribeFunction)(void const* generator, unsigned long long index);
+
+	// Run every case and log the lowest failing ones, returns the lowest failing index or count when they all pass
+	static unsigned long long Run(TestFixture& test, unsigned long long count, void const* generator, RunFunction run, DescribeFunction describe);
+
+	// Run a single value into a fixture of its own, its messages are only logged to the test after the header when there is one
+	static bool Fails(TestFixture& test, void (*run)(TestFixture& test, void const* value), void const* value, char const* logHeader);
+};
+
+template <typename T>
+TempString TestDescribeValue(T const& value) { return TypeToString(value); }
+
+//---------------------------------------------------------------------------------
+// Generators. Count is the number of cases, operator() returns the value of a
+// case and Shrink offers smaller values than a failing one, the attempt'th
+// candidate for each attempt until it returns false. The biggest jumps are
+// offered first so shrinking is quick.
+//---------------------------------------------------------------------------------
+
+// Every step from first to last, inclusive. They all run so the first failure is already the smallest.
+template <typename T>
+struct TestCaseRange
+{
+	typedef T Value;
+
+	TestCaseRange(T first, T last, T step) : myFirst(first), myLast(last), myStep(step) {}
+
+	unsigned long long Count() const { return myStep > T(0) && !(myLast < myFirst) ? (unsigned long long)((myLast - myFirst) / myStep) + 1 : 0; }
+	T operator()(unsigned long long index) const { return T(myFirst + T(index) * myStep); }
+	bool Shrink(T const&, int, T&) const { return false; }
+
+	T myFirst;
+	T myLast;
+	T myStep;
+};
+
+// Every entry of a table, which has to outlive the test
+template <typename T>
+struct TestCaseTable
+{
+	typedef T Value;
+
+	TestCaseTable(T const* table, size_t count) : myTable(table), myCount(count) {}
+
+	unsigned long long Count() const { return myCount; }
+	T const& operator()(unsigned long long index) const { return myTable[index]; }
+	bool Shrink(T const&, int, T&) const { return false; }
+
+	T const* myTable;
+	size_t myCount;
+};
+
+// Uniformly random integers or reals in [low, high], shrinking towards whichever value in range is closest to zero
+template <typename T, bool Integral = std::is_integral<T>::value>
+struct TestCaseRandom
+{
+	typedef T Value;
+
+	TestCaseRandom(T low, T high, unsigned long long count, unsigned long long seed) : myLow(low), myHigh(high), myCount(count), mySeed(seed) {}
+
+	unsigned long long Count() const { return myCount; }
+	T operator()(unsigned long long index) const
+	{
+		// unsigned so the full range of any type works, a range of 2^64 wraps to 0 which gives all the bits
+		TestRandomStream random(mySeed, index);
+		return T((unsigned long long)myLow + random.Below((unsigned long long)myHigh - (unsigned long long)myLow + 1));
+	}
+	bool Shrink(T const& value, int attempt, T& smaller) const
+	{
+		// the target, then moving a half, a quarter and so on of the way there
+		T target = myLow > T(0) ? myLow : myHigh < T(0) ? myHigh : T(0);
+		bool above = value > target;
+		unsigned long long distance = above ? (unsigned long long)value - (unsigned long long)target : (unsigned long long)target - (unsigned long long)value;
+		unsigned long long move = attempt < 64 ? distance >> attempt : 0;
+		if (move == 0)
+			return false;
+		smaller = T(above ? (unsigned long long)value - move : (unsigned long long)value + move);
+		return true;
+	}
+
+	T myLow;
+	T myHigh;
+	unsigned long long myCount;
+	unsigned long long mySeed;
+};
+
+template <typename T>
+struct TestCaseRandom<T, false>
+{
+	typedef T Value;
+
+	TestCaseRandom(T low, T high, unsigned long long count, unsigned long long seed) : myLow(low), myHigh(high), myCount(count), mySeed(seed) {}
+
+	unsigned long long Count() const { return myCount; }
+	T operator()(unsigned long long index) const
+	{
+		TestRandomStream random(mySeed, index);
+		T value = T(myLow + (myHigh - myLow) * T(random.Real()));
+		return value < myHigh ? value : myHigh;
+	}
+	bool Shrink(T const& value, int attempt, T& smaller) const
+	{
+		// the target, then moving a half, a quarter and so on of the way there for as long as that changes anything
+		T target = myLow > T(0) ? myLow : myHigh < T(0) ? myHigh : T(0);
+		if (attempt >= 64)
+			return false;
+		T scale = T(1);
+		for (int i = 0; i < attempt; ++i)
+			scale = scale / T(2);
+		smaller = T(value - (value - target) * scale);
+		return smaller != value;
+	}
+
+	T myLow;
+	T myHigh;
+	unsigned long long myCount;
+	unsigned long long mySeed;
+};
+
+// A stream of random numbers per case, for building inputs out of several values
+struct TestCaseStreams
+{
+	typedef TestRandomStream Value;
+
+	TestCaseStreams(unsigned long long count, unsigned long long seed) : myCount(count), mySeed(seed) {}
+
+	unsigned long long Count() const { return myCount; }
+	TestRandomStream operator()(unsigned long long index) const { return TestRandomStream(mySeed, index); }
+	bool Shrink(TestRandomStream const&, int, TestRandomStream&) const { return false; }
+
+	unsigned long long myCount;
+	unsigned long long mySeed;
+};
+
+// Pairs of two generators, the last one changing fastest. Either half shrinks on its own.
+template <typename A, typename B>
+struct TestCasePair
+{
+	A first;
+	B second;
+};
+
+template <typename A, typename B>
+TempString TestDescribeValue(TestCasePair<A, B> const& value)
+{
+	TempString first = TestDescribeValue(value.first);
+	TempString second = TestDescribeValue(value.second);
+	TempString pair;
+	snprintf(pair.myTextBuffer, sizeof(pair.myTextBuffer), "(%s, %s)", (*first)[0] ? *first : "?", (*second)[0] ? *second : "?");
+	return pair;
+}
+
+template <typename A, typename B>
+struct TestCaseProduct
+{
+	typedef TestCasePair<typename A::Value, typename B::Value> Value;
+
+	TestCaseProduct(A const& a, B const& b) : myA(a), myB(b) {}
+
+	unsigned long long Count() const { return myA.Count() * myB.Count(); }
+	Value operator()(unsigned long long index) const
+	{
+		unsigned long long count = myB.Count();
+		Value value = { myA(index / count), myB(index % count) };
+		return value;
+	}
+	bool Shrink(Value const& value, int attempt, Value& smaller) const
+	{
+		smaller = value;
+		int firstAttempts = 0;
+		for (typename A::Value candidate = value.first; myA.Shrink(value.first, firstAttempts, candidate); ++firstAttempts)
+		{
+			if (firstAttempts == attempt)
+			{
+				smaller.first = candidate;
+				return true;
+			}
+		}
+		return myB.Shrink(value.second, attempt - firstAttempts, smaller.second);
+	}
+
+	A myA;
+	B myB;
+};
+
+//---------------------------------------------------------------------------------
+// Generator shorthands, i.e. TestRange(0, 255), TestTable(cases), TestRandom(-1e6, 1e6, 100000)
+//---------------------------------------------------------------------------------
+template <typename T>
+TestCaseRange<T> TestRange(T first, T last, T step = T(1)) { return TestCaseRange<T>(first, last, step); }
+
+template <typename T, size_t N>
+TestCaseTable<T> TestTable(T const (&table)[N]) { return TestCaseTable<T>(table, N); }
+
+template <typename T>
+TestCaseRandom<T> TestRandom(T low, T high, unsigned long long count, unsigned long long seed = 0) { return TestCaseRandom<T>(low, high, count, seed ^ TestCases::GetSeed()); }
+
+inline TestCaseStreams TestRandomStreams(unsigned long long count, unsigned long long seed = 0) { return TestCaseStreams(count, seed ^ TestCases::GetSeed()); }
+
+template <typename A, typename B>
+TestCaseProduct<A, B> TestProduct(A const& a, B const& b) { return TestCaseProduct<A, B>(a, b); }
+
+//---------------------------------------------------------------------------------
+// Runs every case of a test, then shrinks the lowest failing one
+//---------------------------------------------------------------------------------
+template <typename Test, typename Generator>
+void TestRunCases(Test& test, Generator const& generator)
+{
+	typedef typename Generator::Value Value;
+	struct Erased
+	{
+		static void Run(TestFixture& fixture, void const* cases, unsigned long long index) { static_cast<Test&>(fixture).RunCase((*(Generator const*)cases)(index)); }
+		static void RunValue(TestFixture& fixture, void const* value) { static_cast<Test&>(fixture).RunCase(*(Value const*)value); }
+		static TempString Describe(void const* cases, unsigned long long index) { return TestDescribeValue((*(Generator const*)cases)(index)); }
+	};
+
+	unsigned long long count = generator.Count();
+	unsigned long long failed = TestCases::Run(test, count, &generator, &Erased::Run, &Erased::Describe);
+	if (failed >= count)
+		return;
+
+	// keep taking the first smaller candidate that still fails until none of them do
+	Value smallest = generator(failed);
+	Value candidate = smallest;
+	int steps = 0;
+	int shrunk = 0;
+	for (int attempt = 0; steps < CASES_SHRINK_STEPS && generator.Shrink(smallest, attempt, candidate); ++attempt)
+	{
+		++steps;
+		if (TestCases::Fails(test, &Erased::RunValue, &candidate, nullptr))
+		{
+			smallest = candidate;
+			++shrunk;
+			attempt = -1;
+		}
+	}
+	if (shrunk == 0)
+		return;
+
+	char header[256];
+	TempString value = TestDescribeValue(smallest);
+	snprintf(header, sizeof(header), "Case %llu shrank to %s after %d of %d candidates failed:", failed, (*value)[0] ? *value : "a smaller value", shrunk, steps);
+	TestCases::Fails(test, &Erased::RunValue, &smallest, header);
+}
+
+//---------------------------------------------------------------------------------
+// Parameterized test definition macros. The body runs once for every case with
+// the case in value, i.e.
+// DEFINE_CASES_G(RoundTrip, Utf8, TestRange(0, 0x10ffff)) { ... Encode(value) ... }
+// Cases run on several threads at once sharing the one fixture, so keep anything
+// a case changes local to the body. TEST macros check into the case.
+//---------------------------------------------------------------------------------
+#define DEFINE_CASES_FULL(name, group, fixture, generator) \
+struct TOK(group, name) final : public fixture { \
+	typedef decltype(generator) Generator; \
+	char const* TestName() const override { return #name; } \
+	char const* TestGroup() const override { return #group; } \
+	void RunTest() override { TestRunCases(*this, generator); } \
+	void RunCase(Generator::Value const& value); \
+} TOK(TOK(group, name), Instance); \
+void TOK(group, name)::RunCase(TOK(group, name)::Generator::Value const& value TEST_UNUSED_)
+
+#define DEFINE_CASES(name, generator) DEFINE_CASES_FULL(name, Global, BASE_FIXTURE, generator)
+#define DEFINE_CASES_G(name, group, generator) DEFINE_CASES_FULL(name, group, BASE_FIXTURE, generator)
+#define DEFINE_CASES_F(name, fixture, generator) DEFINE_CASES_FULL(name, Global, fixture, generator)
+#define DEFINE_CASES_GF(name, group, fixture, generator) DEFINE_CASES_FULL(name, group, fixture, generator)
@@ -0,0 +1,581 @@
+#include "simpletest_fuzz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#if defined(_WIN32)
+#if !defined(WIN32_LEAN_AND_MEAN)
+#define WIN32_LEAN_AND_MEAN
+#endif
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__clang__)
+#define FUZZ_NO_COVERAGE __attribute__((no_sanitize("coverage")))
+#elif defined(__has_attribute)
+#if __has_attribute(no_sanitize_coverage)
+#define FUZZ_NO_COVERAGE __attribute__((no_sanitize_coverage))
+#endif
+#endif
+#if !defined(FUZZ_NO_COVERAGE)
+#define FUZZ_NO_COVERAGE
+#endif
+
+static unsigned long long locRuns;
+static double locSeconds;
+static char const* locCorpus = FUZZ_CORPUS_DIR;
+static unsigned long long locSeed = 1;
+
+void TestFuzz::SetFuzzing(unsigned long long runs, double seconds) { locRuns = runs; locSeconds = seconds; }
+bool TestFuzz::IsFuzzing() { return locRuns > 0 || locSeconds > 0; }
+void TestFuzz::SetCorpus(char const* directory) { locCorpus = directory; }
+char const* TestFuzz::GetCorpus() { return locCorpus; }
+void TestFuzz::SetSeed(unsigned long long seed) { locSeed = seed; }
+unsigned long long TestFuzz::GetSeed() { return locSeed; }
+
+TestFuzzTarget* TestFuzzTarget::ourFirst;
+
+TestFuzzTarget::TestFuzzTarget(TestFixture& test, TestFuzz::RunFunction run)
+	: myTest(&test)
+	, myRun(run)
+	, myNext(ourFirst)
+{
+	ourFirst = this;
+}
+
+//---------------------------------------------------------------------------------
+// Every input checks into a fixture standing in for the test, so a failing input
+// can be told apart and its messages logged under a header saying which it was
+//---------------------------------------------------------------------------------
+static bool locRunInput(TestStandIn& fixture, TestFuzz::RunFunction run, unsigned char const* data, size_t size)
+{
+	return fixture.Run([&] { run(fixture.Test(), data, size); });
+}
+
+// Setup of a test that isn't run through ExecuteTest, for libFuzzer
+struct TestFuzzSetup : TestFixture
+{
+	static void Run(TestFixture& test)
+	{
+		void (TestFixture::*setup)() = &TestFuzzSetup::Setup;
+		TestFixture* lastCurrent = ourCurrentTest;
+		ourCurrentTest = &test;
+		(test.*setup)();
+		ourCurrentTest = lastCurrent;
+	}
+};
+
+//---------------------------------------------------------------------------------
+// Corpus files
+//---------------------------------------------------------------------------------
+static int const locPathLength = 512;
+
+template <typename Function>
+static void locForEachFile(char const* directory, Function function)
+{
+	char path[2 * locPathLength]; // room for the directory and the longest file name
+#if defined(_WIN32)
+	snprintf(path, sizeof(path), "%s/*", directory);
+	WIN32_FIND_DATAA found;
+	HANDLE find = FindFirstFileA(path, &found);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+	do
+	{
+		if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", directory, found.cFileName);
+		function(path);
+	} while (FindNextFileA(find, &found));
+	FindClose(find);
+#else
+	DIR* dir = opendir(directory);
+	if (dir == nullptr)
+		return;
+	while (dirent* entry = readdir(dir))
+	{
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+		function(path);
+	}
+	closedir(dir);
+#endif
+}
+
+// Reads up to maxSize bytes, returns false if the file couldn't be read
+static bool locReadFile(char const* path, unsigned char* data, size_t maxSize, size_t& size, bool& truncated)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == nullptr)
+		return false;
+
+	size = fread(data, 1, maxSize, file);
+	unsigned char extra;
+	truncated = size == maxSize && fread(&extra, 1, 1, file) == 1;
+	fclose(file);
+	return true;
+}
+
+static unsigned long long locHashInput(unsigned char const* data, size_t size)
+{
+	unsigned long long hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ data[i]) * 0x100000001b3ull;
+	return hash;
+}
+
+static void locMakeDirectory(char const* path)
+{
+#if defined(_WIN32)
+	_mkdir(path);
+#else
+	mkdir(path, 0755);
+#endif
+}
+
+// Save an input named after its hash, path receives where it went
+static bool locSaveInput(char const* directory, char const* prefix, unsigned char const* data, size_t size, char* path, size_t pathSize)
+{
+	locMakeDirectory(locCorpus);
+	locMakeDirectory(directory);
+	snprintf(path, pathSize, "%s/%s%016llx", directory, prefix, locHashInput(data, size));
+
+	FILE* file = fopen(path, "wb");
+	if (file == nullptr)
+		return false;
+	bool written = fwrite(data, 1, size, file) == size;
+	return fclose(file) == 0 && written;
+}
+
+//---------------------------------------------------------------------------------
+// Replay runs the empty input and then every file in the corpus
+//---------------------------------------------------------------------------------
+static thread_local unsigned char locInput[FUZZ_MAX_LENGTH];
+
+static void locReplay(TestFixture& test, TestFuzz::RunFunction run, TestStandIn& fixture, char const* directory)
+{
+	int numInputs = 1;
+	if (locRunInput(fixture, run, nullptr, 0))
+		fixture.Log("The empty input failed:");
+	fixture.Reset();
+
+	locForEachFile(directory, [&](char const* path)
+	{
+		size_t size;
+		bool truncated;
+		if (!locReadFile(path, locInput, sizeof(locInput), size, truncated))
+			return;
+
+		++numInputs;
+		if (truncated)
+			test.LogMessage("Corpus input %s is longer than FUZZ_MAX_LENGTH, only the first %d bytes were used", path, FUZZ_MAX_LENGTH);
+
+		if (locRunInput(fixture, run, locInput, size))
+		{
+			char header[2 * locPathLength + 64];
+			snprintf(header, sizeof(header), "Corpus input %s failed %d of %d checks:", path, fixture.NumErrors(), fixture.NumTests());
+			fixture.Log(header);
+		}
+		fixture.Reset();
+	});
+
+	if (test.ShouldLogInfo())
+		test.LogMessage("Replayed %d inputs from %s", numInputs, directory);
+}
+
+//---------------------------------------------------------------------------------
+// Coverage. Instrumented code bumps a counter per edge, and an input is kept
+// when any counter lands in a bucket (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+)
+// it never reached before. Counters are shared by every thread, so only one
+// test fuzzes at a time.
+//---------------------------------------------------------------------------------
+alignas(64) static unsigned char locCoverage[FUZZ_COVERAGE_SIZE];
+static unsigned char locSeenCoverage[FUZZ_COVERAGE_SIZE];
+static bool locCovered; // set by every counter bump, so uninstrumented runs don't scan the counters
+
+#if defined(__GNUC__) && !defined(FUZZ_LIBFUZZER)
+extern "C" FUZZ_NO_COVERAGE void __sanitizer_cov_trace_pc_guard_init(uint32_t* start, uint32_t* stop)
+{
+	static uint32_t numGuards;
+	if (start == stop || *start)
+		return;
+	for (uint32_t* guard = start; guard < stop; ++guard)
+		*guard = ++numGuards;
+}
+extern "C" FUZZ_NO_COVERAGE void __sanitizer_cov_trace_pc_guard(uint32_t* guard)
+{
+	++locCoverage[*guard % FUZZ_COVERAGE_SIZE];
+	locCovered = true;
+}
+extern "C" FUZZ_NO_COVERAGE void __sanitizer_cov_trace_pc()
+{
+	uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+	++locCoverage[(pc ^ (pc >> 16)) % FUZZ_COVERAGE_SIZE];
+	locCovered = true;
+}
+#endif
+
+// Clears the counters, returns the number of buckets reached for the first time
+static int locCollectCoverage()
+{
+	if (!locCovered)
+		return 0;
+
+	locCovered = false;
+	int numNew = 0;
+	for (size_t i = 0; i < FUZZ_COVERAGE_SIZE; i += 8)
+	{
+		unsigned long long word;
+		memcpy(&word, locCoverage + i, 8);
+		if (word == 0)
+			continue;
+
+		for (size_t k = i; k < i + 8 && k < FUZZ_COVERAGE_SIZE; ++k)
+		{
+			unsigned count = locCoverage[k];
+			if (count == 0)
+				continue;
+
+			locCoverage[k] = 0;
+			unsigned char bucket = (unsigned char)(count >= 128 ? 128 : count >= 32 ? 64 : count >= 16 ? 32 : count >= 8 ? 16 : count >= 4 ? 8 : count == 3 ? 4 : count);
+			if ((locSeenCoverage[k] & bucket) == 0)
+			{
+				locSeenCoverage[k] |= bucket;
+				++numNew;
+			}
+		}
+	}
+	return numNew;
+}
+
+//---------------------------------------------------------------------------------
+// Mutations, a few at a time on a copy of an input from the corpus
+//---------------------------------------------------------------------------------
+struct TestFuzzRandom
+{
+	unsigned long long Next()
+	{
+		unsigned long long z = (myState += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+	size_t Below(size_t bound) { return bound ? size_t(Next() % bound) : 0; }
+
+	unsigned long long myState;
+};
+
+static size_t locMutate(unsigned char* data, size_t size, size_t maxSize, TestFuzzRandom& random, unsigned char const* other, size_t otherSize)
+{
+	static unsigned long long const interesting[] = { 0, 1, 0x7f, 0x80, 0xff, 0x100, 0x7fff, 0x8000, 0xffff, 0x10000, 0x7fffffff, 0x80000000, 0xffffffff, ~0ull };
+
+	for (int mutations = 1 + int(random.Below(4)); mutations; --mutations)
+	{
+		size_t at = random.Below(size);
+		switch (size ? random.Below(8) : 2)
+		{
+		case 0: // flip a bit
+			data[at] ^= (unsigned char)(1u << random.Below(8));
+			break;
+		case 1: // any byte
+			data[at] = (unsigned char)random.Next();
+			break;
+		case 2: // insert a few bytes
+		{
+			size_t count = 1 + random.Below(4);
+			count = count < maxSize - size ? count : maxSize - size;
+			at = random.Below(size + 1);
+			memmove(data + at + count, data + at, size - at);
+			for (size_t i = 0; i < count; ++i)
+				data[at + i] = (unsigned char)random.Next();
+			size += count;
+			break;
+		}
+		case 3: // erase a few bytes
+		{
+			size_t count = 1 + random.Below(size - at < 8 ? size - at : 8);
+			memmove(data + at, data + at + count, size - at - count);
+			size -= count;
+			break;
+		}
+		case 4: // a boundary value, little or big endian
+		{
+			unsigned long long value = interesting[random.Below(sizeof(interesting) / sizeof(interesting[0]))];
+			size_t width = size_t(1) << random.Below(4);
+			width = width < size - at ? width : size - at;
+			bool big = random.Next() & 1;
+			for (size_t i = 0; i < width; ++i)
+				data[at + i] = (unsigned char)(value >> (8 * (big ? width - 1 - i : i)));
+			break;
+		}
+		case 5: // nudge a byte
+			data[at] = (unsigned char)(data[at] + 1 + random.Below(16) - 8);
+			break;
+		case 6: // copy part of the input over another part
+		{
+			size_t from = random.Below(size);
+			size_t count = 1 + random.Below(size - (at > from ? at : from));
+			memmove(data + at, data + from, count);
+			break;
+		}
+		case 7: // splice in part of another input
+		{
+			if (otherSize == 0)
+				break;
+			size_t from = random.Below(otherSize);
+			size_t count = 1 + random.Below(otherSize - from);
+			count = count < maxSize - at ? count : maxSize - at;
+			memcpy(data + at, other + from, count);
+			size = at + count > size ? at + count : size;
+			break;
+		}
+		}
+	}
+	return size;
+}
+
+//---------------------------------------------------------------------------------
+// Built in fuzzing. The corpus is loaded into a fixed arena, every input that
+// reaches new coverage is added to it and saved, and the first failing input is
+// saved and logged before stopping. Inputs that crash are written out by a
+// signal handler before the process goes down.
+//---------------------------------------------------------------------------------
+struct TestFuzzInput
+{
+	size_t offset;
+	size_t size;
+};
+
+static std::mutex locFuzzLock;
+static unsigned char locArena[FUZZ_CORPUS_SIZE];
+static TestFuzzInput locInputs[FUZZ_MAX_INPUTS];
+static unsigned char locMutated[FUZZ_MAX_LENGTH];
+
+#if !defined(_WIN32)
+static char locCrashPath[locPathLength];
+static size_t locCrashDirectoryLength;
+static unsigned char const* volatile locCrashInput;
+static volatile size_t locCrashSize;
+static struct sigaction locOldActions[32];
+static int const locCrashSignals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+static void locCrashHandler(int signal)
+{
+	// only async signal safe calls, the name is written by hand
+	char* name = locCrashPath + locCrashDirectoryLength;
+	memcpy(name, "/crash-", 7);
+	unsigned long long hash = locHashInput(locCrashInput, locCrashSize);
+	for (int i = 0; i < 16; ++i)
+		name[7 + i] = "0123456789abcdef"[(hash >> (60 - 4 * i)) & 15];
+	name[23] = 0;
+
+	int fd = open(locCrashPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0)
+	{
+		ssize_t written = write(fd, locCrashInput, locCrashSize);
+		(void)written;
+		close(fd);
+		static char const message[] = "\nFuzzing crashed, the input was saved to ";
+		written = write(2, message, sizeof(message) - 1);
+		written = write(2, locCrashPath, strlen(locCrashPath));
+		written = write(2, "\n", 1);
+	}
+
+	sigaction(signal, &locOldActions[signal], nullptr);
+	raise(signal);
+}
+#endif
+
+static void locFuzz(TestFixture& test, TestFuzz::RunFunction run, TestStandIn& fixture, char const* directory)
+{
+	std::lock_guard<std::mutex> lock(locFuzzLock);
+
+	int numInputs = 0;
+	size_t used = 0;
+	auto addInput = [&](unsigned char const* data, size_t size)
+	{
+		if (numInputs == FUZZ_MAX_INPUTS || size > FUZZ_CORPUS_SIZE - used)
+			return false;
+		if (size)
+			memcpy(locArena + used, data, size);
+		locInputs[numInputs].offset = used;
+		locInputs[numInputs].size = size;
+		used += size;
+		++numInputs;
+		return true;
+	};
+
+	addInput(nullptr, 0);
+	locForEachFile(directory, [&](char const* path)
+	{
+		size_t size;
+		bool truncated;
+		if (locReadFile(path, locMutated, sizeof(locMutated), size, truncated))
+			addInput(locMutated, size);
+	});
+
+#if !defined(_WIN32)
+	locCrashDirectoryLength = size_t(snprintf(locCrashPath, sizeof(locCrashPath) - 24, "%s", directory));
+	locCrashDirectoryLength = locCrashDirectoryLength < sizeof(locCrashPath) - 24 ? locCrashDirectoryLength : sizeof(locCrashPath) - 25;
+	locMakeDirectory(locCorpus);
+	locMakeDirectory(directory);
+	for (int signal : locCrashSignals)
+	{
+		struct sigaction action = {};
+		action.sa_handler = locCrashHandler;
+		sigemptyset(&action.sa_mask);
+		sigaction(signal, &action, &locOldActions[signal]);
+	}
+#endif
+
+	memset(locCoverage, 0, sizeof(locCoverage));
+	memset(locSeenCoverage, 0, sizeof(locSeenCoverage));
+	locCovered = false;
+	int numFeatures = 0;
+	int numLoaded = numInputs;
+
+	TestFuzzRandom random = { TestFuzz::GetSeed() ^ locHashInput((unsigned char const*)directory, strlen(directory)) };
+	auto start = std::chrono::steady_clock::now();
+	double seconds = 0;
+	unsigned long long runs = 0;
+	for (;; ++runs)
+	{
+		if ((runs & 63) == 0)
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if ((locRuns && runs >= locRuns) || (locSeconds > 0 && seconds >= locSeconds))
+			break;
+
+		// the loaded corpus runs as it is first, then mutations of it
+		size_t size;
+		if (runs < (unsigned long long)numLoaded)
+		{
+			size = locInputs[runs].size;
+			memcpy(locMutated, locArena + locInputs[runs].offset, size);
+		}
+		else
+		{
+			TestFuzzInput const& input = locInputs[random.Below(size_t(numInputs))];
+			TestFuzzInput const& other = locInputs[random.Below(size_t(numInputs))];
+			memcpy(locMutated, locArena + input.offset, input.size);
+			size = locMutate(locMutated, input.size, sizeof(locMutated), random, locArena + other.offset, other.size);
+		}
+
+#if !defined(_WIN32)
+		locCrashInput = locMutated;
+		locCrashSize = size;
+#endif
+		bool failed = locRunInput(fixture, run, locMutated, size);
+		int numNew = locCollectCoverage();
+		numFeatures += numNew;
+
+		char path[locPathLength];
+		if (failed)
+		{
+			char header[locPathLength + 128];
+			if (locSaveInput(directory, "failure-", locMutated, size, path, sizeof(path)))
+				snprintf(header, sizeof(header), "Input %s failed %d of %d checks after %llu runs, seed %llu:", path, fixture.NumErrors(), fixture.NumTests(), runs + 1, TestFuzz::GetSeed());
+			else
+				snprintf(header, sizeof(header), "An input of %d bytes failed %d of %d checks after %llu runs, seed %llu, it couldn't be saved to %s:", int(size), fixture.NumErrors(), fixture.NumTests(), runs + 1, TestFuzz::GetSeed(), directory);
+			fixture.Log(header);
+			fixture.Reset();
+			++runs;
+			break;
+		}
+		fixture.Reset();
+
+		if (numNew && runs >= (unsigned long long)numLoaded && addInput(locMutated, size))
+			locSaveInput(directory, "", locMutated, size, path, sizeof(path));
+	}
+
+#if !defined(_WIN32)
+	for (int signal : locCrashSignals)
+		sigaction(signal, &locOldActions[signal], nullptr);
+	locCrashInput = nullptr;
+#endif
+
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (test.ShouldLogInfo())
+		test.LogMessage("Fuzzed %llu inputs in %.1f seconds, %d inputs in the corpus reaching %d coverage features", runs, seconds, numInputs, numFeatures);
+}
+
+void TestFuzz::Run(TestFixture& test, RunFunction run)
+{
+	alignas(TestStandIn) char storage[sizeof(TestStandIn)];
+	TestStandIn& fixture = *TestStandIn::Construct(storage, test);
+
+	char directory[locPathLength];
+	snprintf(directory, sizeof(directory), "%s/%s.%s", locCorpus, test.TestGroup(), test.TestName());
+
+	if (IsFuzzing())
+		locFuzz(test, run, fixture, directory);
+	else
+		locReplay(test, run, fixture, directory);
+
+	// failing inputs were logged as they went, so only the counts are left to adopt
+	fixture.Adopt();
+	fixture.~TestStandIn();
+}
+
+//---------------------------------------------------------------------------------
+// libFuzzer entry points. Setup runs once before the first input, libFuzzer
+// exits without giving TearDown a chance to run.
+//---------------------------------------------------------------------------------
+#if defined(FUZZ_LIBFUZZER)
+static TestFuzzTarget* locTarget;
+alignas(TestStandIn) static char locTargetStorage[sizeof(TestStandIn)];
+static TestStandIn* locTargetFixture;
+
+extern "C" int LLVMFuzzerInitialize(int*, char***)
+{
+	char const* wanted = getenv("SIMPLETEST_FUZZ");
+	int numTargets = 0;
+	for (TestFuzzTarget* i = TestFuzzTarget::ourFirst; i; i = i->myNext)
+	{
+		++numTargets;
+		char name[256];
+		snprintf(name, sizeof(name), "%s/%s", i->myTest->TestGroup(), i->myTest->TestName());
+		if (wanted == nullptr || strcmp(wanted, name) == 0)
+			locTarget = i;
+	}
+
+	if (locTarget == nullptr || (wanted == nullptr && numTargets > 1))
+	{
+		TestFixture::Printf("Set SIMPLETEST_FUZZ to the group/name of the test to fuzz:\n");
+		for (TestFuzzTarget* i = TestFuzzTarget::ourFirst; i; i = i->myNext)
+			TestFixture::Printf("  %s/%s\n", i->myTest->TestGroup(), i->myTest->TestName());
+		exit(1);
+	}
+
+	locTargetFixture = TestStandIn::Construct(locTargetStorage, *locTarget->myTest);
+	TestFuzzSetup::Run(*locTarget->myTest);
+	return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size)
+{
+	if (locRunInput(*locTargetFixture, locTarget->myRun, data, size))
+	{
+		char buffer[ERROR_CHUNK_SIZE];
+		TestFixture::Printf("[%s/%s] failed %d of %d checks:\n", locTarget->myTest->TestGroup(), locTarget->myTest->TestName(), locTargetFixture->NumErrors(), locTargetFixture->NumTests());
+		for (TestError const* err = locTargetFixture->GetFirstError(); err; err = err->next)
+			TestFixture::Printf("%s\n", err->Text(buffer, sizeof(buffer)));
+		fflush(stdout);
+		abort();
+	}
+	locTargetFixture->Reset();
+	return 0;
+}
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "simpletest.h"
+
+//---------------------------------------------------------------------------------
+// Optional fuzz tests. The body of a DEFINE_FUZZ_TEST takes a byte buffer and
+// runs in process on the test's fixture, so Setup and TearDown are shared with
+// the regular tests and any failing TEST counts as a crash. Normal runs replay
+// the test's corpus directory as a quick regression test. When fuzzing, either
+// libFuzzer (define FUZZ_LIBFUZZER and link with clang's -fsanitize=fuzzer) or
+// the built in mutation loop drives it. The built in loop follows coverage when
+// the code under test is built with -fsanitize-coverage=trace-pc-guard (clang)
+// or trace-pc (gcc), and mutates blindly otherwise.
+//---------------------------------------------------------------------------------
+#if !defined(FUZZ_CORPUS_DIR)
+#define FUZZ_CORPUS_DIR "corpus" // inputs of a test live in FUZZ_CORPUS_DIR/group.name, one per file
+#endif
+#if !defined(FUZZ_MAX_LENGTH)
+#define FUZZ_MAX_LENGTH 4096 // longest input, longer corpus files are cut short
+#endif
+#if !defined(FUZZ_CORPUS_SIZE)
+#define FUZZ_CORPUS_SIZE (1 << 20) // bytes of inputs the built in loop keeps in memory
+#endif
+#if !defined(FUZZ_MAX_INPUTS)
+#define FUZZ_MAX_INPUTS 4096 // most inputs the built in loop keeps in memory
+#endif
+#if !defined(FUZZ_COVERAGE_SIZE)
+#define FUZZ_COVERAGE_SIZE (1 << 16) // coverage counters, edges past this share them
+#endif
+
+struct TestFuzz
+{
+	typedef void (*RunFunction)(TestFixture& test, unsigned char const* data, size_t size);
+
+	// Fuzz for this many inputs or seconds instead of replaying, whichever comes first. 0 doesn't limit, both 0 replays.
+	static void SetFuzzing(unsigned long long runs, double seconds);
+	static bool IsFuzzing();
+
+	// Directory holding a folder of inputs for each test, found and saved inputs go there too
+	static void SetCorpus(char const* directory);
+	static char const* GetCorpus();
+
+	// Seed of the mutation loop, logged with failures
+	static void SetSeed(unsigned long long seed);
+	static unsigned long long GetSeed();
+
+	// Replays the corpus of a test or fuzzes it, used by DEFINE_FUZZ_TEST
+	static void Run(TestFixture& test, RunFunction run);
+};
+
+//---------------------------------------------------------------------------------
+// Every fuzz test registers a target so libFuzzer can find it, the one to fuzz is
+// picked with SIMPLETEST_FUZZ=group/name when there's more than one
+//---------------------------------------------------------------------------------
+struct TestFuzzTarget
+{
+	TestFuzzTarget(TestFixture& test, TestFuzz::RunFunction run);
+
+	TestFixture* myTest;
+	TestFuzz::RunFunction myRun;
+	TestFuzzTarget* myNext;
+	static TestFuzzTarget* ourFirst;
+};
+
+//---------------------------------------------------------------------------------
+// Fuzz test definition macros. The body runs once per input with it in data and
+// size, i.e.
+// DEFINE_FUZZ_TEST_G(Parse, Json) { Json json; if (json.Parse(data, size)) TEST(json.Validate()); }
+// Inputs share the fixture, Setup runs before the first and TearDown after the last.
+//---------------------------------------------------------------------------------
+#define DEFINE_FUZZ_TEST_FULL(name, group, fixture) \
+struct TOK(group, name) final : public fixture { \
+	char const* TestName() const override { return #name; } \
+	char const* TestGroup() const override { return #group; } \
+	void RunTest() override { TestFuzz::Run(*this, &RunErased); } \
+	static void RunErased(TestFixture& test, unsigned char const* data, size_t size) { static_cast<TOK(group, name)&>(test).RunInput(data, size); } \
+	void RunInput(unsigned char const* data, size_t size); \
+} TOK(TOK(group, name), Instance); \
+static TestFuzzTarget TOK(TOK(group, name), Target)(TOK(TOK(group, name), Instance), &TOK(group, name)::RunErased); \
+void TOK(group, name)::RunInput(unsigned char const* data TEST_UNUSED_, size_t size TEST_UNUSED_)
+
+#define DEFINE_FUZZ_TEST(name) DEFINE_FUZZ_TEST_FULL(name, Global, BASE_FIXTURE)
+#define DEFINE_FUZZ_TEST_G(name, group) DEFINE_FUZZ_TEST_FULL(name, group, BASE_FIXTURE)
+#define DEFINE_FUZZ_TEST_F(name, fixture) DEFINE_FUZZ_TEST_FULL(name, Global, fixture)
+#define DEFINE_FUZZ_TEST_GF(name, group, fixture) DEFINE_FUZZ_TEST_FULL(name, group, fixture)
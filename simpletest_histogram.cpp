@@ -0,0 +1,81 @@
+#include "simpletest_histogram.h"
+#include <stdio.h>
+#include <string.h>
+
+//---------------------------------------------------------------------------------
+void TestHistogram::Add(TestHistogram const& other)
+{
+	for (int i = 0; i < ourNumCounts; ++i)
+		myCounts[i] += other.myCounts[i];
+
+	myCount += other.myCount;
+	mySum += other.mySum;
+	myMin = other.myMin < myMin ? other.myMin : myMin;
+	myMax = other.myMax > myMax ? other.myMax : myMax;
+}
+void TestHistogram::Clear()
+{
+	memset(myCounts, 0, sizeof(myCounts));
+	myCount = 0;
+	mySum = 0;
+	myMin = ~0ull;
+	myMax = 0;
+}
+unsigned long long TestHistogram::ValueAt(double percentile) const
+{
+	if (myCount == 0)
+		return 0;
+
+	// rank of the sample the percentile falls on, counting from 1
+	double rank = percentile / 100 * double(myCount);
+	unsigned long long target = rank <= 1 ? 1 : rank >= double(myCount) ? myCount : (unsigned long long)rank;
+	if (double(target) < rank)
+		++target;
+
+	unsigned long long seen = 0;
+	for (int i = 0; i < ourNumCounts; ++i)
+	{
+		seen += myCounts[i];
+		if (seen >= target)
+		{
+			unsigned long long value = HighestValue(i);
+			return value < myMax ? value : myMax;
+		}
+	}
+	return myMax;
+}
+
+//---------------------------------------------------------------------------------
+// Three significant digits in whatever unit suits, right aligned to width
+//---------------------------------------------------------------------------------
+static int locFormatNanoseconds(char* buffer, size_t size, int width, double nanoseconds)
+{
+	if (nanoseconds < 999.5)
+		return snprintf(buffer, size, "%*.3g ns", width, nanoseconds);
+	else if (nanoseconds < 999.5e3)
+		return snprintf(buffer, size, "%*.3g us", width, nanoseconds * 1e-3);
+	else if (nanoseconds < 999.5e6)
+		return snprintf(buffer, size, "%*.3g ms", width, nanoseconds * 1e-6);
+	return snprintf(buffer, size, "%*.3g  s", width, nanoseconds * 1e-9);
+}
+
+TestHistogramTable::TestHistogramTable(TestHistogram const& histogram)
+{
+	static char const* const names[] = { "min", "p50", "p90", "p99", "p99.9", "p99.99", "max" };
+	static double const percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+	double const nanosecondsPerTick = TestClock::ToSeconds(1) * 1e9;
+
+	char* write = myText;
+	char* end = myText + sizeof(myText);
+	write += snprintf(write, size_t(end - write), "%llu samples, mean ", histogram.Count());
+	write += locFormatNanoseconds(write, size_t(end - write), 1, histogram.Mean() * nanosecondsPerTick);
+
+	write += snprintf(write, size_t(end - write), "\n");
+	for (char const* name : names)
+		write += snprintf(write, size_t(end - write), "%8s%s", name, name == names[6] ? "\n" : "   ");
+
+	write += locFormatNanoseconds(write, size_t(end - write), 8, double(histogram.Min()) * nanosecondsPerTick);
+	for (double percentile : percentiles)
+		write += locFormatNanoseconds(write, size_t(end - write), 8, histogram.NanosecondsAt(percentile));
+	locFormatNanoseconds(write, size_t(end - write), 8, double(histogram.Max()) * nanosecondsPerTick);
+}
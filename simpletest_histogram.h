@@ -0,0 +1,128 @@
+#pragma once
+
+#include "simpletest.h"
+
+//---------------------------------------------------------------------------------
+// Optional HDR style latency histograms. Values are TestClock ticks, bucketed
+// log-linearly so every value is kept to within 1 part in 2^(HISTOGRAM_PRECISION_BITS - 1)
+// of what was recorded, which keeps p99 and p999 honest without storing samples.
+// Counts live inside the histogram so recording never allocates, and it's inline
+// and branch free so it can wrap the operation under test directly. Define
+// BENCHMARK_USE_TSC for the cheapest clock. Histograms aren't thread safe, give
+// each thread its own and Add them together afterwards.
+//---------------------------------------------------------------------------------
+#if !defined(HISTOGRAM_PRECISION_BITS)
+#define HISTOGRAM_PRECISION_BITS 8 // 8 keeps values to within 1/128, better than 1%
+#endif
+#if !defined(HISTOGRAM_RANGE_BITS)
+#define HISTOGRAM_RANGE_BITS 40 // values are clamped below 2^bits ticks, minutes with any clock
+#endif
+
+static_assert(HISTOGRAM_PRECISION_BITS >= 2 && HISTOGRAM_PRECISION_BITS < HISTOGRAM_RANGE_BITS && HISTOGRAM_RANGE_BITS <= 63, "Histogram precision must be at least 2 bits and less than the range, which is at most 63 bits");
+
+struct TestHistogram
+{
+	static int const ourHalfBuckets = 1 << (HISTOGRAM_PRECISION_BITS - 1);
+	static int const ourNumCounts = (HISTOGRAM_RANGE_BITS - HISTOGRAM_PRECISION_BITS + 2) * ourHalfBuckets;
+	static unsigned long long const ourMaxValue = (1ull << HISTOGRAM_RANGE_BITS) - 1;
+
+	TestHistogram() { Clear(); }
+
+	void Record(unsigned long long ticks)
+	{
+		ticks = ticks < ourMaxValue ? ticks : ourMaxValue;
+		++myCounts[Index(ticks)];
+		++myCount;
+		mySum += ticks;
+		myMin = ticks < myMin ? ticks : myMin;
+		myMax = ticks > myMax ? ticks : myMax;
+	}
+
+	void Add(TestHistogram const& other);
+	void Clear();
+
+	unsigned long long Count() const { return myCount; }
+	unsigned long long Min() const { return myCount ? myMin : 0; }
+	unsigned long long Max() const { return myMax; }
+	double Mean() const { return myCount ? double(mySum) / double(myCount) : 0; }
+
+	// Highest value the given percent of samples are at or below, rounded up to the end of its bucket
+	unsigned long long ValueAt(double percentile) const;
+
+	// Same in nanoseconds
+	double NanosecondsAt(double percentile) const { return TestClock::ToSeconds(ValueAt(percentile)) * 1e9; }
+
+	// Bucket of a value, bucket 0 holds small values exactly and each one after that covers twice the range at the same number of steps
+	static int Index(unsigned long long value)
+	{
+		int shift = HighestBit(value | (2ull * ourHalfBuckets - 1)) - (HISTOGRAM_PRECISION_BITS - 1);
+		return (shift << (HISTOGRAM_PRECISION_BITS - 1)) + int(value >> shift);
+	}
+	static unsigned long long LowestValue(int index)
+	{
+		int shift = index < 2 * ourHalfBuckets ? 0 : index / ourHalfBuckets - 1;
+		return (unsigned long long)(index - shift * ourHalfBuckets) << shift;
+	}
+	static unsigned long long HighestValue(int index) { return LowestValue(index + 1) - 1; }
+
+private:
+	static int HighestBit(unsigned long long value)
+	{
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return int(index);
+#else
+		return 63 - __builtin_clzll(value);
+#endif
+	}
+
+	unsigned long long myCount;
+	unsigned long long mySum;
+	unsigned long long myMin;
+	unsigned long long myMax;
+	unsigned long long myCounts[ourNumCounts];
+};
+
+//---------------------------------------------------------------------------------
+// Records the time from construction to the end of the scope
+//---------------------------------------------------------------------------------
+struct TestHistogramTimer
+{
+	explicit TestHistogramTimer(TestHistogram& histogram) : myHistogram(histogram), myStart(TestClock::Now()) {}
+	~TestHistogramTimer() { myHistogram.Record(TestClock::Now() - myStart); }
+
+private:
+	TestHistogram& myHistogram;
+	unsigned long long myStart;
+};
+
+#define TEST_HISTOGRAM_SCOPE(histogram) TestHistogramTimer TOK(test_histogram_timer_, __LINE__)(histogram)
+
+//---------------------------------------------------------------------------------
+// Compact table of the count, mean, min, common percentiles and max, i.e.
+// 100000 samples, mean 44.3 ns
+//      min        p50        p90        p99      p99.9     p99.99        max
+//      30 ns      44 ns      49 ns      58 ns     145 ns     563 ns    28.6 us
+//---------------------------------------------------------------------------------
+struct TestHistogramTable
+{
+	explicit TestHistogramTable(TestHistogram const& histogram);
+
+	char const* operator*() const { return myText; }
+
+	char myText[256];
+};
+
+//---------------------------------------------------------------------------------
+// Assertions on a percentile in nanoseconds, failures log the whole table.
+// Histograms without any samples always fail.
+// i.e. TEST_PERCENTILE_LESS(latency, 99.9, 500);
+//---------------------------------------------------------------------------------
+#define TEST_PERCENTILE_OPERATOR(histogram, percentile, nanoseconds, op1, op2) do { TestHistogram const& test_histogram_ = histogram; double test_value_ = test_histogram_.NanosecondsAt(percentile); TEST_CHECK_(test_histogram_.Count() && test_value_ op1 double(nanoseconds), STR(histogram) " p" STR(percentile) " " STR(op1) " " STR(nanoseconds) " ns", "p%g of %.0f ns " STR(op2) " %g ns\n%s", double(percentile), test_value_, double(nanoseconds), *TestHistogramTable(test_histogram_)); } while(0)
+
+#define TEST_PERCENTILE_LESS(histogram, percentile, nanoseconds) TEST_PERCENTILE_OPERATOR(histogram, percentile, nanoseconds, <, >=)
+#define TEST_PERCENTILE_LESS_EQUAL(histogram, percentile, nanoseconds) TEST_PERCENTILE_OPERATOR(histogram, percentile, nanoseconds, <=, >)
+
+// Log the table as an informational message, shown in Verbose mode
+#define TEST_HISTOGRAM_LOG(histogram) do { TestFixture* __fx = test_scope_.Fixture(); if (__fx->ShouldLogInfo()) __fx->LogMessage(STR(histogram) ": %s", *TestHistogramTable(histogram)); } while(0)
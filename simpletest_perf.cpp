@@ -0,0 +1,231 @@
+#include "simpletest_perf.h"
+#include <stdio.h>
+#include <string.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define TEST_PERF_EVENTS 1
+#endif
+
+static char const* const locCounterNames[PerfCounterCount] =
+{
+	"instructions",
+	"cycles",
+	"cache misses",
+	"branch misses",
+	"page faults",
+};
+
+#if TEST_PERF_EVENTS
+//---------------------------------------------------------------------------------
+// A thread's counter group, opened on first use and closed when the thread exits.
+// Counters that fail to open are left out of the group.
+//---------------------------------------------------------------------------------
+struct TestPerfGroup
+{
+	TestPerfGroup() { Open(); }
+	~TestPerfGroup() { Close(); }
+
+	void Open()
+	{
+		static struct { unsigned type; unsigned long long config; } const events[PerfCounterCount] =
+		{
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+			{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+		};
+
+		myPid = getpid();
+		myLeader = -1;
+		myNumOpen = 0;
+		for (int i = 0; i < PerfCounterCount; ++i)
+		{
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = events[i].type;
+			attr.config = events[i].config;
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			attr.exclude_kernel = 1; // allowed with the default perf_event_paranoid
+			attr.exclude_hv = 1;
+
+			int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, myLeader, 0);
+			if (fd < 0)
+				continue;
+
+			if (myLeader < 0)
+				myLeader = fd;
+			myFds[myNumOpen] = fd;
+			myCounters[myNumOpen++] = i;
+		}
+	}
+	void Close()
+	{
+		for (int i = myNumOpen - 1; i >= 0; --i)
+			close(myFds[i]);
+		myLeader = -1;
+		myNumOpen = 0;
+	}
+
+	unsigned Read(unsigned long long values[PerfCounterCount])
+	{
+		// counters follow the thread that opened them, a forked worker process needs its own
+		if (myPid != getpid())
+		{
+			Close();
+			Open();
+		}
+		if (myLeader < 0)
+			return 0;
+
+		// nr, time enabled, time running, then a value per counter in the order they were opened
+		unsigned long long buffer[3 + PerfCounterCount];
+		ssize_t size = read(myLeader, buffer, sizeof(buffer));
+		if (size < ssize_t(sizeof(unsigned long long) * (3 + myNumOpen)))
+			return 0;
+
+		// a group the PMU can't schedule never runs, that's as good as not having counters
+		if (buffer[2] == 0 && buffer[1] != 0)
+			return 0;
+
+		unsigned available = 0;
+		for (int i = 0; i < myNumOpen; ++i)
+		{
+			values[myCounters[i]] = buffer[3 + i];
+			available |= 1u << myCounters[i];
+		}
+		return available;
+	}
+
+	pid_t myPid;
+	int myLeader;
+	int myNumOpen;
+	int myFds[PerfCounterCount];
+	int myCounters[PerfCounterCount];
+};
+
+static thread_local TestPerfGroup locPerfGroup;
+#endif
+
+//---------------------------------------------------------------------------------
+unsigned TestPerf::Available()
+{
+	unsigned long long values[PerfCounterCount];
+	return Read(values);
+}
+char const* TestPerf::CounterName(TestPerfCounter counter)
+{
+	return counter >= 0 && counter < PerfCounterCount ? locCounterNames[counter] : "unknown";
+}
+unsigned TestPerf::Read(unsigned long long values[PerfCounterCount])
+{
+#if TEST_PERF_EVENTS
+	return locPerfGroup.Read(values);
+#else
+	(void)values;
+	return 0;
+#endif
+}
+
+//---------------------------------------------------------------------------------
+TestPerfScope::TestPerfScope(bool start)
+{
+	Reset();
+	if (start)
+		Start();
+}
+void TestPerfScope::Start()
+{
+	if (myRunning)
+		return;
+
+	unsigned available = TestPerf::Read(myStart);
+	myAvailable = myAvailable == ~0u ? available : myAvailable & available;
+	myRunning = true;
+}
+void TestPerfScope::Stop()
+{
+	if (!myRunning)
+		return;
+
+	unsigned long long end[PerfCounterCount];
+	myAvailable &= TestPerf::Read(end);
+	for (int i = 0; i < PerfCounterCount; ++i)
+	{
+		if (IsAvailable(TestPerfCounter(i)))
+			myTotal[i] += end[i] - myStart[i];
+	}
+	myRunning = false;
+}
+void TestPerfScope::Reset()
+{
+	memset(myStart, 0, sizeof(myStart));
+	memset(myTotal, 0, sizeof(myTotal));
+	myAvailable = ~0u; // narrowed to what can actually be read on the first Start
+	myRunning = false;
+}
+unsigned long long TestPerfScope::Get(TestPerfCounter counter) const
+{
+	if (!IsAvailable(counter))
+		return 0;
+
+	unsigned long long total = myTotal[counter];
+	if (myRunning)
+	{
+		unsigned long long now[PerfCounterCount];
+		if ((TestPerf::Read(now) >> counter) & 1)
+			total += now[counter] - myStart[counter];
+	}
+	return total;
+}
+
+//---------------------------------------------------------------------------------
+// Phases run back to back on one thread, so per thread scopes are all the hook needs
+//---------------------------------------------------------------------------------
+static thread_local TestPerfScope locBodyCounters(false);
+static thread_local TestPerfScope locFixtureCounters(false);
+
+static void locLogCounters(TestFixture& test, char const* phase, TestPerfScope const& scope)
+{
+	if (!test.ShouldLogInfo())
+		return;
+
+	char buffer[256];
+	int length = 0;
+	for (int i = 0; i < PerfCounterCount; ++i)
+	{
+		TestPerfCounter counter = TestPerfCounter(i);
+		if (scope.IsAvailable(counter) && length < int(sizeof(buffer)))
+			length += snprintf(buffer + length, sizeof(buffer) - length, "%s%llu %s", length ? ", " : "", scope.Get(counter), locCounterNames[i]);
+	}
+
+	if (length)
+		test.LogMessage("%s: %s", phase, buffer);
+}
+void TestPerfHook::BeginPhase(TestFixture& test, TestPhase phase)
+{
+	if (test.GetBenchmark())
+		return;
+
+	if (phase == TestPhaseSetup)
+	{
+		locBodyCounters.Reset();
+		locFixtureCounters.Reset();
+	}
+	(phase == TestPhaseRunTest ? locBodyCounters : locFixtureCounters).Start();
+}
+void TestPerfHook::EndPhase(TestFixture& test, TestPhase phase)
+{
+	if (test.GetBenchmark())
+		return;
+
+	(phase == TestPhaseRunTest ? locBodyCounters : locFixtureCounters).Stop();
+	if (phase == TestPhaseTearDown)
+	{
+		locLogCounters(test, "RunTest", locBodyCounters);
+		locLogCounters(test, "Setup/TearDown", locFixtureCounters);
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "simpletest.h"
+
+//---------------------------------------------------------------------------------
+// Hardware performance counters for tests, read through perf_event_open on Linux.
+// Each thread opens its counters as a single group the first time it measures
+// something so they're all read together. Where counters can't be opened
+// (other platforms, containers, perf_event_paranoid) they're reported as
+// unavailable and the assertions below are skipped instead of failing.
+//---------------------------------------------------------------------------------
+enum TestPerfCounter
+{
+	PerfInstructions,
+	PerfCycles,
+	PerfCacheMisses,
+	PerfBranchMisses,
+	PerfPageFaults,
+	PerfCounterCount
+};
+
+struct TestPerf
+{
+	// Bit per counter that the calling thread can read
+	static unsigned Available();
+	static char const* CounterName(TestPerfCounter counter);
+
+	// Read the calling thread's counters, returns the bits of the ones that were read
+	static unsigned Read(unsigned long long values[PerfCounterCount]);
+};
+
+//---------------------------------------------------------------------------------
+// Accumulates counters between Start and Stop, starts straight away unless told otherwise
+//---------------------------------------------------------------------------------
+struct TestPerfScope
+{
+	explicit TestPerfScope(bool start = true);
+
+	void Start();
+	void Stop();
+	void Reset();
+
+	bool IsAvailable(TestPerfCounter counter) const { return (myAvailable >> counter) & 1; }
+	unsigned long long Get(TestPerfCounter counter) const; // includes the current interval if still running
+
+private:
+	unsigned long long myStart[PerfCounterCount];
+	unsigned long long myTotal[PerfCounterCount];
+	unsigned myAvailable;
+	bool myRunning;
+};
+
+//---------------------------------------------------------------------------------
+// Declare a static instance to measure every test. The counters for RunTest and
+// for Setup/TearDown are logged as messages, so they're shown in Verbose mode
+// and alongside any failures. Benchmarks are left alone.
+//---------------------------------------------------------------------------------
+struct TestPerfHook : TestHook
+{
+	void BeginPhase(TestFixture& test, TestPhase phase) override;
+	void EndPhase(TestFixture& test, TestPhase phase) override;
+};
+
+//---------------------------------------------------------------------------------
+// Assertions on a scope, skipped when the counter isn't available
+// i.e. TEST_PERF_LESS(parse, PerfInstructions, 10000);
+//---------------------------------------------------------------------------------
+#define TEST_PERF_OPERATOR(scope, counter, limit, op1, op2) do { TestPerfScope const& test_perf_ = scope; if (test_perf_.IsAvailable(counter)) { unsigned long long test_value_ = test_perf_.Get(counter); TEST_CHECK_(test_value_ op1 (unsigned long long)(limit), STR(scope) " " STR(counter) " " STR(op1) " " STR(limit), "%llu %s " STR(op2) " %llu", test_value_, TestPerf::CounterName(counter), (unsigned long long)(limit)); } } while(0)
+
+#define TEST_PERF_LESS(scope, counter, limit) TEST_PERF_OPERATOR(scope, counter, limit, <, >=)
+#define TEST_PERF_LESS_EQUAL(scope, counter, limit) TEST_PERF_OPERATOR(scope, counter, limit, <=, >)
+#define TEST_PERF_GREATER(scope, counter, limit) TEST_PERF_OPERATOR(scope, counter, limit, >, <=)
+#define TEST_PERF_GREATER_EQUAL(scope, counter, limit) TEST_PERF_OPERATOR(scope, counter, limit, >=, <)
@@ -0,0 +1,354 @@
+#include "simpletest_report.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#if defined(_WIN32)
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif
+
+//---------------------------------------------------------------------------------
+// Writer
+//---------------------------------------------------------------------------------
+static long long locSeek(int fd, long long position, int whence)
+{
+#if defined(_WIN32)
+	return _lseeki64(fd, position, whence);
+#else
+	return (long long)lseek(fd, off_t(position), whence);
+#endif
+}
+
+TestWriter::TestWriter(int fd)
+	: myFd(fd)
+	, myOwned(false)
+	, myFailed(false)
+	, myStart(fd >= 0 ? locSeek(fd, 0, SEEK_CUR) : -1)
+	, myFlushed(0)
+	, myUsed(0)
+{
+}
+TestWriter::TestWriter(char const* path)
+	: myOwned(true)
+	, myFailed(false)
+	, myStart(0)
+	, myFlushed(0)
+	, myUsed(0)
+{
+#if defined(_WIN32)
+	myFd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	myFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (myFd < 0)
+		TestFixture::Printf("Failed to open report file '%s'.\n", path);
+}
+TestWriter::~TestWriter()
+{
+	Flush();
+	if (myOwned && myFd >= 0)
+	{
+#if defined(_WIN32)
+		_close(myFd);
+#else
+		close(myFd);
+#endif
+	}
+}
+bool TestWriter::Flush()
+{
+	for (size_t written = 0; written < myUsed && !myFailed && myFd >= 0;)
+	{
+#if defined(_WIN32)
+		int result = _write(myFd, myBuffer + written, unsigned(myUsed - written));
+#else
+		ssize_t result = write(myFd, myBuffer + written, myUsed - written);
+		if (result < 0 && errno == EINTR)
+			continue;
+#endif
+		if (result <= 0)
+			myFailed = true;
+		else
+			written += size_t(result);
+	}
+
+	myFlushed += (long long)myUsed;
+	myUsed = 0;
+	return !myFailed && myFd >= 0;
+}
+bool TestWriter::Patch(long long position, char const* data, size_t size)
+{
+	if (position < 0 || position + (long long)size > Tell())
+		return false;
+
+	if (position >= myFlushed)
+	{
+		memcpy(myBuffer + (position - myFlushed), data, size);
+		return true;
+	}
+
+	// only whole patches are written, a patch straddling the buffer is flushed first
+	if (myStart < 0 || myFailed || (position + (long long)size > myFlushed && !Flush()))
+		return false;
+
+	long long end = locSeek(myFd, 0, SEEK_CUR);
+	bool patched = end >= 0 && locSeek(myFd, myStart + position, SEEK_SET) >= 0;
+#if defined(_WIN32)
+	patched = patched && _write(myFd, data, unsigned(size)) == int(size);
+#else
+	patched = patched && write(myFd, data, size) == ssize_t(size);
+#endif
+	if (end >= 0 && locSeek(myFd, end, SEEK_SET) < 0)
+		myFailed = true;
+	return patched;
+}
+void TestWriter::Write(char const* data, size_t size)
+{
+	while (size)
+	{
+		if (myUsed == sizeof(myBuffer))
+			Flush();
+
+		size_t count = sizeof(myBuffer) - myUsed;
+		count = count < size ? count : size;
+		memcpy(myBuffer + myUsed, data, count);
+		myUsed += count;
+		data += count;
+		size -= count;
+	}
+}
+void TestWriter::Write(char const* string)
+{
+	Write(string, strlen(string));
+}
+void TestWriter::Printf(char const* format, ...)
+{
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		va_list args;
+		va_start(args, format);
+		int printed = vsnprintf(myBuffer + myUsed, sizeof(myBuffer) - myUsed, format, args);
+		va_end(args);
+
+		if (printed < 0)
+			return;
+		if (size_t(printed) < sizeof(myBuffer) - myUsed)
+		{
+			myUsed += size_t(printed);
+			return;
+		}
+
+		// didn't fit, try again with an empty buffer and keep what fits after that
+		if (attempt == 0 && myUsed)
+			Flush();
+		else
+			myUsed = sizeof(myBuffer) - 1;
+	}
+}
+
+//---------------------------------------------------------------------------------
+// Escaping, runs of characters that don't need it are written in one go
+//---------------------------------------------------------------------------------
+static void locWriteXml(TestWriter& writer, char const* string)
+{
+	char const* run = string;
+	for (; *string; ++string)
+	{
+		unsigned char c = (unsigned char)*string;
+		char const* escaped = c == '&' ? "&amp;" : c == '<' ? "&lt;" : c == '>' ? "&gt;" : c == '"' ? "&quot;" : c == '\'' ? "&apos;" :
+			(c < 0x20 && c != '\n' && c != '\t' && c != '\r') ? "?" : nullptr; // other control characters aren't allowed in xml at all
+		if (escaped)
+		{
+			writer.Write(run, size_t(string - run));
+			writer.Write(escaped);
+			run = string + 1;
+		}
+	}
+	writer.Write(run, size_t(string - run));
+}
+static void locWriteJson(TestWriter& writer, char const* string)
+{
+	writer.Write("\"", 1);
+	char const* run = string;
+	for (; *string; ++string)
+	{
+		unsigned char c = (unsigned char)*string;
+		if (c == '"' || c == '\\' || c < 0x20)
+		{
+			writer.Write(run, size_t(string - run));
+			if (c == '\n')
+				writer.Write("\\n", 2);
+			else if (c == '\t')
+				writer.Write("\\t", 2);
+			else if (c == '"' || c == '\\')
+				writer.Printf("\\%c", c);
+			else
+				writer.Printf("\\u%04x", c);
+			run = string + 1;
+		}
+	}
+	writer.Write(run, size_t(string - run));
+	writer.Write("\"", 1);
+}
+// Every line of the message with the given indent in front of it
+static void locWriteIndented(TestWriter& writer, char const* string, char const* indent)
+{
+	for (char const* line = string; line;)
+	{
+		char const* end = strchr(line, '\n');
+		writer.Write(indent);
+		writer.Write(line, end ? size_t(end - line) : strlen(line));
+		writer.Write("\n", 1);
+		line = end ? end + 1 : nullptr;
+	}
+}
+
+static void locWriteCounts(TestWriter& writer, TestFixture const& test, char const* format)
+{
+	if (test.NumDroppedMessages())
+		writer.Printf(format, test.NumDroppedMessages(), "messages were dropped, MESSAGE_SPACE or ERROR_ARENA_SIZE is too small");
+	if (test.NumUnloggedFailures())
+		writer.Printf(format, test.NumUnloggedFailures(), "failures were counted but not logged");
+}
+
+//---------------------------------------------------------------------------------
+// JUnit
+//---------------------------------------------------------------------------------
+// Room for tests="..." failures="..." with any int, whitespace between attributes is fine when they don't fit
+static char const locJUnitCountSpace[] = "                                              ";
+
+void TestJUnitReporter::BeginRun(int)
+{
+	myNumReported = myNumFailed = 0;
+	myWriter.Write("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n<testsuite name=\"simpletest\"");
+	myCounts = myWriter.Tell();
+	myWriter.Write(locJUnitCountSpace);
+	myWriter.Write(">\n");
+}
+void TestJUnitReporter::EndTest(TestFixture const& test)
+{
+	++myNumReported;
+	myNumFailed += test.NumErrors() != 0;
+
+	myWriter.Write("<testcase classname=\"");
+	locWriteXml(myWriter, test.TestGroup());
+	myWriter.Write("\" name=\"");
+	locWriteXml(myWriter, test.TestName());
+	myWriter.Printf("\" time=\"%.6f\"", test.GetDuration());
+
+	if (test.NumErrors() == 0 && test.GetFirstError() == nullptr)
+	{
+		myWriter.Write("/>\n");
+		return;
+	}
+
+	myWriter.Write(">\n");
+	if (test.NumErrors())
+		myWriter.Printf("<failure message=\"%d of %d assertions failed\" type=\"assertion\">", test.NumErrors(), test.NumTests());
+	else
+		myWriter.Write("<system-out>");
+
+	char buffer[ERROR_CHUNK_SIZE];
+	for (TestError const* err = test.GetFirstError(); err; err = err->next)
+	{
+		locWriteXml(myWriter, err->Text(buffer, sizeof(buffer)));
+		myWriter.Write("\n", 1);
+	}
+	locWriteCounts(myWriter, test, "%d more %s\n");
+
+	myWriter.Write(test.NumErrors() ? "</failure>\n</testcase>\n" : "</system-out>\n</testcase>\n");
+}
+void TestJUnitReporter::EndRun(int, int, int, bool)
+{
+	myWriter.Write("</testsuite>\n</testsuites>\n");
+
+	char counts[sizeof(locJUnitCountSpace)];
+	int length = snprintf(counts, sizeof(counts), " tests=\"%d\" failures=\"%d\"", myNumReported, myNumFailed);
+	if (length > 0 && size_t(length) < sizeof(counts))
+		myWriter.Patch(myCounts, counts, size_t(length));
+	myWriter.Flush();
+}
+
+//---------------------------------------------------------------------------------
+// JSON Lines
+//---------------------------------------------------------------------------------
+static void locWriteTestName(TestWriter& writer, char const* event, TestFixture const& test)
+{
+	writer.Printf("{\"event\":\"%s\",\"group\":", event);
+	locWriteJson(writer, test.TestGroup());
+	writer.Write(",\"name\":");
+	locWriteJson(writer, test.TestName());
+}
+void TestJsonReporter::BeginRun(int numTests)
+{
+	myWriter.Printf("{\"event\":\"begin_run\",\"tests\":%d}\n", numTests);
+}
+void TestJsonReporter::BeginTest(TestFixture const& test)
+{
+	locWriteTestName(myWriter, "begin_test", test);
+	myWriter.Write("}\n");
+}
+void TestJsonReporter::EndTest(TestFixture const& test)
+{
+	locWriteTestName(myWriter, "end_test", test);
+	myWriter.Printf(",\"passed\":%s,\"checks\":%d,\"errors\":%d,\"duration\":%.9g,\"dropped\":%d,\"unlogged\":%d,\"messages\":[",
+		test.NumErrors() ? "false" : "true", test.NumTests(), test.NumErrors(), test.GetDuration(), test.NumDroppedMessages(), test.NumUnloggedFailures());
+
+	char buffer[ERROR_CHUNK_SIZE];
+	for (TestError const* err = test.GetFirstError(); err; err = err->next)
+	{
+		if (err != test.GetFirstError())
+			myWriter.Write(",", 1);
+		locWriteJson(myWriter, err->Text(buffer, sizeof(buffer)));
+	}
+	myWriter.Write("]}\n");
+}
+void TestJsonReporter::EndRun(int numTests, int numChecks, int numErrors, bool passed)
+{
+	myWriter.Printf("{\"event\":\"end_run\",\"tests\":%d,\"checks\":%d,\"errors\":%d,\"passed\":%s}\n", numTests, numChecks, numErrors, passed ? "true" : "false");
+	myWriter.Flush();
+}
+
+//---------------------------------------------------------------------------------
+// TAP
+//---------------------------------------------------------------------------------
+void TestTapReporter::BeginRun(int)
+{
+	myNumReported = 0;
+	myWriter.Write("TAP version 13\n");
+}
+void TestTapReporter::EndTest(TestFixture const& test)
+{
+	// '#' starts a directive in a description, so it's swapped out
+	char name[256];
+	snprintf(name, sizeof(name), "%s/%s", test.TestGroup(), test.TestName());
+	for (char* c = name; *c; ++c)
+	{
+		if (*c == '#')
+			*c = '_';
+	}
+
+	myWriter.Printf("%s %d - %s\n", test.NumErrors() ? "not ok" : "ok", ++myNumReported, name);
+	if (test.NumErrors() == 0)
+		return;
+
+	myWriter.Printf("  ---\n  checks: %d\n  errors: %d\n  duration: %.9g\n  messages:\n", test.NumTests(), test.NumErrors(), test.GetDuration());
+
+	char buffer[ERROR_CHUNK_SIZE];
+	for (TestError const* err = test.GetFirstError(); err; err = err->next)
+	{
+		myWriter.Write("    - |\n");
+		locWriteIndented(myWriter, err->Text(buffer, sizeof(buffer)), "      ");
+	}
+	locWriteCounts(myWriter, test, "  # %d more %s\n");
+	myWriter.Write("  ...\n");
+}
+void TestTapReporter::EndRun(int numTests, int numChecks, int numErrors, bool)
+{
+	myWriter.Printf("1..%d\n# %d tests, %d of %d assertions failed\n", myNumReported, numTests, numErrors, numChecks);
+	myWriter.Flush();
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "simpletest.h"
+
+//---------------------------------------------------------------------------------
+// Optional structured reporters for CI, writing JUnit XML, JSON Lines or TAP.
+// Hand them to ExecuteOptions::reporter, chaining more than one through myNext.
+// Output is buffered in the reporter and written straight to a file descriptor
+// in REPORT_BUFFER_SIZE pieces, so reporters don't allocate or truncate anything.
+//---------------------------------------------------------------------------------
+#if !defined(REPORT_BUFFER_SIZE)
+#define REPORT_BUFFER_SIZE 64 * 1024 // bytes each reporter collects before writing them out
+#endif
+
+//---------------------------------------------------------------------------------
+// Buffered writes to a file descriptor, either one it's given or a file it creates
+//---------------------------------------------------------------------------------
+struct TestWriter
+{
+	explicit TestWriter(int fd);
+	explicit TestWriter(char const* path);
+	~TestWriter();
+	TestWriter(TestWriter const&) = delete;
+	TestWriter& operator=(TestWriter const&) = delete;
+
+	bool IsOpen() const { return myFd >= 0; }
+
+	void Write(char const* data, size_t size);
+	void Write(char const* string);
+	void Printf(char const* format, ...); // for short formatted pieces, anything bigger than the buffer is cut short
+	bool Flush();
+
+	// Bytes written so far, a position that can be overwritten later with Patch
+	long long Tell() const { return myFlushed + (long long)myUsed; }
+	// Overwrite what was written at a position, only works while it's still buffered or for files that can seek
+	bool Patch(long long position, char const* data, size_t size);
+
+private:
+	int myFd;
+	bool myOwned;
+	bool myFailed;
+	long long myStart; // where the descriptor was when the writer got it, -1 when it can't seek
+	long long myFlushed;
+	size_t myUsed;
+	char myBuffer[REPORT_BUFFER_SIZE];
+};
+
+//---------------------------------------------------------------------------------
+// One testcase per test with its group as the class name. Failure messages go in
+// the failure and the messages of passing tests in system-out. The counts on the
+// testsuite are of the tests that were reported, so they're filled into space
+// left for them once the run ends, pipes that can't seek back leave them out.
+//---------------------------------------------------------------------------------
+struct TestJUnitReporter : TestReporter
+{
+	explicit TestJUnitReporter(char const* path) : myWriter(path) {}
+	explicit TestJUnitReporter(int fd) : myWriter(fd) {}
+
+	void BeginRun(int numTests) override;
+	void EndTest(TestFixture const& test) override;
+	void EndRun(int numTests, int numChecks, int numErrors, bool passed) override;
+
+private:
+	TestWriter myWriter;
+	long long myCounts = -1;
+	int myNumReported = 0;
+	int myNumFailed = 0;
+};
+
+//---------------------------------------------------------------------------------
+// One JSON object per line for every event, told apart by their "event" field
+//---------------------------------------------------------------------------------
+struct TestJsonReporter : TestReporter
+{
+	explicit TestJsonReporter(char const* path) : myWriter(path) {}
+	explicit TestJsonReporter(int fd) : myWriter(fd) {}
+
+	void BeginRun(int numTests) override;
+	void BeginTest(TestFixture const& test) override;
+	void EndTest(TestFixture const& test) override;
+	void EndRun(int numTests, int numChecks, int numErrors, bool passed) override;
+
+private:
+	TestWriter myWriter;
+};
+
+//---------------------------------------------------------------------------------
+// TAP version 13, with a YAML block holding the counts and messages of failures.
+// The plan comes last so it matches the tests reported when a run stops early.
+//---------------------------------------------------------------------------------
+struct TestTapReporter : TestReporter
+{
+	explicit TestTapReporter(char const* path) : myWriter(path) {}
+	explicit TestTapReporter(int fd) : myWriter(fd) {}
+
+	void BeginRun(int numTests) override;
+	void EndTest(TestFixture const& test) override;
+	void EndRun(int numTests, int numChecks, int numErrors, bool passed) override;
+
+private:
+	TestWriter myWriter;
+	int myNumReported = 0;
+};
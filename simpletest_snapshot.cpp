@@ -0,0 +1,231 @@
+#include "simpletest_snapshot.h"
+#include <stdio.h>
+#include <string.h>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static char const* locDirectory;
+static bool locUpdate;
+static std::atomic<int> locNumUpdated;
+static std::atomic<int> locNumTemporaries; // keeps temporary names unique between threads
+
+//---------------------------------------------------------------------------------
+// Mapping. Empty files can't be mapped but are still open, they just have no data.
+//---------------------------------------------------------------------------------
+#if defined(_WIN32)
+bool TestMappedFile::Open(char const* path)
+{
+	Close();
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	myFile = file;
+	myOpen = true;
+	if (size.QuadPart == 0)
+		return true;
+
+	myMapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	myData = myMapping ? MapViewOfFile(myMapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (myData == nullptr)
+	{
+		Close();
+		return false;
+	}
+
+	mySize = size_t(size.QuadPart);
+	return true;
+}
+void TestMappedFile::Close()
+{
+	if (myData)
+		UnmapViewOfFile(myData);
+	if (myMapping)
+		CloseHandle(myMapping);
+	if (myFile)
+		CloseHandle(myFile);
+
+	myData = nullptr;
+	myMapping = nullptr;
+	myFile = nullptr;
+	mySize = 0;
+	myOpen = false;
+}
+#else
+bool TestMappedFile::Open(char const* path)
+{
+	Close();
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	// the mapping keeps the file alive, so the descriptor can go straight away
+	void* data = info.st_size ? mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	if (data)
+		madvise(data, size_t(info.st_size), MADV_SEQUENTIAL);
+
+	myData = data;
+	mySize = size_t(info.st_size);
+	myOpen = true;
+	return true;
+}
+void TestMappedFile::Close()
+{
+	if (myData)
+		munmap(myData, mySize);
+
+	myData = nullptr;
+	mySize = 0;
+	myOpen = false;
+}
+#endif
+
+//---------------------------------------------------------------------------------
+// Golden files are written next to themselves and renamed into place
+//---------------------------------------------------------------------------------
+static bool locWriteGolden(char const* path, void const* data, size_t size)
+{
+	char temporary[SNAPSHOT_PATH_LENGTH + 32];
+#if defined(_WIN32)
+	snprintf(temporary, sizeof(temporary), "%s.%lu.%d.tmp", path, GetCurrentProcessId(), locNumTemporaries.fetch_add(1));
+#else
+	snprintf(temporary, sizeof(temporary), "%s.%d.%d.tmp", path, (int)getpid(), locNumTemporaries.fetch_add(1));
+#endif
+
+	FILE* file = fopen(temporary, "wb");
+	if (file == nullptr)
+		return false;
+
+	bool written = fwrite(data, 1, size, file) == size && fflush(file) == 0;
+#if !defined(_WIN32)
+	written = written && fsync(fileno(file)) == 0;
+#endif
+	written = fclose(file) == 0 && written;
+
+#if defined(_WIN32)
+	written = written && MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+	written = written && rename(temporary, path) == 0;
+#endif
+
+	if (!written)
+		remove(temporary);
+	return written;
+}
+
+// Same check git uses to tell binary files from text
+static bool locIsBinary(char const* data, size_t size)
+{
+	return memchr(data, 0, size < 8000 ? size : 8000) != nullptr;
+}
+
+//---------------------------------------------------------------------------------
+void TestSnapshot::SetDirectory(char const* directory)
+{
+	locDirectory = directory;
+}
+void TestSnapshot::SetUpdate(bool update)
+{
+	locUpdate = update;
+}
+bool TestSnapshot::IsUpdating()
+{
+	return locUpdate;
+}
+int TestSnapshot::NumUpdated()
+{
+	return locNumUpdated.load(std::memory_order_relaxed);
+}
+
+bool TestSnapshot::Check(TestFixture& test, char const* path, void const* data, size_t size, char const* prefix, char const* condition)
+{
+	char fullPath[SNAPSHOT_PATH_LENGTH];
+	int length = locDirectory && locDirectory[0] ? snprintf(fullPath, sizeof(fullPath), "%s/%s", locDirectory, path) : snprintf(fullPath, sizeof(fullPath), "%s", path);
+	if (length < 0 || size_t(length) >= sizeof(fullPath))
+	{
+		test.AddTest();
+		test.AddError();
+		if (test.ShouldLogFailure())
+			test.LogMessage(prefix, condition, "Path is longer than SNAPSHOT_PATH_LENGTH");
+		return false;
+	}
+
+	TestMappedFile golden;
+	bool matches = golden.Open(fullPath) && golden.Size() == size && TestFindMismatch(golden.Data(), data, size, 0) == size;
+	if (matches)
+	{
+		test.AddTest();
+		return true;
+	}
+
+	if (locUpdate)
+	{
+		golden.Close();
+		test.AddTest();
+		if (!locWriteGolden(fullPath, data, size))
+		{
+			test.AddError();
+			if (test.ShouldLogFailure())
+				test.LogMessage(prefix, condition, "Failed to write golden file");
+			return false;
+		}
+
+		++locNumUpdated;
+		test.LogMessage("Updated golden file '%s'", fullPath);
+		return true;
+	}
+
+	if (!golden.IsOpen())
+	{
+		test.AddTest();
+		test.AddError();
+		if (test.ShouldLogFailure())
+			test.LogMessage(prefix, condition, "Golden file is missing, run in update mode to create it");
+		return false;
+	}
+
+	char const* candidate = (char const*)data;
+	if (!locIsBinary(golden.Data(), golden.Size()) && !locIsBinary(candidate, size))
+		return test.TestStrings(golden.Data(), golden.Size(), candidate, size, prefix, condition);
+
+	if (golden.Size() == size)
+		return test.TestMemory(golden.Data(), candidate, size, prefix, condition);
+
+	size_t shortest = golden.Size() < size ? golden.Size() : size;
+	char message[160];
+	snprintf(message, sizeof(message), "Golden file is %llu bytes but the data is %llu, first difference at offset 0x%llx",
+		(unsigned long long)golden.Size(), (unsigned long long)size, (unsigned long long)TestFindMismatch(golden.Data(), candidate, shortest, 0));
+
+	test.AddTest();
+	test.AddError();
+	if (test.ShouldLogFailure())
+		test.LogMessage(prefix, condition, message);
+	return false;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "simpletest.h"
+#include <string.h>
+
+//---------------------------------------------------------------------------------
+// Optional golden file snapshots. Golden files are memory mapped and compared in
+// place, so even huge ones are never copied. Text is reported the same way as
+// TEST_STR_EQ_LEN and anything with nulls near the start as hex like TEST_MEM_EQ.
+// In update mode golden files that are missing or differ are rewritten instead
+// of failing. Each one is written to a temporary file that's renamed over the old
+// one, so an interrupted run never leaves half a golden file behind.
+//---------------------------------------------------------------------------------
+#if !defined(SNAPSHOT_PATH_LENGTH)
+#define SNAPSHOT_PATH_LENGTH 1024 // longest path to a golden file, directory included
+#endif
+
+//---------------------------------------------------------------------------------
+// Read only view of a whole file
+//---------------------------------------------------------------------------------
+struct TestMappedFile
+{
+	TestMappedFile() = default;
+	~TestMappedFile() { Close(); }
+	TestMappedFile(TestMappedFile const&) = delete;
+	TestMappedFile& operator=(TestMappedFile const&) = delete;
+
+	bool Open(char const* path);
+	void Close();
+
+	bool IsOpen() const { return myOpen; }
+	char const* Data() const { return (char const*)myData; }
+	size_t Size() const { return mySize; }
+
+private:
+	void* myData = nullptr;
+	size_t mySize = 0;
+	bool myOpen = false;
+#if defined(_WIN32)
+	void* myFile = nullptr;
+	void* myMapping = nullptr;
+#endif
+};
+
+struct TestSnapshot
+{
+	// Golden files are relative to this directory, the working directory by default. The string must outlive the run.
+	static void SetDirectory(char const* directory);
+
+	// Rewrite golden files that are missing or differ instead of failing
+	static void SetUpdate(bool update);
+	static bool IsUpdating();
+
+	// Golden files written by update mode so far
+	static int NumUpdated();
+
+	// Compare data against a golden file, counts as one assertion
+	static bool Check(TestFixture& test, char const* path, void const* data, size_t size, char const* prefix, char const* condition);
+};
+
+#define TEST_SNAPSHOT(path, data, size) do { if(TEST_UNLIKELY(!TestSnapshot::Check(*test_scope_.Fixture(), path, data, size, TEST_ERROR_PREFIX_ "%s", STR(data) " matches snapshot " STR(path)))) { ERROR_ACTION; } } while(0)
+#define TEST_SNAPSHOT_STR(path, string) TEST_SNAPSHOT(path, string, strlen(string))
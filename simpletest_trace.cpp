@@ -0,0 +1,263 @@
+#include "simpletest_trace.h"
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+//---------------------------------------------------------------------------------
+// Event storage. Blocks are handed out from a single counter and only ever
+// written by the thread that claimed them.
+//---------------------------------------------------------------------------------
+struct TestTraceEvent
+{
+	char const* name;
+	char const* category;
+	unsigned long long time;
+	unsigned long long id; // async spans only
+	char phase;
+};
+
+struct TestTraceBlock
+{
+	std::atomic<int> count;
+	int thread;
+	TestTraceEvent events[TRACE_BLOCK_EVENTS];
+};
+
+static_assert(TRACE_EVENTS >= TRACE_BLOCK_EVENTS, "TRACE_EVENTS must hold at least one block");
+
+static TestTraceBlock locBlocks[TRACE_EVENTS / TRACE_BLOCK_EVENTS];
+static std::atomic<int> locNumBlocks;
+static std::atomic<int> locNumThreads;
+static std::atomic<long long> locNumDropped;
+static std::atomic<unsigned> locGeneration; // bumped by Clear so threads let go of their blocks
+
+static thread_local TestTraceBlock* locBlock;
+static thread_local unsigned locBlockGeneration;
+static thread_local int locThread = -1;
+
+//---------------------------------------------------------------------------------
+// Spans are kept whole when the buffer runs out. Every recorded B or b keeps a
+// slot free in its thread's block for the event that ends it, and a B that
+// doesn't fit is dropped along with its E, which nest so the next unmatched E
+// is the one to drop. An e without a b is harmless, viewers skip them.
+//---------------------------------------------------------------------------------
+static thread_local int locNumOpen;
+static thread_local int locNumOpenAsync;
+static thread_local int locNumDroppedOpen;
+
+static bool locKeepEnd(char phase)
+{
+	if (phase == 'e')
+	{
+		locNumOpenAsync -= locNumOpenAsync > 0;
+		return true;
+	}
+
+	if (locNumDroppedOpen || locNumOpen == 0)
+	{
+		locNumDroppedOpen -= locNumDroppedOpen > 0;
+		return false;
+	}
+	--locNumOpen;
+	return true;
+}
+
+static void locRecord(char const* name, char const* category, char phase, unsigned long long id = 0)
+{
+	unsigned long long time = TestClock::Now();
+
+	unsigned generation = locGeneration.load(std::memory_order_relaxed);
+	if (locBlockGeneration != generation)
+	{
+		// spans begun before a Clear are gone, so are the slots kept for them
+		locBlock = nullptr;
+		locBlockGeneration = generation;
+		locNumOpen = locNumOpenAsync = locNumDroppedOpen = 0;
+	}
+
+	bool begins = phase == 'B' || phase == 'b';
+	if (!begins && !locKeepEnd(phase))
+	{
+		locNumDropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	// a begin needs a slot for itself and one for its end on top of those already kept
+	int needed = begins ? locNumOpen + locNumOpenAsync + 2 : 1;
+	TestTraceBlock* block = locBlock;
+	if (block == nullptr || TRACE_BLOCK_EVENTS - block->count.load(std::memory_order_relaxed) < needed)
+	{
+		int index = needed <= TRACE_BLOCK_EVENTS ? locNumBlocks.fetch_add(1, std::memory_order_relaxed) : INT_MAX;
+		if (index >= int(sizeof(locBlocks) / sizeof(locBlocks[0])))
+		{
+			if (index != INT_MAX)
+				locNumBlocks.fetch_sub(1, std::memory_order_relaxed);
+			locNumDropped.fetch_add(1, std::memory_order_relaxed);
+			locNumDroppedOpen += phase == 'B';
+			return;
+		}
+
+		if (locThread < 0)
+			locThread = locNumThreads.fetch_add(1, std::memory_order_relaxed);
+
+		block = &locBlocks[index];
+		block->thread = locThread;
+		block->count.store(0, std::memory_order_relaxed);
+		locBlock = block;
+	}
+
+	int count = block->count.load(std::memory_order_relaxed);
+	TestTraceEvent& event = block->events[count];
+	event.name = name;
+	event.category = category;
+	event.time = time;
+	event.id = id;
+	event.phase = phase;
+	block->count.store(count + 1, std::memory_order_release);
+
+	locNumOpen += phase == 'B';
+	locNumOpenAsync += phase == 'b';
+}
+
+void TestTrace::Begin(char const* name, char const* category)
+{
+	locRecord(name, category, 'B');
+}
+void TestTrace::End(char const* name, char const* category)
+{
+	locRecord(name, category, 'E');
+}
+void TestTrace::BeginAsync(char const* name, char const* category, unsigned long long id)
+{
+	locRecord(name, category, 'b', id);
+}
+void TestTrace::EndAsync(char const* name, char const* category, unsigned long long id)
+{
+	locRecord(name, category, 'e', id);
+}
+long long TestTrace::NumDropped()
+{
+	return locNumDropped.load(std::memory_order_relaxed);
+}
+void TestTrace::Clear()
+{
+	locNumBlocks.store(0, std::memory_order_relaxed);
+	locNumDropped.store(0, std::memory_order_relaxed);
+	locGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+
+//---------------------------------------------------------------------------------
+// Chrome trace event format, timestamps are in microseconds
+//---------------------------------------------------------------------------------
+static void locWriteString(FILE* file, char const* string)
+{
+	fputc('"', file);
+	for (; *string; ++string)
+	{
+		unsigned char c = (unsigned char)*string;
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+	fputc('"', file);
+}
+bool TestTrace::Write(char const* path)
+{
+	FILE* file = fopen(path, "w");
+	if (file == nullptr)
+		return false;
+
+	int numBlocks = locNumBlocks.load(std::memory_order_acquire);
+	if (numBlocks > int(sizeof(locBlocks) / sizeof(locBlocks[0])))
+		numBlocks = int(sizeof(locBlocks) / sizeof(locBlocks[0]));
+
+	unsigned long long start = ~0ull;
+	for (int i = 0; i < numBlocks; ++i)
+	{
+		if (locBlocks[i].count.load(std::memory_order_acquire) > 0 && locBlocks[i].events[0].time < start)
+			start = locBlocks[i].events[0].time;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	int numThreads = locNumThreads.load(std::memory_order_relaxed);
+	for (int i = 0; i < numThreads; ++i)
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Thread %d\"}}", i ? ",\n" : "", i, i);
+
+	bool first = numThreads == 0;
+	for (int i = 0; i < numBlocks; ++i)
+	{
+		TestTraceBlock const& block = locBlocks[i];
+		int count = block.count.load(std::memory_order_acquire);
+		for (int e = 0; e < count; ++e)
+		{
+			TestTraceEvent const& event = block.events[e];
+			fprintf(file, "%s{\"name\":", first ? "" : ",\n");
+			locWriteString(file, event.name);
+			fprintf(file, ",\"cat\":");
+			locWriteString(file, event.category);
+			fprintf(file, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", event.phase, TestClock::ToSeconds(event.time - start) * 1e6, block.thread);
+			if (event.phase == 'b' || event.phase == 'e')
+				fprintf(file, ",\"id\":\"0x%llx\"", event.id);
+			fputc('}', file);
+			first = false;
+		}
+	}
+
+	fprintf(file, "\n]}\n");
+	return fclose(file) == 0;
+}
+
+//---------------------------------------------------------------------------------
+static char const* const locPhaseNames[] = { "Setup", "RunTest", "TearDown" };
+
+TestTraceHook::~TestTraceHook()
+{
+	if (myPath && !TestTrace::Write(myPath))
+		TestFixture::Printf("Failed to write trace to '%s'.\n", myPath);
+	if (TestTrace::NumDropped())
+		TestFixture::Printf("%lld trace events were dropped, TRACE_EVENTS is too small.\n", TestTrace::NumDropped());
+}
+void TestTraceHook::BeginPhase(TestFixture& test, TestPhase phase)
+{
+	if (test.GetBenchmark())
+		return;
+
+	if (phase == TestPhaseSetup)
+		TestTrace::Begin(test.TestName(), test.TestGroup());
+	TestTrace::Begin(locPhaseNames[phase], "simpletest");
+}
+void TestTraceHook::EndPhase(TestFixture& test, TestPhase phase)
+{
+	if (test.GetBenchmark())
+		return;
+
+	TestTrace::End(locPhaseNames[phase], "simpletest");
+	if (phase == TestPhaseTearDown)
+		TestTrace::End(test.TestName(), test.TestGroup());
+}
+void TestTraceHook::BeginOverlappedPhase(TestFixture& test, TestPhase phase)
+{
+	if (test.GetBenchmark())
+		return;
+
+	// the phases share the test's category so they nest under it
+	unsigned long long id = (unsigned long long)(uintptr_t)&test;
+	if (phase == TestPhaseSetup)
+		TestTrace::BeginAsync(test.TestName(), test.TestGroup(), id);
+	TestTrace::BeginAsync(locPhaseNames[phase], test.TestGroup(), id);
+}
+void TestTraceHook::EndOverlappedPhase(TestFixture& test, TestPhase phase)
+{
+	if (test.GetBenchmark())
+		return;
+
+	unsigned long long id = (unsigned long long)(uintptr_t)&test;
+	TestTrace::EndAsync(locPhaseNames[phase], test.TestGroup(), id);
+	if (phase == TestPhaseTearDown)
+		TestTrace::EndAsync(test.TestName(), test.TestGroup(), id);
+}
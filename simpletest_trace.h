@@ -0,0 +1,69 @@
+#pragma once
+
+#include "simpletest.h"
+
+//---------------------------------------------------------------------------------
+// Optional execution tracing. Events are recorded into static blocks claimed by
+// each thread, so recording never locks or allocates, and are written out as a
+// Chrome trace event file that Perfetto or chrome://tracing can open. Names are
+// stored by pointer and must outlive the trace, i.e. string literals.
+// Events from worker processes aren't collected, trace with threads instead.
+//---------------------------------------------------------------------------------
+#if !defined(TRACE_EVENTS)
+#define TRACE_EVENTS 256 * 1024 // total events that can be recorded before new ones are dropped
+#endif
+#if !defined(TRACE_BLOCK_EVENTS)
+#define TRACE_BLOCK_EVENTS 1024 // events a thread claims at a time
+#endif
+
+struct TestTrace
+{
+	static void Begin(char const* name, char const* category);
+	static void End(char const* name, char const* category);
+
+	// Spans that other work interleaves with on the same thread, i.e. async tests. Spans
+	// with the same category and id nest, whichever thread records them.
+	static void BeginAsync(char const* name, char const* category, unsigned long long id);
+	static void EndAsync(char const* name, char const* category, unsigned long long id);
+
+	// Write everything recorded so far, only call this while no tests are running
+	static bool Write(char const* path);
+	static void Clear();
+
+	// Events that didn't fit in TRACE_EVENTS
+	static long long NumDropped();
+};
+
+//---------------------------------------------------------------------------------
+// Records a zone from construction to the end of the scope
+//---------------------------------------------------------------------------------
+struct TestTraceZone
+{
+	explicit TestTraceZone(char const* name) : myName(name) { TestTrace::Begin(name, "zone"); }
+	~TestTraceZone() { TestTrace::End(myName, "zone"); }
+
+private:
+	char const* myName;
+};
+
+#define TEST_TRACE_SCOPE(name) TestTraceZone TOK(test_trace_zone_, __LINE__)(name)
+
+//---------------------------------------------------------------------------------
+// Declare a static instance to trace every test and its Setup, RunTest and
+// TearDown. When given a path the trace is written there on exit. Overlapped
+// tests are traced as async spans keyed by the fixture, in the test's group.
+// Benchmarks are left alone.
+//---------------------------------------------------------------------------------
+struct TestTraceHook : TestHook
+{
+	explicit TestTraceHook(char const* path = nullptr) : myPath(path) {}
+	~TestTraceHook();
+
+	void BeginPhase(TestFixture& test, TestPhase phase) override;
+	void EndPhase(TestFixture& test, TestPhase phase) override;
+	void BeginOverlappedPhase(TestFixture& test, TestPhase phase) override;
+	void EndOverlappedPhase(TestFixture& test, TestPhase phase) override;
+
+private:
+	char const* myPath;
+};